@@ -0,0 +1,22 @@
+#! /bin/bash
+
+# Compares two result files written by run-benchmarks.sh, e.g., before and after a change.
+
+set -e
+
+if [ $# -ne 2 ]; then
+    echo "Usage: $0 OLD_RESULTS NEW_RESULTS" >&2
+    exit 2
+fi
+
+awk -F '\t' '
+    /^#/ { next }
+    FNR == NR { old[$1] = $2; next }
+    {
+        change = "";
+        if ($1 in old && old[$1] > 0) {
+            change = sprintf("%+.1f%%", ($2 - old[$1]) * 100 / old[$1]);
+        }
+        printf "%-36s %12s %12s %10s %s\n", $1, ($1 in old ? old[$1] : "-"), $2, change, $3;
+    }
+' "$1" "$2"
@@ -0,0 +1,220 @@
+#! /bin/bash
+
+# Generates tiny type 1 and type 2 AppImages offline, plus a tree mixing them with
+# files which aren't AppImages, for the benchmarks.
+#
+# Output layout:
+#   OUT_DIR/templates/type1-<n>.AppImage, type2-<n>.AppImage, noise-<n>
+#   OUT_DIR/tree/...  (copies of the templates, spread over subdirectories)
+
+set -e
+
+usage() {
+    cat >&2 <<EOF
+Usage: $0 [options] OUT_DIR
+  --type1 N      number of type 1 AppImages in the tree (default: 50)
+  --type2 N      number of type 2 AppImages in the tree (default: 200)
+  --noise N      number of other files in the tree (default: 2000)
+  --depth D      depth of the directory tree (default: 4)
+  --fanout F     number of subdirectories per directory (default: 4)
+  --variants V   number of distinct AppImages of each type (default: 8)
+  --seed S       seed for the sizes and placement of the files (default: 1)
+EOF
+    exit 2
+}
+
+N_TYPE1=50
+N_TYPE2=200
+N_NOISE=2000
+DEPTH=4
+FANOUT=4
+VARIANTS=8
+SEED=1
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --type1) N_TYPE1="$2"; shift 2 ;;
+        --type2) N_TYPE2="$2"; shift 2 ;;
+        --noise) N_NOISE="$2"; shift 2 ;;
+        --depth) DEPTH="$2"; shift 2 ;;
+        --fanout) FANOUT="$2"; shift 2 ;;
+        --variants) VARIANTS="$2"; shift 2 ;;
+        --seed) SEED="$2"; shift 2 ;;
+        -*) usage ;;
+        *) OUT_DIR="$1"; shift ;;
+    esac
+done
+
+if [ "$OUT_DIR" == "" ]; then
+    usage
+fi
+
+# any small ELF binary does as a runtime, the AppImages are never executed
+RUNTIME_SOURCE=$(readlink -f "$(type -P true)")
+
+# 1x1 transparent PNG
+ICON_BASE64="iVBORw0KGgoAAAANSUhEUgAAAAEAAAABCAYAAAAfFcSJAAAADUlEQVR42mNkYPhfDwAChwGA60e6kgAAAABJRU5ErkJggg=="
+
+# make the squashfs and ISO images reproducible
+export SOURCE_DATE_EPOCH=0
+
+TEMPLATES_DIR="$OUT_DIR"/templates
+TREE_DIR="$OUT_DIR"/tree
+rm -rf "$TEMPLATES_DIR" "$TREE_DIR"
+mkdir -p "$TEMPLATES_DIR" "$TREE_DIR"
+
+BUILD_DIR=$(mktemp -d -p "${TMPDIR:-/tmp}" appimaged-fixtures-XXXXXX)
+
+cleanup () {
+    if [ -d "$BUILD_DIR" ]; then
+        rm -rf "$BUILD_DIR"
+    fi
+}
+
+trap cleanup EXIT
+
+# write the bytes given as printf escapes to file at offset
+patch_bytes() {
+    printf "$3" | dd of="$1" bs=1 seek="$2" conv=notrunc status=none
+}
+
+make_appdir() {
+    local appdir="$1"
+    local name="$2"
+    local with_mime="$3"
+
+    mkdir -p "$appdir"
+
+    cat > "$appdir"/AppRun <<EOF
+#! /bin/sh
+echo "$name"
+EOF
+    chmod +x "$appdir"/AppRun
+
+    cat > "$appdir"/"$name".desktop <<EOF
+[Desktop Entry]
+Type=Application
+Name=$name
+Exec=AppRun %F
+Icon=$name
+Categories=Utility;
+EOF
+
+    echo "$ICON_BASE64" | base64 -d > "$appdir"/"$name".png
+    ln -s "$name".png "$appdir"/.DirIcon
+
+    if [ "$with_mime" == "1" ]; then
+        mkdir -p "$appdir"/usr/share/mime/packages
+        cat > "$appdir"/usr/share/mime/packages/"$name".xml <<EOF
+<?xml version="1.0" encoding="UTF-8"?>
+<mime-info xmlns="http://www.freedesktop.org/standards/shared-mime-info">
+  <mime-type type="application/x-$name">
+    <comment>$name document</comment>
+    <glob pattern="*.$name"/>
+  </mime-type>
+</mime-info>
+EOF
+        sed -i "s|^Categories=.*|&\nMimeType=application/x-$name;|" "$appdir"/"$name".desktop
+    fi
+}
+
+make_type2() {
+    local name="$1"
+    local appdir="$BUILD_DIR"/"$name".AppDir
+
+    make_appdir "$appdir" "$name" "$2"
+    mksquashfs "$appdir" "$BUILD_DIR"/"$name".squashfs -root-owned -noappend -quiet >/dev/null
+
+    # the squashfs image starts right after the section headers, which are at the end of the runtime
+    cp "$RUNTIME_SOURCE" "$BUILD_DIR"/"$name".runtime
+    patch_bytes "$BUILD_DIR"/"$name".runtime 8 'AI\x02'
+    cat "$BUILD_DIR"/"$name".runtime "$BUILD_DIR"/"$name".squashfs > "$TEMPLATES_DIR"/"$name".AppImage
+    chmod +x "$TEMPLATES_DIR"/"$name".AppImage
+}
+
+make_type1() {
+    local name="$1"
+    local appdir="$BUILD_DIR"/"$name".AppDir
+
+    make_appdir "$appdir" "$name" "$2"
+    "$MKISOFS" -R -J -quiet -o "$TEMPLATES_DIR"/"$name".AppImage "$appdir"
+
+    # the system area in front of the ISO 9660 volume descriptors holds the runtime
+    patch_bytes "$TEMPLATES_DIR"/"$name".AppImage 0 '\x7fELF'
+    patch_bytes "$TEMPLATES_DIR"/"$name".AppImage 8 'AI\x01'
+    chmod +x "$TEMPLATES_DIR"/"$name".AppImage
+}
+
+if [ "$N_TYPE2" -gt 0 ] && ! command -v mksquashfs >/dev/null; then
+    echo "Warning: mksquashfs not found, not generating type 2 AppImages" >&2
+    N_TYPE2=0
+fi
+
+MKISOFS=""
+for candidate in genisoimage mkisofs xorrisofs; do
+    if command -v "$candidate" >/dev/null; then
+        MKISOFS="$candidate"
+        break
+    fi
+done
+if [ "$N_TYPE1" -gt 0 ] && [ "$MKISOFS" == "" ]; then
+    echo "Warning: neither genisoimage, mkisofs nor xorrisofs found, not generating type 1 AppImages" >&2
+    N_TYPE1=0
+fi
+
+# every other variant ships a MIME package, so that the MIME database is updated as well
+for i in $(seq 1 "$VARIANTS"); do
+    if [ "$N_TYPE1" -gt 0 ]; then
+        make_type1 type1-"$i" $((i % 2))
+    fi
+    if [ "$N_TYPE2" -gt 0 ]; then
+        make_type2 type2-"$i" $((i % 2))
+    fi
+done
+
+RANDOM="$SEED"
+
+# files the daemon has to look at and reject: plain ELF binaries, text and archives
+for i in $(seq 1 "$VARIANTS"); do
+    cp "$RUNTIME_SOURCE" "$TEMPLATES_DIR"/noise-elf-"$i"
+    yes "noise $i" | head -c $(( (RANDOM % 64 + 1) * 1024 )) > "$TEMPLATES_DIR"/noise-text-"$i".txt
+    yes "archive $i" | head -c $(( (RANDOM % 512 + 1) * 1024 )) | gzip -n > "$TEMPLATES_DIR"/noise-archive-"$i".tar.gz
+done
+
+# copy a template to a random directory at most DEPTH levels below the root of the tree
+# (no command substitution, RANDOM must advance in this shell to stay reproducible)
+place() {
+    local template="$1"
+    local target="$2"
+
+    local dir="$TREE_DIR"
+    local levels=$(( RANDOM % (DEPTH + 1) ))
+    for _ in $(seq 1 "$levels"); do
+        dir="$dir"/dir-$(( RANDOM % FANOUT ))
+    done
+
+    mkdir -p "$dir"
+    cp "$TEMPLATES_DIR"/"$template" "$dir"/"$target"
+}
+
+NOISE_TEMPLATES=($(cd "$TEMPLATES_DIR" && ls noise-*))
+
+for i in $(seq 1 "$N_TYPE1"); do
+    place type1-$(( (i - 1) % VARIANTS + 1 )).AppImage app-type1-"$i".AppImage
+done
+for i in $(seq 1 "$N_TYPE2"); do
+    place type2-$(( (i - 1) % VARIANTS + 1 )).AppImage app-type2-"$i".AppImage
+done
+for i in $(seq 1 "$N_NOISE"); do
+    template="${NOISE_TEMPLATES[$(( RANDOM % ${#NOISE_TEMPLATES[@]} ))]}"
+    place "$template" "$i"-"$template"
+done
+
+# read by run-benchmarks.sh, some types may have been skipped
+cat > "$OUT_DIR"/fixtures.env <<EOF
+N_TYPE1=$N_TYPE1
+N_TYPE2=$N_TYPE2
+N_NOISE=$N_NOISE
+EOF
+
+echo "Generated $N_TYPE1 type 1 and $N_TYPE2 type 2 AppImages and $N_NOISE other files in $TREE_DIR"
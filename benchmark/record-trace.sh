@@ -0,0 +1,90 @@
+#! /bin/bash
+
+# Records the file system activity below ROOT (e.g., while downloading a few files
+# with a browser) as a trace for replay-trace.sh, until interrupted with Ctrl+C.
+#
+# inotify doesn't tell what was written, so files are replayed with fixtures: an
+# AppImage if the recorded file was one, any other file otherwise. Moves are paired
+# by order, which is how inotifywait reports them.
+
+set -e
+
+if [ $# -ne 1 ]; then
+    echo "Usage: $0 ROOT > TRACE" >&2
+    exit 2
+fi
+
+ROOT=$(readlink -f "$1")
+
+if ! command -v inotifywait >/dev/null; then
+    echo "Error: inotifywait not found, please install inotify-tools" >&2
+    exit 1
+fi
+
+now_ms() {
+    local now="${EPOCHREALTIME/[.,]/}"
+    if [ "$now" == "" ]; then
+        now=$(( $(date +%s%N) / 1000 ))
+    fi
+    echo $(( now / 1000 ))
+}
+
+is_appimage() {
+    cmp -s -n 2 -i 8:0 "$1" <(printf "AI")
+}
+
+echo "# recorded below $ROOT on $(date -u "+%Y-%m-%d %H:%M:%S %Z")"
+
+last=$(now_ms)
+moved_from=""
+inotifywait -m -r -q --format '%e|%w%f' -e close_write,moved_from,moved_to,delete,create "$ROOT" |
+while IFS="|" read -r events path; do
+    now=$(now_ms)
+    delay=$(( now - last ))
+    relative="${path#$ROOT/}"
+
+    # a file moved out of ROOT is gone as far as the daemon is concerned
+    if [ "$moved_from" != "" ] && [ "${events#MOVED_TO}" == "$events" ]; then
+        echo "$delay remove $moved_from"
+        moved_from=""
+        delay=0
+        last="$now"
+    fi
+
+    line=""
+    case "$events" in
+        CREATE,ISDIR)
+            line="mkdir $relative"
+            ;;
+        CLOSE_WRITE*)
+            if is_appimage "$path"; then
+                line="copy $relative appimage"
+            else
+                line="copy $relative noise"
+            fi
+            ;;
+        MOVED_FROM*)
+            moved_from="$relative"
+            ;;
+        MOVED_TO*)
+            if [ "$moved_from" != "" ]; then
+                line="move $moved_from $relative"
+                moved_from=""
+            elif [ -d "$path" ]; then
+                line="mkdir $relative"
+            elif is_appimage "$path"; then
+                line="copy $relative appimage"
+            else
+                line="copy $relative noise"
+            fi
+            ;;
+        DELETE*)
+            line="remove $relative"
+            ;;
+    esac
+
+    if [ "$line" != "" ]; then
+        echo "$delay $line"
+        last="$now"
+    fi
+done
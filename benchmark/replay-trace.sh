@@ -0,0 +1,117 @@
+#! /bin/bash
+
+# Replays a file system event trace below ROOT, using the fixtures generated by
+# make-fixtures.sh as file contents.
+#
+# Every line of a trace is "<delay in ms> <operation> <arguments...>", paths are
+# relative to ROOT, empty lines and lines starting with # are ignored:
+#   mkdir DIR
+#   copy PATH TEMPLATE                       write the whole file at once
+#   download PATH TEMPLATE CHUNKS INTERVAL   append the file in CHUNKS parts, INTERVAL ms apart
+#   move OLD NEW
+#   remove PATH                              removes directories recursively
+#
+# TEMPLATE is either the name of a file in the templates directory, or "appimage" or
+# "noise" for the next AppImage or other file in turn.
+
+set -e
+
+if [ $# -ne 3 ]; then
+    echo "Usage: $0 TRACE ROOT TEMPLATES_DIR" >&2
+    exit 2
+fi
+
+TRACE="$1"
+ROOT="$2"
+TEMPLATES_DIR="$3"
+
+APPIMAGE_TEMPLATES=($(cd "$TEMPLATES_DIR" && ls *.AppImage 2>/dev/null))
+NOISE_TEMPLATES=($(cd "$TEMPLATES_DIR" && ls noise-*))
+next_appimage=0
+next_noise=0
+
+if [ ${#APPIMAGE_TEMPLATES[@]} -eq 0 ]; then
+    echo "Error: no AppImages in $TEMPLATES_DIR" >&2
+    exit 1
+fi
+
+# sets template to the file to use for the name given in a trace
+resolve_template() {
+    case "$1" in
+        appimage)
+            template="$TEMPLATES_DIR"/"${APPIMAGE_TEMPLATES[$next_appimage]}"
+            next_appimage=$(( (next_appimage + 1) % ${#APPIMAGE_TEMPLATES[@]} ))
+            ;;
+        noise)
+            template="$TEMPLATES_DIR"/"${NOISE_TEMPLATES[$next_noise]}"
+            next_noise=$(( (next_noise + 1) % ${#NOISE_TEMPLATES[@]} ))
+            ;;
+        *)
+            template="$TEMPLATES_DIR"/"$1"
+            ;;
+    esac
+}
+
+sleep_ms() {
+    if [ "$1" -gt 0 ]; then
+        sleep "$(printf "%d.%03d" $(( $1 / 1000 )) $(( $1 % 1000 )))"
+    fi
+}
+
+download() {
+    local path="$1"
+    local chunks="$3"
+    local interval="$4"
+
+    resolve_template "$2"
+    local size
+    size=$(stat -c %s "$template")
+    local chunk_size=$(( (size + chunks - 1) / chunks ))
+
+    : > "$path"
+    for i in $(seq 0 $(( chunks - 1 ))); do
+        dd if="$template" bs="$chunk_size" skip="$i" count=1 status=none >> "$path"
+        if [ "$i" -lt $(( chunks - 1 )) ]; then
+            sleep_ms "$interval"
+        fi
+    done
+}
+
+n_operations=0
+line_number=0
+while read -r delay operation arguments; do
+    line_number=$(( line_number + 1 ))
+    if [ "$delay" == "" ] || [ "${delay:0:1}" == "#" ]; then
+        continue
+    fi
+
+    sleep_ms "$delay"
+
+    set -- $arguments
+    case "$operation" in
+        mkdir)
+            mkdir -p "$ROOT"/"$1"
+            ;;
+        copy)
+            resolve_template "$2"
+            cp "$template" "$ROOT"/"$1"
+            ;;
+        download)
+            download "$ROOT"/"$1" "$2" "$3" "$4"
+            ;;
+        move)
+            mv "$ROOT"/"$1" "$ROOT"/"$2"
+            ;;
+        remove)
+            rm -rf "$ROOT"/"$1"
+            ;;
+        *)
+            echo "Error: unknown operation in $TRACE, line $line_number: $operation" >&2
+            exit 1
+            ;;
+    esac
+
+    n_operations=$(( n_operations + 1 ))
+done < "$TRACE"
+
+echo "Replayed $n_operations operations from $TRACE"
@@ -0,0 +1,358 @@
+#! /bin/bash
+
+# Benchmarks an appimaged binary against generated fixtures in a sandboxed HOME:
+#   cold_scan_*      startup with an empty cache, until all fixtures are in the menu / completely registered
+#   warm_scan_*      startup with the cache of the previous run
+#   register_*       a batch of AppImages moved into ~/Downloads at once, and removed again
+#   event_to_*       latency from moving a single AppImage into ~/Downloads to its menu entry
+#   trace_<name>_*   replay of each trace (see replay-trace.sh) until the daemon has caught up
+#
+# Results are printed and written as tab separated "metric value unit" lines, which
+# compare-results.sh compares between two runs.
+
+set -e
+
+usage() {
+    cat >&2 <<EOF
+Usage: $0 --appimaged PATH [options]
+  --appimaged PATH      binary to benchmark
+  --work-dir DIR        where to put fixtures, sandbox and logs (default: temporary directory)
+  --keep                don't remove the temporary work directory
+  --results FILE        where to write the results (default: benchmark-results.tsv)
+  --type1 N             type 1 AppImages in the scanned tree (default: 50)
+  --type2 N             type 2 AppImages in the scanned tree (default: 200)
+  --noise N             other files in the scanned tree (default: 2000)
+  --depth D             depth of the scanned tree (default: 4)
+  --seed S              seed for the fixtures (default: 1)
+  --batch N             AppImages in the throughput benchmark (default: 100)
+  --latency-runs N      repetitions of the latency benchmark (default: 20)
+  --traces DIR          directory with *.trace files to replay (default: traces next to this script)
+  --timeout SECONDS     give up waiting for the daemon after this long (default: 300)
+  --daemon-args ARGS    additional arguments for appimaged, e.g., "--jobs 2"
+EOF
+    exit 2
+}
+
+BENCHMARK_DIR=$(readlink -f "$(dirname "$0")")
+
+APPIMAGED=""
+WORK_DIR=""
+KEEP=""
+RESULTS=""
+FIXTURE_ARGS=()
+BATCH=100
+LATENCY_RUNS=20
+TRACES_DIR="$BENCHMARK_DIR"/traces
+TIMEOUT=300
+DAEMON_ARGS=()
+
+while [ $# -gt 0 ]; do
+    case "$1" in
+        --appimaged) APPIMAGED=$(readlink -f "$2"); shift 2 ;;
+        --work-dir) WORK_DIR="$2"; shift 2 ;;
+        --keep) KEEP=1; shift ;;
+        --results) RESULTS="$2"; shift 2 ;;
+        --type1|--type2|--noise|--depth|--seed) FIXTURE_ARGS+=("$1" "$2"); shift 2 ;;
+        --batch) BATCH="$2"; shift 2 ;;
+        --latency-runs) LATENCY_RUNS="$2"; shift 2 ;;
+        --traces) TRACES_DIR=$(readlink -f "$2"); shift 2 ;;
+        --timeout) TIMEOUT="$2"; shift 2 ;;
+        --daemon-args) DAEMON_ARGS=($2); shift 2 ;;
+        *) usage ;;
+    esac
+done
+
+if [ "$APPIMAGED" == "" ] || [ ! -x "$APPIMAGED" ]; then
+    usage
+fi
+
+if [ "$WORK_DIR" == "" ]; then
+    WORK_DIR=$(mktemp -d -p "${TMPDIR:-/tmp}" appimaged-benchmark-XXXXXX)
+    if [ "$KEEP" == "" ]; then
+        REMOVE_WORK_DIR=1
+    fi
+fi
+mkdir -p "$WORK_DIR"
+WORK_DIR=$(readlink -f "$WORK_DIR")
+
+if [ "$RESULTS" == "" ]; then
+    RESULTS=benchmark-results.tsv
+fi
+RESULTS=$(readlink -f "$RESULTS")
+
+FIXTURES_DIR="$WORK_DIR"/fixtures
+LOG_DIR="$WORK_DIR"/logs
+SANDBOX_DIR="$WORK_DIR"/sandbox
+STATE_DIR="$WORK_DIR"/state
+
+DAEMON_PID=""
+
+cleanup () {
+    if [ "$DAEMON_PID" != "" ]; then
+        kill "$DAEMON_PID" 2>/dev/null || true
+        wait "$DAEMON_PID" 2>/dev/null || true
+    fi
+    if [ "$REMOVE_WORK_DIR" != "" ]; then
+        rm -rf "$WORK_DIR"
+    fi
+}
+
+trap cleanup EXIT
+
+now_ms() {
+    local now="${EPOCHREALTIME/[.,]/}"
+    if [ "$now" == "" ]; then
+        now=$(( $(date +%s%N) / 1000 ))
+    fi
+    echo $(( now / 1000 ))
+}
+
+record() {
+    printf "%s\t%s\t%s\n" "$1" "$2" "$3" | tee -a "$RESULTS"
+}
+
+# the value at percentile $1 of the numbers on stdin
+percentile() {
+    sort -n | awk -v p="$1" '{ values[NR] = $1 } END { i = int(NR * p / 100 + 0.999); if (i < 1) i = 1; print values[i] }'
+}
+
+per_second() {
+    echo $(( $1 * 1000 / ($2 > 0 ? $2 : 1) ))
+}
+
+# set up a HOME of its own, which the daemon watches instead of the real one
+rm -rf "$SANDBOX_DIR" "$STATE_DIR" "$LOG_DIR"
+mkdir -p "$SANDBOX_DIR" "$STATE_DIR" "$LOG_DIR"
+export HOME="$SANDBOX_DIR"/home
+export XDG_DATA_HOME="$HOME"/.local/share
+export XDG_CONFIG_HOME="$HOME"/.config
+export XDG_CACHE_HOME="$HOME"/.cache
+export XDG_RUNTIME_DIR="$SANDBOX_DIR"/run
+unset APPIMAGE APPDIR
+mkdir -p "$HOME"/Downloads "$HOME"/Applications "$XDG_DATA_HOME" "$XDG_CONFIG_HOME" "$XDG_CACHE_HOME" "$XDG_RUNTIME_DIR"
+chmod 0700 "$XDG_RUNTIME_DIR"
+echo "XDG_DOWNLOAD_DIR=\"$HOME/Downloads\"" > "$XDG_CONFIG_HOME"/user-dirs.dirs
+
+APPLICATIONS_DIR="$XDG_DATA_HOME"/applications
+STAGING_DIR="$SANDBOX_DIR"/staging
+mkdir -p "$STAGING_DIR"
+
+# desktop entries are named after the MD5 sum of the AppImage's URI
+md5_of_path() {
+    printf "file://%s" "$1" | md5sum | cut -c1-32
+}
+
+# print the MD5 sums of the AppImages below the given directories
+list_appimages() {
+    find "$@" -type f 2>/dev/null | while read -r path; do
+        if cmp -s -n 2 -i 8:0 "$path" <(printf "AI"); then
+            md5_of_path "$path"
+        fi
+    done
+}
+
+# print the MD5 sums of the registered AppImages, without preliminary entries if $1 is "complete"
+list_registered() {
+    ls "$APPLICATIONS_DIR" 2>/dev/null | sed -n 's/^appimagekit_\([0-9a-f]\{32\}\)-.*\.desktop$/\1/p' | sort -u > "$STATE_DIR"/registered
+
+    if [ "$1" == "complete" ]; then
+        grep -l "^X-AppImaged-Preliminary=true" "$APPLICATIONS_DIR"/appimagekit_*.desktop 2>/dev/null |
+            sed -n 's|^.*/appimagekit_\([0-9a-f]\{32\}\)-.*\.desktop$|\1|p' | sort -u > "$STATE_DIR"/preliminary
+        comm -23 "$STATE_DIR"/registered "$STATE_DIR"/preliminary
+    else
+        cat "$STATE_DIR"/registered
+    fi
+}
+
+check_daemon() {
+    if ! kill -0 "$DAEMON_PID" 2>/dev/null; then
+        echo "Error: appimaged exited unexpectedly, see $DAEMON_LOG" >&2
+        tail -n 20 "$DAEMON_LOG" >&2
+        exit 1
+    fi
+}
+
+# wait until the registered AppImages ("menu" or "complete") are exactly those listed in file $2
+wait_for_registered() {
+    local mode="$1"
+    local expected="$2"
+    local deadline=$(( $(now_ms) + TIMEOUT * 1000 ))
+
+    while ! list_registered "$mode" | cmp -s - "$expected"; do
+        check_daemon
+        if [ "$(now_ms)" -gt "$deadline" ]; then
+            echo "Error: timed out waiting for the daemon to register $(wc -l < "$expected") AppImages ($mode)," \
+                 "$(list_registered "$mode" | comm -12 - "$expected" | wc -l) are registered" >&2
+            exit 1
+        fi
+        sleep 0.01
+    done
+}
+
+# like wait_for_registered, but AppImages found elsewhere on the system (e.g., in /opt) are ignored
+wait_for_registered_subset() {
+    local mode="$1"
+    local expected="$2"
+    local n_expected
+    n_expected=$(wc -l < "$expected")
+    local deadline=$(( $(now_ms) + TIMEOUT * 1000 ))
+
+    while [ "$(list_registered "$mode" | comm -12 - "$expected" | wc -l)" -ne "$n_expected" ]; do
+        check_daemon
+        if [ "$(now_ms)" -gt "$deadline" ]; then
+            echo "Error: timed out waiting for the daemon to register $n_expected AppImages ($mode)" >&2
+            exit 1
+        fi
+        sleep 0.01
+    done
+}
+
+start_daemon() {
+    DAEMON_LOG="$LOG_DIR"/"$1".log
+    "$APPIMAGED" --no-install "${DAEMON_ARGS[@]}" > "$DAEMON_LOG" 2>&1 &
+    DAEMON_PID=$!
+}
+
+# SIGUSR1 appends the statistics to the log and updates the JSON file, which is kept next to the log
+stop_daemon() {
+    kill -USR1 "$DAEMON_PID"
+    sleep 0.5
+    cp "$XDG_RUNTIME_DIR"/appimaged/stats.json "${DAEMON_LOG%.log}".stats.json 2>/dev/null || true
+
+    kill "$DAEMON_PID"
+    wait "$DAEMON_PID" 2>/dev/null || true
+    DAEMON_PID=""
+}
+
+# the registry is saved a few seconds after the last change, a warm start needs it
+wait_for_registry_save() {
+    sleep 4
+}
+
+# copy n AppImages to the staging directory, which is on the same file system, but not watched
+stage_appimages() {
+    local templates=($(cd "$FIXTURES_DIR"/templates && ls *.AppImage))
+    rm -rf "$STAGING_DIR"/*
+    for i in $(seq 1 "$1"); do
+        cp "$FIXTURES_DIR"/templates/"${templates[$(( (i - 1) % ${#templates[@]} ))]}" "$STAGING_DIR"/app-"$i".AppImage
+    done
+}
+
+echo "Generating fixtures..."
+"$BENCHMARK_DIR"/make-fixtures.sh "${FIXTURE_ARGS[@]}" "$FIXTURES_DIR"
+source "$FIXTURES_DIR"/fixtures.env
+if [ $(( N_TYPE1 + N_TYPE2 )) -eq 0 ]; then
+    echo "Error: no AppImages could be generated, please install squashfs-tools or genisoimage" >&2
+    exit 1
+fi
+
+: > "$RESULTS"
+{
+    echo "# $("$APPIMAGED" --version 2>&1 | head -n 1)"
+    echo "# $(LC_ALL=C date -u "+%Y-%m-%d %H:%M:%S %Z") on $(nproc) CPUs"
+    echo "# fixtures: $N_TYPE1 type 1, $N_TYPE2 type 2, $N_NOISE other files ${FIXTURE_ARGS[*]}"
+    echo "# daemon arguments: ${DAEMON_ARGS[*]}"
+} >> "$RESULTS"
+
+cp -a "$FIXTURES_DIR"/tree "$HOME"/Applications/fixtures
+list_appimages "$HOME"/Applications/fixtures | sort -u > "$STATE_DIR"/fixtures
+
+echo "Cold startup scan..."
+start=$(now_ms)
+start_daemon cold-scan
+wait_for_registered_subset menu "$STATE_DIR"/fixtures
+record cold_scan_menu_ms $(( $(now_ms) - start )) ms
+wait_for_registered_subset complete "$STATE_DIR"/fixtures
+record cold_scan_complete_ms $(( $(now_ms) - start )) ms
+wait_for_registry_save
+stop_daemon
+
+echo "Warm startup scan..."
+start=$(now_ms)
+start_daemon warm-scan
+until grep -q "^Initial scan finished" "$DAEMON_LOG"; do
+    check_daemon
+    sleep 0.01
+done
+record warm_scan_ms $(( $(now_ms) - start )) ms
+record warm_scan_reported_ms "$(sed -n 's/^Initial scan finished in \([0-9]*\) milliseconds.*$/\1/p' "$DAEMON_LOG")" ms
+
+# from now on, exactly these AppImages are expected to be registered when the daemon is idle
+wait_for_registered_subset complete "$STATE_DIR"/fixtures
+list_registered complete > "$STATE_DIR"/baseline
+
+echo "Register and unregister throughput..."
+mkdir -p "$HOME"/Downloads/batch
+stage_appimages "$BATCH"
+for i in $(seq 1 "$BATCH"); do
+    md5_of_path "$HOME"/Downloads/batch/app-"$i".AppImage
+done | sort -u | sort -u - "$STATE_DIR"/baseline > "$STATE_DIR"/expected
+start=$(now_ms)
+mv "$STAGING_DIR"/* "$HOME"/Downloads/batch/
+wait_for_registered menu "$STATE_DIR"/expected
+elapsed=$(( $(now_ms) - start ))
+record register_menu_ms "$elapsed" ms
+record register_menu_per_second "$(per_second "$BATCH" "$elapsed")" AppImages/s
+wait_for_registered complete "$STATE_DIR"/expected
+elapsed=$(( $(now_ms) - start ))
+record register_complete_ms "$elapsed" ms
+record register_complete_per_second "$(per_second "$BATCH" "$elapsed")" AppImages/s
+
+start=$(now_ms)
+rm -rf "$HOME"/Downloads/batch/*
+wait_for_registered menu "$STATE_DIR"/baseline
+elapsed=$(( $(now_ms) - start ))
+record unregister_ms "$elapsed" ms
+record unregister_per_second "$(per_second "$BATCH" "$elapsed")" AppImages/s
+rm -rf "$HOME"/Downloads/batch
+
+echo "Event to menu latency..."
+: > "$STATE_DIR"/menu-latencies
+: > "$STATE_DIR"/complete-latencies
+for i in $(seq 1 "$LATENCY_RUNS"); do
+    stage_appimages 1
+    path="$HOME"/Downloads/latency-"$i".AppImage
+    md5_of_path "$path" | sort -u - "$STATE_DIR"/baseline > "$STATE_DIR"/expected
+
+    start=$(now_ms)
+    mv "$STAGING_DIR"/app-1.AppImage "$path"
+    wait_for_registered menu "$STATE_DIR"/expected
+    echo $(( $(now_ms) - start )) >> "$STATE_DIR"/menu-latencies
+    wait_for_registered complete "$STATE_DIR"/expected
+    echo $(( $(now_ms) - start )) >> "$STATE_DIR"/complete-latencies
+
+    rm "$path"
+    wait_for_registered menu "$STATE_DIR"/baseline
+done
+for kind in menu complete; do
+    record event_to_"$kind"_p50_ms "$(percentile 50 < "$STATE_DIR"/"$kind"-latencies)" ms
+    record event_to_"$kind"_p90_ms "$(percentile 90 < "$STATE_DIR"/"$kind"-latencies)" ms
+    record event_to_"$kind"_max_ms "$(percentile 100 < "$STATE_DIR"/"$kind"-latencies)" ms
+done
+
+for trace in "$TRACES_DIR"/*.trace; do
+    [ -f "$trace" ] || continue
+    name=$(basename "$trace" .trace)
+    name="${name//-/_}"
+    echo "Replaying $(basename "$trace")..."
+
+    start=$(now_ms)
+    "$BENCHMARK_DIR"/replay-trace.sh "$trace" "$HOME" "$FIXTURES_DIR"/templates > /dev/null
+    replayed=$(now_ms)
+    record trace_"$name"_replay_ms $(( replayed - start )) ms
+
+    list_appimages "$HOME"/Downloads "$HOME"/Applications | sort -u - "$STATE_DIR"/baseline > "$STATE_DIR"/expected
+    wait_for_registered complete "$STATE_DIR"/expected
+    record trace_"$name"_settle_ms $(( $(now_ms) - replayed )) ms
+
+    # restore the state from before the trace
+    find "$HOME"/Downloads "$HOME"/Applications -mindepth 1 -maxdepth 1 ! -path "$HOME"/Applications/fixtures -exec rm -rf {} +
+    wait_for_registered menu "$STATE_DIR"/baseline
+done
+
+stop_daemon
+
+echo "Results written to $RESULTS, logs and statistics of the daemon are in $LOG_DIR"
+if [ "$REMOVE_WORK_DIR" != "" ]; then
+    echo "Note: the logs are removed on exit, use --work-dir or --keep to keep them"
+fi
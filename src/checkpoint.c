@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "checkpoint.h"
+#include "logger.h"
+
+/* Layout of the checkpoint file:
+ * header, then per directory a fixed-size entry followed by its NUL-terminated path and the
+ * NUL-terminated names of its n_subdirs subdirectories. Like the registry's index, the file is
+ * a cache stored in native byte order; files with another version are ignored. */
+#define CHECKPOINT_FILE_MAGIC "AIDSCAN\0"
+#define CHECKPOINT_FILE_VERSION 1
+
+struct checkpoint_file_header {
+    char magic[8];
+    guint32 version;
+    guint32 n_entries;
+};
+
+struct checkpoint_file_entry {
+    guint64 dev;
+    guint64 ino;
+    gint64 mtime_sec;
+    guint32 mtime_nsec;
+    guint32 n_subdirs;
+};
+
+struct checkpoint_dir {
+    guint64 dev;
+    guint64 ino;
+    gint64 mtime_sec;
+    guint32 mtime_nsec;
+    gchar** subdirs;
+    gboolean seen;
+};
+
+struct checkpoint {
+    GMutex mutex;
+    gchar* file_path;
+    // path -> struct checkpoint_dir
+    GHashTable* dirs;
+    // directories which have files being handled, they aren't recorded
+    GHashTable* invalidated;
+    // directories which weren't read because they were unchanged
+    GHashTable* skipped;
+    gboolean dirty;
+    gint64 last_save;
+};
+
+static void checkpoint_dir_free(struct checkpoint_dir* dir) {
+    g_strfreev(dir->subdirs);
+    g_free(dir);
+}
+
+static gboolean dir_matches_stat(const struct checkpoint_dir* dir, const struct stat* st) {
+    return dir->dev == (guint64) st->st_dev && dir->ino == (guint64) st->st_ino
+           && dir->mtime_sec == (gint64) st->st_mtim.tv_sec && dir->mtime_nsec == (guint32) st->st_mtim.tv_nsec;
+}
+
+// the NUL-terminated string at *offset, NULL if it exceeds the data
+static const gchar* read_string(const gchar* data, gsize length, gsize* offset) {
+    const gchar* string = data + *offset;
+    const gchar* end = memchr(string, '\0', length - *offset);
+    if (end == NULL) {
+        return NULL;
+    }
+    *offset = end - data + 1;
+    return string;
+}
+
+static gboolean load_file(checkpoint_t* checkpoint, const gchar* data, gsize length) {
+    struct checkpoint_file_header header;
+    if (length < sizeof(header)) {
+        return FALSE;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, CHECKPOINT_FILE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != CHECKPOINT_FILE_VERSION) {
+        return FALSE;
+    }
+
+    gsize offset = sizeof(header);
+    for (guint32 i = 0; i < header.n_entries; i++) {
+        struct checkpoint_file_entry entry;
+        if (length - offset < sizeof(entry)) {
+            return FALSE;
+        }
+        memcpy(&entry, data + offset, sizeof(entry));
+        offset += sizeof(entry);
+
+        const gchar* path = read_string(data, length, &offset);
+        if (path == NULL || entry.n_subdirs > length - offset) {
+            return FALSE;
+        }
+
+        struct checkpoint_dir* dir = g_new0(struct checkpoint_dir, 1);
+        dir->dev = entry.dev;
+        dir->ino = entry.ino;
+        dir->mtime_sec = entry.mtime_sec;
+        dir->mtime_nsec = entry.mtime_nsec;
+        dir->subdirs = g_new0(gchar*, entry.n_subdirs + 1);
+        g_hash_table_replace(checkpoint->dirs, g_strdup(path), dir);
+
+        for (guint32 j = 0; j < entry.n_subdirs; j++) {
+            const gchar* subdir = read_string(data, length, &offset);
+            if (subdir == NULL) {
+                return FALSE;
+            }
+            dir->subdirs[j] = g_strdup(subdir);
+        }
+    }
+
+    return offset == length;
+}
+
+checkpoint_t* checkpoint_load(const char* file_path) {
+    checkpoint_t* checkpoint = g_new0(checkpoint_t, 1);
+    g_mutex_init(&checkpoint->mutex);
+    checkpoint->file_path = g_strdup(file_path);
+    checkpoint->dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) checkpoint_dir_free);
+    checkpoint->invalidated = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    checkpoint->skipped = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    checkpoint->last_save = g_get_monotonic_time();
+
+    gchar* data = NULL;
+    gsize length = 0;
+    if (g_file_get_contents(file_path, &data, &length, NULL) && !load_file(checkpoint, data, length)) {
+        logger_print(LOGGER_LEVEL_WARNING, "Ignoring invalid scan checkpoint %s", file_path);
+        g_hash_table_remove_all(checkpoint->dirs);
+    }
+    g_free(data);
+
+    return checkpoint;
+}
+
+gboolean checkpoint_lookup(checkpoint_t* checkpoint, const char* path, const struct stat* st, gchar*** subdirs) {
+    g_mutex_lock(&checkpoint->mutex);
+    struct checkpoint_dir* dir = g_hash_table_lookup(checkpoint->dirs, path);
+    gboolean unchanged = dir != NULL && dir_matches_stat(dir, st);
+    if (unchanged) {
+        dir->seen = TRUE;
+        *subdirs = g_strdupv(dir->subdirs);
+        g_hash_table_add(checkpoint->skipped, g_strdup(path));
+    }
+    g_mutex_unlock(&checkpoint->mutex);
+    return unchanged;
+}
+
+void checkpoint_invalidate(checkpoint_t* checkpoint, const char* dir_path) {
+    g_mutex_lock(&checkpoint->mutex);
+    if (!g_hash_table_contains(checkpoint->invalidated, dir_path)) {
+        g_hash_table_add(checkpoint->invalidated, g_strdup(dir_path));
+    }
+    g_mutex_unlock(&checkpoint->mutex);
+}
+
+void checkpoint_record(checkpoint_t* checkpoint, const char* path, const struct stat* st, GPtrArray* subdirs) {
+    g_mutex_lock(&checkpoint->mutex);
+    if (g_hash_table_remove(checkpoint->invalidated, path)) {
+        if (g_hash_table_remove(checkpoint->dirs, path)) {
+            checkpoint->dirty = TRUE;
+        }
+        g_mutex_unlock(&checkpoint->mutex);
+        return;
+    }
+
+    struct checkpoint_dir* dir = g_new0(struct checkpoint_dir, 1);
+    dir->dev = st->st_dev;
+    dir->ino = st->st_ino;
+    dir->mtime_sec = st->st_mtim.tv_sec;
+    dir->mtime_nsec = st->st_mtim.tv_nsec;
+    dir->subdirs = g_new0(gchar*, subdirs->len + 1);
+    for (guint i = 0; i < subdirs->len; i++) {
+        dir->subdirs[i] = g_strdup(g_ptr_array_index(subdirs, i));
+    }
+    dir->seen = TRUE;
+    g_hash_table_replace(checkpoint->dirs, g_strdup(path), dir);
+    checkpoint->dirty = TRUE;
+    g_mutex_unlock(&checkpoint->mutex);
+}
+
+GHashTable* checkpoint_get_skipped_dirs(checkpoint_t* checkpoint) {
+    g_mutex_lock(&checkpoint->mutex);
+    GHashTable* skipped = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, checkpoint->skipped);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        g_hash_table_add(skipped, g_strdup(key));
+    }
+    g_mutex_unlock(&checkpoint->mutex);
+    return skipped;
+}
+
+static gboolean is_unseen(gpointer key, gpointer value, gpointer user_data) {
+    return !((struct checkpoint_dir*) value)->seen;
+}
+
+void checkpoint_prune_unseen(checkpoint_t* checkpoint) {
+    g_mutex_lock(&checkpoint->mutex);
+    if (g_hash_table_foreach_remove(checkpoint->dirs, is_unseen, NULL) > 0) {
+        checkpoint->dirty = TRUE;
+    }
+    g_mutex_unlock(&checkpoint->mutex);
+}
+
+static GString* serialize_locked(checkpoint_t* checkpoint) {
+    GString* data = g_string_new(NULL);
+
+    struct checkpoint_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_FILE_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_FILE_VERSION;
+    header.n_entries = g_hash_table_size(checkpoint->dirs);
+    g_string_append_len(data, (const gchar*) &header, sizeof(header));
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, checkpoint->dirs);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const struct checkpoint_dir* dir = value;
+
+        struct checkpoint_file_entry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.dev = dir->dev;
+        entry.ino = dir->ino;
+        entry.mtime_sec = dir->mtime_sec;
+        entry.mtime_nsec = dir->mtime_nsec;
+        entry.n_subdirs = g_strv_length(dir->subdirs);
+        g_string_append_len(data, (const gchar*) &entry, sizeof(entry));
+
+        g_string_append_len(data, key, strlen(key) + 1);
+        for (gchar** subdir = dir->subdirs; *subdir != NULL; subdir++) {
+            g_string_append_len(data, *subdir, strlen(*subdir) + 1);
+        }
+    }
+
+    return data;
+}
+
+void checkpoint_save(checkpoint_t* checkpoint, gint64 min_interval) {
+    g_mutex_lock(&checkpoint->mutex);
+    gint64 now = g_get_monotonic_time();
+    if (!checkpoint->dirty || now < checkpoint->last_save + min_interval) {
+        g_mutex_unlock(&checkpoint->mutex);
+        return;
+    }
+
+    GString* data = serialize_locked(checkpoint);
+    checkpoint->dirty = FALSE;
+    checkpoint->last_save = now;
+
+    // written while holding the lock, so that an older state never replaces a newer one
+    GError* error = NULL;
+    gchar* dirname = g_path_get_dirname(checkpoint->file_path);
+    g_mkdir_with_parents(dirname, 0755);
+    if (!g_file_set_contents(checkpoint->file_path, data->str, data->len, &error)) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to save scan checkpoint %s: %s", checkpoint->file_path, error->message);
+        g_error_free(error);
+        checkpoint->dirty = TRUE;
+    }
+    g_mutex_unlock(&checkpoint->mutex);
+
+    g_free(dirname);
+    g_string_free(data, TRUE);
+}
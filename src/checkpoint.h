@@ -0,0 +1,43 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <glib.h>
+
+/* Progress of the initial scan, kept in a file so that it survives restarts.
+ *
+ * For every directory whose files were all known to the registry when it was walked,
+ * the checkpoint remembers its modification time and the names of its subdirectories.
+ * As long as the modification time doesn't change, no file was added, removed or
+ * renamed in there, so the next scan neither reads the directory nor looks at its
+ * files, and only descends into the remembered subdirectories (which still need to be
+ * watched, and are checked on their own). Files modified in place while appimaged
+ * wasn't running go unnoticed in such directories.
+ *
+ * The checkpoint is saved periodically during the scan, so a scan which is interrupted
+ * resumes with the directories it hadn't completed yet. */
+
+typedef struct checkpoint checkpoint_t;
+
+// load the checkpoint saved by a previous run, if it is valid; the checkpoint is saved to the same file
+checkpoint_t* checkpoint_load(const char* file_path);
+
+/* Whether the directory at path is unchanged (according to st) since all its files were known.
+ * If so, subdirs is set to the names of its subdirectories, to be freed with g_strfreev(). */
+gboolean checkpoint_lookup(checkpoint_t* checkpoint, const char* path, const struct stat* st, gchar*** subdirs);
+
+// files in the directory at dir_path are being handled, so it needs to be read again next time
+void checkpoint_invalidate(checkpoint_t* checkpoint, const char* dir_path);
+
+/* The files of the directory at path have been looked at, and it has the subdirectories subdirs.
+ * It is only remembered if it wasn't invalidated while it was walked. */
+void checkpoint_record(checkpoint_t* checkpoint, const char* path, const struct stat* st, GPtrArray* subdirs);
+
+// the directories which were skipped since the checkpoint was loaded, i.e., whose files weren't looked at
+GHashTable* checkpoint_get_skipped_dirs(checkpoint_t* checkpoint);
+
+// forget the directories which have not been looked up or recorded since the checkpoint was loaded
+void checkpoint_prune_unseen(checkpoint_t* checkpoint);
+
+// write the file if the checkpoint changed and it wasn't written during the last min_interval microseconds
+void checkpoint_save(checkpoint_t* checkpoint, gint64 min_interval);
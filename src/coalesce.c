@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <glib.h>
+
+#include "coalesce.h"
+#include "logger.h"
+#include "registry.h"
+
+// IN_MOVED_FROM and IN_MOVED_TO are normally delivered back to back, but the quiet window might be set to zero
+#define MIN_MOVE_WINDOW (100 * 1000)
+
+struct pending {
+    workqueue_job_type_t type;
+    char* old_path;
+    gint64 deadline;
+};
+
+struct move {
+    char* path;
+    gint64 deadline;
+};
+
+struct coalescer {
+    GMutex mutex;
+    GCond cond;
+    gboolean shutdown;
+    pthread_t thread;
+
+    gint64 quiet_window;
+    workqueue_t* queue;
+
+    // path -> struct pending
+    GHashTable* pending;
+    // cookie -> struct move, IN_MOVED_FROM events waiting for their IN_MOVED_TO
+    GHashTable* moves;
+};
+
+static void pending_free(gpointer data) {
+    struct pending* pending = data;
+    g_free(pending->old_path);
+    g_free(pending);
+}
+
+static void move_free(gpointer data) {
+    struct move* move = data;
+    g_free(move->path);
+    g_free(move);
+}
+
+// must be called with the mutex held
+static void set_pending_locked(coalescer_t* coalescer, const char* path, workqueue_job_type_t type,
+                               const char* old_path, gint64 deadline) {
+    struct pending* pending = g_hash_table_lookup(coalescer->pending, path);
+
+    // a rename to this path is superseded, so the registration of its old path has to go
+    if (pending != NULL && pending->type == WORKQUEUE_JOB_RENAME
+        && !(type == WORKQUEUE_JOB_RENAME && g_strcmp0(pending->old_path, old_path) == 0)) {
+        gchar* superseded = pending->old_path;
+        pending->old_path = NULL;
+        set_pending_locked(coalescer, superseded, WORKQUEUE_JOB_UNREGISTER, NULL, deadline);
+        g_free(superseded);
+    }
+
+    if (pending == NULL) {
+        pending = g_new0(struct pending, 1);
+        g_hash_table_insert(coalescer->pending, g_strdup(path), pending);
+    }
+
+    pending->type = type;
+    g_free(pending->old_path);
+    pending->old_path = g_strdup(old_path);
+    pending->deadline = deadline;
+}
+
+// must be called with the mutex held
+static void pair_move_locked(coalescer_t* coalescer, const char* from, const char* to, gint64 deadline) {
+    struct pending* pending = g_hash_table_lookup(coalescer->pending, from);
+
+    if (pending == NULL) {
+        set_pending_locked(coalescer, to, WORKQUEUE_JOB_RENAME, from, deadline);
+        return;
+    }
+
+    switch (pending->type) {
+        case WORKQUEUE_JOB_RENAME: {
+            // moved twice within the quiet window
+            gchar* origin = g_strdup(pending->old_path);
+            g_hash_table_remove(coalescer->pending, from);
+            if (strcmp(origin, to) != 0) {
+                set_pending_locked(coalescer, to, WORKQUEUE_JOB_RENAME, origin, deadline);
+            }
+            g_free(origin);
+            break;
+        }
+        case WORKQUEUE_JOB_COMPLETE:
+        case WORKQUEUE_JOB_REGISTER: {
+            // written and moved right away (e.g., a finished download), the new contents haven't been looked at yet
+            g_hash_table_remove(coalescer->pending, from);
+
+            registry_entry_t entry;
+            if (registry_get(from, &entry) && entry.type != -1) {
+                set_pending_locked(coalescer, from, WORKQUEUE_JOB_UNREGISTER, NULL, deadline);
+            }
+            set_pending_locked(coalescer, to, WORKQUEUE_JOB_REGISTER, NULL, deadline);
+            break;
+        }
+        case WORKQUEUE_JOB_UNREGISTER:
+            set_pending_locked(coalescer, to, WORKQUEUE_JOB_REGISTER, NULL, deadline);
+            break;
+    }
+}
+
+static void dispatch(coalescer_t* coalescer, const char* path, struct pending* pending) {
+    if (pending->type == WORKQUEUE_JOB_RENAME) {
+        workqueue_push_rename(coalescer->queue, pending->old_path, path);
+    } else {
+        workqueue_push(coalescer->queue, pending->type, path);
+    }
+}
+
+static void* coalescer_main(void* arguments) {
+    coalescer_t* coalescer = arguments;
+
+    g_mutex_lock(&coalescer->mutex);
+    while (TRUE) {
+        gint64 now = g_get_monotonic_time();
+        gboolean flush = coalescer->shutdown;
+        gint64 next_deadline = G_MAXINT64;
+
+        GHashTableIter iter;
+        gpointer key, value;
+
+        // unpaired moves: the file was moved out of the watched directories
+        g_hash_table_iter_init(&iter, coalescer->moves);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            struct move* move = value;
+            if (flush || move->deadline <= now) {
+                set_pending_locked(coalescer, move->path, WORKQUEUE_JOB_UNREGISTER, NULL, now);
+                g_hash_table_iter_remove(&iter);
+            } else {
+                next_deadline = MIN(next_deadline, move->deadline);
+            }
+        }
+
+        GSList* due_paths = NULL;
+        GSList* due_pendings = NULL;
+        g_hash_table_iter_init(&iter, coalescer->pending);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            struct pending* pending = value;
+            if (flush || pending->deadline <= now) {
+                due_paths = g_slist_prepend(due_paths, key);
+                due_pendings = g_slist_prepend(due_pendings, pending);
+                g_hash_table_iter_steal(&iter);
+            } else {
+                next_deadline = MIN(next_deadline, pending->deadline);
+            }
+        }
+
+        if (due_paths != NULL) {
+            // pushing may block until the workers catch up, don't hold up the event loop meanwhile
+            g_mutex_unlock(&coalescer->mutex);
+            for (GSList *path = due_paths, *pending = due_pendings; path != NULL; path = path->next, pending = pending->next) {
+                dispatch(coalescer, path->data, pending->data);
+            }
+            g_slist_free_full(due_paths, g_free);
+            g_slist_free_full(due_pendings, pending_free);
+            g_mutex_lock(&coalescer->mutex);
+            continue;
+        }
+
+        if (flush) {
+            break;
+        }
+
+        if (next_deadline == G_MAXINT64) {
+            g_cond_wait(&coalescer->cond, &coalescer->mutex);
+        } else {
+            g_cond_wait_until(&coalescer->cond, &coalescer->mutex, next_deadline);
+        }
+    }
+    g_mutex_unlock(&coalescer->mutex);
+
+    return NULL;
+}
+
+coalescer_t* coalescer_new(gint64 quiet_window, workqueue_t* queue) {
+    coalescer_t* coalescer = g_new0(coalescer_t, 1);
+
+    g_mutex_init(&coalescer->mutex);
+    g_cond_init(&coalescer->cond);
+    coalescer->quiet_window = MAX(quiet_window, 0);
+    coalescer->queue = queue;
+    coalescer->pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, pending_free);
+    coalescer->moves = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, move_free);
+
+    if (pthread_create(&coalescer->thread, NULL, coalescer_main, coalescer) != 0) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to create event coalescing thread");
+        g_hash_table_destroy(coalescer->pending);
+        g_hash_table_destroy(coalescer->moves);
+        g_cond_clear(&coalescer->cond);
+        g_mutex_clear(&coalescer->mutex);
+        g_free(coalescer);
+        return NULL;
+    }
+
+    return coalescer;
+}
+
+void coalescer_add(coalescer_t* coalescer, coalesce_event_type_t type, const char* path, guint32 cookie) {
+    gint64 now = g_get_monotonic_time();
+    gint64 deadline = now + coalescer->quiet_window;
+
+    g_mutex_lock(&coalescer->mutex);
+    switch (type) {
+        case COALESCE_EVENT_WRITTEN:
+            set_pending_locked(coalescer, path, WORKQUEUE_JOB_REGISTER, NULL, deadline);
+            break;
+        case COALESCE_EVENT_REMOVED:
+            set_pending_locked(coalescer, path, WORKQUEUE_JOB_UNREGISTER, NULL, deadline);
+            break;
+        case COALESCE_EVENT_MOVED_FROM: {
+            struct move* move = g_new0(struct move, 1);
+            move->path = g_strdup(path);
+            move->deadline = now + MAX(coalescer->quiet_window, MIN_MOVE_WINDOW);
+            g_hash_table_replace(coalescer->moves, GUINT_TO_POINTER(cookie), move);
+            break;
+        }
+        case COALESCE_EVENT_MOVED_TO: {
+            struct move* move = g_hash_table_lookup(coalescer->moves, GUINT_TO_POINTER(cookie));
+            if (move != NULL) {
+                g_hash_table_steal(coalescer->moves, GUINT_TO_POINTER(cookie));
+                pair_move_locked(coalescer, move->path, path, deadline);
+                move_free(move);
+            } else {
+                // moved in from somewhere we don't watch
+                set_pending_locked(coalescer, path, WORKQUEUE_JOB_REGISTER, NULL, deadline);
+            }
+            break;
+        }
+    }
+    g_cond_signal(&coalescer->cond);
+    g_mutex_unlock(&coalescer->mutex);
+}
+
+void coalescer_free(coalescer_t* coalescer) {
+    if (coalescer == NULL) {
+        return;
+    }
+
+    g_mutex_lock(&coalescer->mutex);
+    coalescer->shutdown = TRUE;
+    g_cond_signal(&coalescer->cond);
+    g_mutex_unlock(&coalescer->mutex);
+
+    pthread_join(coalescer->thread, NULL);
+
+    g_hash_table_destroy(coalescer->pending);
+    g_hash_table_destroy(coalescer->moves);
+    g_cond_clear(&coalescer->cond);
+    g_mutex_clear(&coalescer->mutex);
+    g_free(coalescer);
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <glib.h>
+
+#include "workqueue.h"
+
+/* Stage between the inotify events and the job queue.
+ *
+ * Events are collected per path and only turned into a job once no further
+ * event for that path arrived during the quiet window, so that bursts of writes
+ * result in a single job. IN_MOVED_FROM and IN_MOVED_TO events are paired by
+ * their cookie and turned into rename jobs; a move without counterpart is
+ * handled like a deletion or creation of the file, respectively. */
+
+typedef enum {
+    COALESCE_EVENT_WRITTEN,
+    COALESCE_EVENT_REMOVED,
+    COALESCE_EVENT_MOVED_FROM,
+    COALESCE_EVENT_MOVED_TO,
+} coalesce_event_type_t;
+
+typedef struct coalescer coalescer_t;
+
+coalescer_t* coalescer_new(gint64 quiet_window, workqueue_t* queue);
+
+// cookie is only used for the move events
+void coalescer_add(coalescer_t* coalescer, coalesce_event_type_t type, const char* path, guint32 cookie);
+
+// passes all collected events on to the job queue and frees the coalescer
+void coalescer_free(coalescer_t* coalescer);
@@ -0,0 +1,422 @@
+// strchrnul() is only declared with _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <glib.h>
+
+#include "config.h"
+#include "logger.h"
+
+#define CONFIG_GROUP "Watch"
+
+// node of the trie of excluded paths, keyed by path component
+struct exclude_node {
+    GHashTable* children;
+    // the path up to this node is excluded, and so is everything below it
+    gboolean excluded;
+};
+
+struct config {
+    gint ref_count;
+    GPtrArray* roots;
+    gboolean mount_applications;
+    int max_depth;
+    // the exclusions as written in the file, to tell whether a new configuration excludes less
+    GPtrArray* excludes;
+    struct exclude_node* excluded_paths;
+    // patterns for the names of files and directories
+    GPtrArray* name_patterns;
+    // patterns for whole paths
+    GPtrArray* path_patterns;
+};
+
+static struct exclude_node* exclude_node_new(void) {
+    return g_new0(struct exclude_node, 1);
+}
+
+static void exclude_node_free(struct exclude_node* node) {
+    if (node->children != NULL) {
+        g_hash_table_unref(node->children);
+    }
+    g_free(node);
+}
+
+static void exclude_node_insert(struct exclude_node* node, const char* path) {
+    gchar** components = g_strsplit(path, "/", -1);
+    for (gchar** component = components; *component != NULL && !node->excluded; component++) {
+        if (**component == '\0') {
+            continue;
+        }
+        if (node->children == NULL) {
+            node->children = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                                   (GDestroyNotify) exclude_node_free);
+        }
+        struct exclude_node* child = g_hash_table_lookup(node->children, *component);
+        if (child == NULL) {
+            child = exclude_node_new();
+            g_hash_table_insert(node->children, g_strdup(*component), child);
+        }
+        node = child;
+    }
+    g_strfreev(components);
+
+    // paths below an excluded one don't need to be stored
+    node->excluded = TRUE;
+    if (node->children != NULL) {
+        g_hash_table_remove_all(node->children);
+    }
+}
+
+/* The node of the trie for path, without modifying or copying path. If path or a directory above it is excluded,
+ * that node is returned; if path isn't in the trie at all, NULL. */
+static const struct exclude_node* exclude_node_find(const struct exclude_node* node, const char* path) {
+    char component[NAME_MAX + 1];
+
+    while (!node->excluded) {
+        while (*path == '/') {
+            path++;
+        }
+        if (*path == '\0') {
+            return node;
+        }
+        if (node->children == NULL) {
+            return NULL;
+        }
+
+        const char* end = strchrnul(path, '/');
+        if ((gsize) (end - path) > NAME_MAX) {
+            return NULL;
+        }
+        memcpy(component, path, end - path);
+        component[end - path] = '\0';
+
+        node = g_hash_table_lookup(node->children, component);
+        if (node == NULL) {
+            return NULL;
+        }
+        path = end;
+    }
+
+    return node;
+}
+
+// replace a leading "~" by the home directory
+static gchar* expand_home(const char* path) {
+    if (strcmp(path, "~") == 0 || g_str_has_prefix(path, "~/")) {
+        return g_build_filename(g_get_home_dir(), path + 1, NULL);
+    }
+    return g_strdup(path);
+}
+
+static void add_root(GPtrArray* roots, const char* path) {
+    if (path == NULL) {
+        return;
+    }
+
+    // symlinks are resolved, so that the paths match those reported for the watched directories
+    char* resolved = realpath(path, NULL);
+    if (resolved == NULL || !g_file_test(resolved, G_FILE_TEST_IS_DIR)) {
+        free(resolved);
+        return;
+    }
+
+    for (guint i = 0; i < roots->len; i++) {
+        if (strcmp(g_ptr_array_index(roots, i), resolved) == 0) {
+            free(resolved);
+            return;
+        }
+    }
+    g_ptr_array_add(roots, g_strdup(resolved));
+    free(resolved);
+}
+
+static void add_default_roots(GPtrArray* roots) {
+    gchar* paths[] = {
+        g_build_filename(g_get_home_dir(), ".local", "bin", NULL),
+        g_strdup(g_get_user_special_dir(G_USER_DIRECTORY_DOWNLOAD)),
+        g_build_filename(g_get_home_dir(), "bin", NULL),
+        g_build_filename(g_get_home_dir(), ".bin", NULL),
+        g_build_filename(g_get_home_dir(), "Applications", NULL),
+        g_strdup("/Applications"),
+        g_strdup("/opt"),
+        g_strdup("/usr/local/bin"),
+    };
+
+    for (gsize i = 0; i < G_N_ELEMENTS(paths); i++) {
+        add_root(roots, paths[i]);
+        g_free(paths[i]);
+    }
+}
+
+static void compile_exclude(config_t* config, const char* exclude) {
+    if (*exclude == '\0') {
+        return;
+    }
+
+    gchar* pattern = expand_home(exclude);
+    gboolean has_wildcards = strpbrk(pattern, "*?") != NULL;
+
+    g_ptr_array_add(config->excludes, g_strdup(exclude));
+    if (strchr(pattern, '/') == NULL) {
+        g_ptr_array_add(config->name_patterns, g_pattern_spec_new(pattern));
+    } else if (*pattern == '/' && !has_wildcards) {
+        exclude_node_insert(config->excluded_paths, pattern);
+    } else {
+        g_ptr_array_add(config->path_patterns, g_pattern_spec_new(pattern));
+    }
+
+    g_free(pattern);
+}
+
+config_t* config_load(const char* path) {
+    GKeyFile* key_file = g_key_file_new();
+    GError* error = NULL;
+    gboolean loaded = path != NULL && g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, &error);
+    if (error != NULL && !g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to load %s: %s", path, error->message);
+        g_error_free(error);
+        g_key_file_unref(key_file);
+        return NULL;
+    }
+    g_clear_error(&error);
+
+    config_t* config = g_new0(config_t, 1);
+    config->ref_count = 1;
+    config->roots = g_ptr_array_new_with_free_func(g_free);
+    config->max_depth = -1;
+    config->excludes = g_ptr_array_new_with_free_func(g_free);
+    config->excluded_paths = exclude_node_new();
+    config->name_patterns = g_ptr_array_new_with_free_func((GDestroyNotify) g_pattern_spec_free);
+    config->path_patterns = g_ptr_array_new_with_free_func((GDestroyNotify) g_pattern_spec_free);
+
+    gchar** roots = loaded ? g_key_file_get_string_list(key_file, CONFIG_GROUP, "Roots", NULL, NULL) : NULL;
+    if (roots != NULL) {
+        for (gchar** root = roots; *root != NULL; root++) {
+            gchar* root_path = expand_home(*root);
+            if (g_path_is_absolute(root_path)) {
+                add_root(config->roots, root_path);
+            } else if (**root != '\0') {
+                logger_print(LOGGER_LEVEL_WARNING, "Ignoring root %s in %s, it is not an absolute path", *root, path);
+            }
+            g_free(root_path);
+        }
+        g_strfreev(roots);
+    } else {
+        add_default_roots(config->roots);
+    }
+
+    config->mount_applications = TRUE;
+    if (loaded && g_key_file_has_key(key_file, CONFIG_GROUP, "MountApplications", NULL)) {
+        config->mount_applications = g_key_file_get_boolean(key_file, CONFIG_GROUP, "MountApplications", &error);
+    }
+
+    if (error == NULL && loaded && g_key_file_has_key(key_file, CONFIG_GROUP, "MaxDepth", NULL)) {
+        config->max_depth = g_key_file_get_integer(key_file, CONFIG_GROUP, "MaxDepth", &error);
+        config->max_depth = MAX(config->max_depth, -1);
+    }
+
+    gchar** excludes = loaded ? g_key_file_get_string_list(key_file, CONFIG_GROUP, "Exclude", NULL, NULL) : NULL;
+    if (excludes != NULL) {
+        for (gchar** exclude = excludes; *exclude != NULL; exclude++) {
+            compile_exclude(config, *exclude);
+        }
+        g_strfreev(excludes);
+    }
+
+    g_key_file_unref(key_file);
+
+    if (error != NULL) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to load %s: %s", path, error->message);
+        g_error_free(error);
+        config_unref(config);
+        return NULL;
+    }
+
+    return config;
+}
+
+config_t* config_ref(config_t* config) {
+    g_atomic_int_inc(&config->ref_count);
+    return config;
+}
+
+void config_unref(config_t* config) {
+    if (config == NULL || !g_atomic_int_dec_and_test(&config->ref_count)) {
+        return;
+    }
+
+    g_ptr_array_unref(config->roots);
+    g_ptr_array_unref(config->excludes);
+    exclude_node_free(config->excluded_paths);
+    g_ptr_array_unref(config->name_patterns);
+    g_ptr_array_unref(config->path_patterns);
+    g_free(config);
+}
+
+const GPtrArray* config_get_roots(const config_t* config) {
+    return config->roots;
+}
+
+gboolean config_get_mount_applications(const config_t* config) {
+    return config->mount_applications;
+}
+
+gboolean config_is_root(const config_t* config, const char* path) {
+    for (guint i = 0; i < config->roots->len; i++) {
+        if (strcmp(g_ptr_array_index(config->roots, i), path) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// length of the longest root path is in or below, 0 if there is none
+static gsize find_root(const config_t* config, const char* path) {
+    gsize root_length = 0;
+    for (guint i = 0; i < config->roots->len; i++) {
+        const char* root = g_ptr_array_index(config->roots, i);
+        gsize length = strlen(root);
+        if (length > root_length && strncmp(path, root, length) == 0
+            && (path[length] == '\0' || path[length] == '/' || length == 1)) {
+            root_length = length;
+        }
+    }
+    return root_length;
+}
+
+static gboolean matches_any(GPtrArray* patterns, const char* string) {
+    for (guint i = 0; i < patterns->len; i++) {
+        if (g_pattern_match_string(g_ptr_array_index(patterns, i), string)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// files are allowed in the deepest directories which are watched
+static gboolean is_within_max_depth(const config_t* config, int depth, gboolean is_dir) {
+    int max_depth = is_dir ? config->max_depth : config->max_depth + 1;
+    return config->max_depth < 0 || depth <= max_depth;
+}
+
+// path is in or below the root, which is root_length characters long; sets *dir if non-NULL and path is allowed
+static gboolean allows_below_root(const config_t* config, gsize root_length, const char* path, gboolean is_dir,
+                                  config_dir_t* dir) {
+    const struct exclude_node* node = exclude_node_find(config->excluded_paths, path);
+    if (node != NULL && node->excluded) {
+        return FALSE;
+    }
+
+    // the exclusions apply to every directory between the root and path, as the walk doesn't enter excluded ones
+    gboolean check_patterns = config->name_patterns->len > 0 || config->path_patterns->len > 0;
+    gboolean excluded = FALSE;
+    int depth = 0;
+    gchar* prefix = g_strdup(path);
+    char* component = prefix + root_length;
+    while (*component != '\0' && !excluded) {
+        while (*component == '/') {
+            component++;
+        }
+        if (*component == '\0') {
+            break;
+        }
+        char* end = strchrnul(component, '/');
+        char separator = *end;
+        depth++;
+
+        // the prefix is cut off after the component for the moment
+        *end = '\0';
+        excluded = check_patterns && (matches_any(config->name_patterns, component)
+                                      || matches_any(config->path_patterns, prefix));
+        *end = separator;
+        component = end;
+    }
+    g_free(prefix);
+
+    if (excluded || !is_within_max_depth(config, depth, is_dir)) {
+        return FALSE;
+    }
+
+    if (dir != NULL) {
+        dir->excluded_paths = node;
+        dir->depth = depth;
+    }
+    return TRUE;
+}
+
+gboolean config_allows(const config_t* config, const char* path, gboolean is_dir) {
+    gsize root_length = find_root(config, path);
+    return root_length > 0 && allows_below_root(config, root_length, path, is_dir, NULL);
+}
+
+// whether path is root or below it
+static gboolean is_below(const char* root, gsize root_length, const char* path) {
+    return strncmp(path, root, root_length) == 0
+           && (path[root_length] == '\0' || path[root_length] == '/' || root[root_length - 1] == '/');
+}
+
+gboolean config_allows_below(const config_t* config, const char* root, const char* path, gboolean is_dir) {
+    gsize root_length = strlen(root);
+    return is_below(root, root_length, path) && allows_below_root(config, root_length, path, is_dir, NULL);
+}
+
+gboolean config_locate(const config_t* config, const char* root, const char* path, config_dir_t* dir) {
+    gsize root_length = root != NULL ? strlen(root) : find_root(config, path);
+    if (root_length == 0 || (root != NULL && !is_below(root, root_length, path))) {
+        return FALSE;
+    }
+    return allows_below_root(config, root_length, path, TRUE, dir);
+}
+
+gboolean config_allows_entry(const config_t* config, const config_dir_t* parent, const char* path, gboolean is_dir,
+                             config_dir_t* dir) {
+    int depth = parent->depth + 1;
+    if (!is_within_max_depth(config, depth, is_dir)) {
+        return FALSE;
+    }
+
+    const char* name = strrchr(path, '/');
+    name = name != NULL ? name + 1 : path;
+
+    // the directory is allowed, so only the entry itself can be excluded
+    const struct exclude_node* node = NULL;
+    if (parent->excluded_paths != NULL && parent->excluded_paths->children != NULL) {
+        node = g_hash_table_lookup(parent->excluded_paths->children, name);
+        if (node != NULL && node->excluded) {
+            return FALSE;
+        }
+    }
+    if (matches_any(config->name_patterns, name) || matches_any(config->path_patterns, path)) {
+        return FALSE;
+    }
+
+    if (dir != NULL) {
+        dir->excluded_paths = node;
+        dir->depth = depth;
+    }
+    return TRUE;
+}
+
+gboolean config_may_allow_more(const config_t* old_config, const config_t* new_config) {
+    if (old_config->max_depth >= 0 && (new_config->max_depth < 0 || new_config->max_depth > old_config->max_depth)) {
+        return TRUE;
+    }
+
+    for (guint i = 0; i < old_config->excludes->len; i++) {
+        const char* exclude = g_ptr_array_index(old_config->excludes, i);
+        gboolean kept = FALSE;
+        for (guint j = 0; j < new_config->excludes->len && !kept; j++) {
+            kept = strcmp(exclude, g_ptr_array_index(new_config->excludes, j)) == 0;
+        }
+        if (!kept) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
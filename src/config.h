@@ -0,0 +1,75 @@
+#pragma once
+
+#include <glib.h>
+
+/* Which directories appimaged watches, read from a key file such as
+ *
+ *   [Watch]
+ *   # replaces the default directories (~/.local/bin, ~/Downloads, ~/bin, ~/.bin,
+ *   # ~/Applications, /Applications, /opt and /usr/local/bin)
+ *   Roots=~/Applications;~/Downloads;/opt
+ *   # also watch the "Applications" directory of every mounted file system (default: true)
+ *   MountApplications=true
+ *   # levels of subdirectories watched below a root, -1 for no limit (default: -1)
+ *   MaxDepth=3
+ *   Exclude=/opt/cuda;/opt/jdk-*;node_modules;.*
+ *
+ * An exclusion without wildcards which starts with "/" or "~/" excludes the directory
+ * or file at that path, along with everything below it. A pattern without "/" is matched
+ * against the name of every directory and file below the roots. Any other pattern is
+ * matched against the whole path, with "*" and "?" matching "/" as well.
+ *
+ * The exclusions are compiled into a trie of the excluded paths' components and a list
+ * of patterns, so a directory is checked without touching the file system. A loaded
+ * configuration is immutable and reference counted, so that it can be replaced while
+ * other threads still use the previous one. */
+
+typedef struct config config_t;
+
+/* Where an allowed directory is relative to the configuration, so that the entries of a directory which is being
+ * walked are checked by their own name, instead of going through their whole path again; see config_allows_entry().
+ * Only valid as long as the configuration it was obtained from. */
+typedef struct {
+    // node of the trie of excluded paths which corresponds to the directory, NULL if there is none
+    const struct exclude_node* excluded_paths;
+    // levels of subdirectories below the root
+    int depth;
+} config_dir_t;
+
+/* Load the configuration from path; if it doesn't exist, the defaults are used.
+ * The roots are resolved and only those which are directories are kept.
+ * Returns NULL and prints the reason if the file is invalid. */
+config_t* config_load(const char* path);
+
+config_t* config_ref(config_t* config);
+
+void config_unref(config_t* config);
+
+// absolute paths of the directories to watch
+const GPtrArray* config_get_roots(const config_t* config);
+
+// whether the "Applications" directories of mounted file systems are to be watched as well
+gboolean config_get_mount_applications(const config_t* config);
+
+// whether path is one of the roots
+gboolean config_is_root(const config_t* config, const char* path);
+
+/* Whether the directory or file at path is to be looked at, i.e., it is below a root,
+ * neither it nor a directory above it is excluded, and it isn't too deep (is_dir). */
+gboolean config_allows(const config_t* config, const char* path, gboolean is_dir);
+
+// same as config_allows(), for a path below a root which isn't part of the configuration, e.g., a mount's
+gboolean config_allows_below(const config_t* config, const char* root, const char* path, gboolean is_dir);
+
+// whether new_config may allow directories which old_config doesn't, i.e., the watched directories need to be rescanned
+gboolean config_may_allow_more(const config_t* old_config, const config_t* new_config);
+
+/* Same as config_allows() for the directory at path, or config_allows_below() if root is non-NULL. If the directory
+ * is allowed, *dir is set for checking its entries. */
+gboolean config_locate(const config_t* config, const char* root, const char* path, config_dir_t* dir);
+
+/* Whether the directory or file at path, which is in the allowed directory parent, is to be looked at. Equivalent
+ * to config_allows(), but only the last component of path is checked. If it is an allowed directory and dir is
+ * non-NULL, *dir is set for checking its entries in turn. */
+gboolean config_allows_entry(const config_t* config, const config_dir_t* parent, const char* path, gboolean is_dir,
+                             config_dir_t* dir);
@@ -0,0 +1,470 @@
+// struct ucred and accept4() are only declared with _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <glib.h>
+
+#include "control.h"
+#include "logger.h"
+#include "registry.h"
+#include "stats.h"
+
+// longest request accepted, a command followed by a path
+#define MAX_REQUEST_LENGTH (PATH_MAX + 64)
+
+struct control_server {
+    int fd;
+    char* socket_path;
+    pthread_t thread;
+
+    workqueue_t* queue;
+    control_rescan_func_t rescan;
+    control_reconcile_func_t reconcile;
+    void* user_data;
+};
+
+struct batched_request {
+    workqueue_job_type_t type;
+    char* path;
+};
+
+struct connection {
+    control_server_t* server;
+    int fd;
+    // register and unregister requests which are queued, but not answered yet
+    workqueue_batch_t* batch;
+    GArray* batched;
+};
+
+static gboolean make_address(struct sockaddr_un* address, const char* socket_path) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address->sun_path)) {
+        logger_print(LOGGER_LEVEL_ERROR, "Control socket path too long: %s", socket_path);
+        return FALSE;
+    }
+    strcpy(address->sun_path, socket_path);
+    return TRUE;
+}
+
+static int connect_to(const char* socket_path) {
+    struct sockaddr_un address;
+    if (!make_address(&address, socket_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+        int connect_errno = errno;
+        close(fd);
+        errno = connect_errno;
+        return -1;
+    }
+
+    return fd;
+}
+
+static gboolean send_all(int fd, const char* data, gsize length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return FALSE;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return TRUE;
+}
+
+static gint compare_paths(gconstpointer a, gconstpointer b) {
+    return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+static void handle_list(GString* response) {
+    GPtrArray* paths = registry_get_paths();
+    g_ptr_array_sort(paths, compare_paths);
+
+    for (guint i = 0; i < paths->len; i++) {
+        const char* path = g_ptr_array_index(paths, i);
+        registry_entry_t entry;
+        // paths with line breaks can't be represented in the protocol
+        if (registry_get(path, &entry) && entry.type != -1 && strchr(path, '\n') == NULL) {
+            g_string_append_printf(response, "DATA %d\t%s\t%s\n", entry.type,
+                                   entry.registered ? "registered" : "pending", path);
+        }
+    }
+
+    g_ptr_array_unref(paths);
+    g_string_append(response, "OK\n");
+}
+
+static void handle_purge(control_server_t* server, GString* response) {
+    GPtrArray* paths = registry_get_paths();
+    workqueue_batch_t* batch = workqueue_batch_new();
+
+    for (guint i = 0; i < paths->len; i++) {
+        const char* path = g_ptr_array_index(paths, i);
+        registry_entry_t entry;
+        if (registry_get(path, &entry) && entry.type != -1) {
+            workqueue_push_batched(server->queue, batch, WORKQUEUE_JOB_UNREGISTER, path);
+        }
+    }
+    workqueue_batch_wait(server->queue, batch);
+
+    workqueue_batch_free(batch);
+    g_ptr_array_unref(paths);
+    g_string_append(response, "OK\n");
+}
+
+static void handle_stats(GString* response) {
+    GString* text = stats_format_text();
+    gchar** lines = g_strsplit(text->str, "\n", -1);
+    for (gchar** line = lines; *line != NULL; line++) {
+        if (**line != '\0') {
+            g_string_append_printf(response, "DATA %s\n", *line);
+        }
+    }
+    g_strfreev(lines);
+    g_string_free(text, TRUE);
+    g_string_append(response, "OK\n");
+}
+
+// answer the queued register and unregister requests once their jobs are done
+static void flush_batch(struct connection* connection, GString* response) {
+    workqueue_t* queue = connection->server->queue;
+
+    if (connection->batched->len == 0) {
+        return;
+    }
+
+    workqueue_batch_wait(queue, connection->batch);
+
+    // registrations which got as far as the preliminary desktop entry are completed in the background
+    gboolean completing = FALSE;
+    for (guint i = 0; i < connection->batched->len; i++) {
+        struct batched_request* request = &g_array_index(connection->batched, struct batched_request, i);
+        registry_entry_t entry;
+        if (request->type == WORKQUEUE_JOB_REGISTER && registry_get(request->path, &entry) && entry.type != -1
+            && !entry.registered) {
+            workqueue_push_batched(queue, connection->batch, WORKQUEUE_JOB_COMPLETE, request->path);
+            completing = TRUE;
+        }
+    }
+    if (completing) {
+        workqueue_batch_wait(queue, connection->batch);
+    }
+
+    for (guint i = 0; i < connection->batched->len; i++) {
+        struct batched_request* request = &g_array_index(connection->batched, struct batched_request, i);
+        registry_entry_t entry;
+        gboolean known = registry_get(request->path, &entry);
+
+        if (request->type == WORKQUEUE_JOB_UNREGISTER || (known && entry.type != -1 && entry.registered)) {
+            g_string_append(response, "OK\n");
+        } else if (!known) {
+            g_string_append_printf(response, "ERROR %s is not a regular file\n", request->path);
+        } else if (entry.type == -1) {
+            g_string_append_printf(response, "ERROR %s is not an AppImage\n", request->path);
+        } else {
+            g_string_append_printf(response, "ERROR failed to register %s\n", request->path);
+        }
+
+        g_free(request->path);
+    }
+    g_array_set_size(connection->batched, 0);
+}
+
+static void handle_request(struct connection* connection, char* line, GString* response) {
+    control_server_t* server = connection->server;
+
+    g_strstrip(line);
+    if (*line == '\0') {
+        return;
+    }
+
+    char* argument = strchr(line, ' ');
+    if (argument != NULL) {
+        *argument++ = '\0';
+        argument = g_strchug(argument);
+    }
+
+    gboolean is_job = strcmp(line, "register") == 0 || strcmp(line, "unregister") == 0;
+    gboolean needs_path = is_job || strcmp(line, "rescan") == 0;
+    gboolean has_path = argument != NULL && g_path_is_absolute(argument);
+
+    // answers are sent in the order of the requests
+    if (!is_job || !has_path) {
+        flush_batch(connection, response);
+    }
+
+    if (needs_path && !has_path) {
+        g_string_append_printf(response, "ERROR %s requires an absolute path\n", line);
+    } else if (is_job) {
+        struct batched_request request;
+        request.type = strcmp(line, "register") == 0 ? WORKQUEUE_JOB_REGISTER : WORKQUEUE_JOB_UNREGISTER;
+        request.path = g_strdup(argument);
+        g_array_append_val(connection->batched, request);
+        workqueue_push_batched(server->queue, connection->batch, request.type, request.path);
+    } else if (strcmp(line, "list") == 0) {
+        handle_list(response);
+    } else if (strcmp(line, "rescan") == 0) {
+        if (server->rescan(argument, server->user_data)) {
+            g_string_append(response, "OK\n");
+        } else {
+            g_string_append_printf(response, "ERROR %s is not watched\n", argument);
+        }
+    } else if (strcmp(line, "purge") == 0) {
+        handle_purge(server, response);
+    } else if (strcmp(line, "reconcile") == 0) {
+        g_string_append_printf(response, "DATA %u\nOK\n", server->reconcile(server->user_data));
+    } else if (strcmp(line, "stats") == 0) {
+        handle_stats(response);
+    } else {
+        g_string_append_printf(response, "ERROR unknown request: %s\n", line);
+    }
+}
+
+static void* connection_main(void* arguments) {
+    struct connection* connection = arguments;
+    GString* input = g_string_new(NULL);
+    GString* response = g_string_new(NULL);
+    char buffer[4096];
+
+    connection->batch = workqueue_batch_new();
+    connection->batched = g_array_new(FALSE, FALSE, sizeof(struct batched_request));
+
+    while (TRUE) {
+        ssize_t n_read = read(connection->fd, buffer, sizeof(buffer));
+        if (n_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n_read <= 0) {
+            break;
+        }
+        g_string_append_len(input, buffer, n_read);
+
+        // all requests which arrived together are queued before the first one is answered
+        char* newline;
+        while ((newline = memchr(input->str, '\n', input->len)) != NULL) {
+            char* line = g_strndup(input->str, newline - input->str);
+            g_string_erase(input, 0, newline - input->str + 1);
+            handle_request(connection, line, response);
+            g_free(line);
+        }
+        flush_batch(connection, response);
+
+        if (input->len > MAX_REQUEST_LENGTH) {
+            g_string_append(response, "ERROR request too long\n");
+        }
+
+        if (!send_all(connection->fd, response->str, response->len) || input->len > MAX_REQUEST_LENGTH) {
+            break;
+        }
+        g_string_truncate(response, 0);
+    }
+
+    close(connection->fd);
+    g_array_free(connection->batched, TRUE);
+    workqueue_batch_free(connection->batch);
+    g_string_free(input, TRUE);
+    g_string_free(response, TRUE);
+    g_free(connection);
+    return NULL;
+}
+
+// only the user running the daemon may control it, even if the socket's directory is accessible to others
+static gboolean is_same_user(int fd) {
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0 && credentials.uid == geteuid();
+}
+
+static void* server_main(void* arguments) {
+    control_server_t* server = arguments;
+
+    while (TRUE) {
+        int fd = accept4(server->fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            // the socket was shut down by control_server_free()
+            break;
+        }
+
+        if (!is_same_user(fd)) {
+            close(fd);
+            continue;
+        }
+
+        struct connection* connection = g_new0(struct connection, 1);
+        connection->server = server;
+        connection->fd = fd;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, connection_main, connection) != 0) {
+            logger_print(LOGGER_LEVEL_ERROR, "Failed to create control connection thread");
+            close(fd);
+            g_free(connection);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    return NULL;
+}
+
+static int listen_on(const char* socket_path) {
+    struct sockaddr_un address;
+    if (!make_address(&address, socket_path)) {
+        return -1;
+    }
+
+    gchar* dirname = g_path_get_dirname(socket_path);
+    g_mkdir_with_parents(dirname, 0700);
+    g_free(dirname);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to create control socket: %s", strerror(errno));
+        return -1;
+    }
+
+    int result = bind(fd, (struct sockaddr*) &address, sizeof(address));
+    if (result != 0 && errno == EADDRINUSE) {
+        int other = connect_to(socket_path);
+        if (other >= 0) {
+            close(other);
+            logger_print(LOGGER_LEVEL_ERROR, "Another appimaged is listening on %s already", socket_path);
+            close(fd);
+            return -1;
+        }
+
+        // left behind by a daemon which didn't exit cleanly
+        unlink(socket_path);
+        result = bind(fd, (struct sockaddr*) &address, sizeof(address));
+    }
+
+    if (result != 0 || listen(fd, SOMAXCONN) != 0) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to listen on %s: %s", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+control_server_t* control_server_new(const char* socket_path, workqueue_t* queue, control_rescan_func_t rescan,
+                                     control_reconcile_func_t reconcile, void* user_data) {
+    int fd = listen_on(socket_path);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    control_server_t* server = g_new0(control_server_t, 1);
+    server->fd = fd;
+    server->socket_path = g_strdup(socket_path);
+    server->queue = queue;
+    server->rescan = rescan;
+    server->reconcile = reconcile;
+    server->user_data = user_data;
+
+    if (pthread_create(&server->thread, NULL, server_main, server) != 0) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to create control socket thread");
+        close(fd);
+        unlink(socket_path);
+        g_free(server->socket_path);
+        g_free(server);
+        return NULL;
+    }
+
+    return server;
+}
+
+void control_server_free(control_server_t* server) {
+    if (server == NULL) {
+        return;
+    }
+
+    // wakes up the thread blocked in accept(); connections which are still open finish on their own
+    shutdown(server->fd, SHUT_RDWR);
+    pthread_join(server->thread, NULL);
+    close(server->fd);
+    unlink(server->socket_path);
+
+    g_free(server->socket_path);
+    g_free(server);
+}
+
+int control_client_run(const char* socket_path, const char* request) {
+    if (strchr(request, '\n') != NULL) {
+        fprintf(stderr, "Invalid request: %s\n", request);
+        return 1;
+    }
+
+    int fd = connect_to(socket_path);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to connect to appimaged at %s: %s\n", socket_path, strerror(errno));
+        return 1;
+    }
+
+    gchar* line = g_strconcat(request, "\n", NULL);
+    gboolean sent = send_all(fd, line, strlen(line));
+    g_free(line);
+    if (!sent) {
+        fprintf(stderr, "Failed to send request: %s\n", strerror(errno));
+        close(fd);
+        return 1;
+    }
+    shutdown(fd, SHUT_WR);
+
+    // the connection is closed by the daemon once the request is answered
+    GString* input = g_string_new(NULL);
+    char buffer[4096];
+    ssize_t n_read;
+    while ((n_read = read(fd, buffer, sizeof(buffer))) != 0) {
+        if (n_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n_read < 0) {
+            break;
+        }
+        g_string_append_len(input, buffer, n_read);
+    }
+    close(fd);
+
+    int exit_code = 1;
+    gchar** lines = g_strsplit(input->str, "\n", -1);
+    for (gchar** current = lines; *current != NULL; current++) {
+        if (g_str_has_prefix(*current, "DATA ")) {
+            printf("%s\n", *current + strlen("DATA "));
+        } else if (strcmp(*current, "OK") == 0) {
+            exit_code = 0;
+        } else if (g_str_has_prefix(*current, "ERROR ")) {
+            fprintf(stderr, "Error: %s\n", *current + strlen("ERROR "));
+        }
+    }
+    g_strfreev(lines);
+
+    if (exit_code != 0 && input->len == 0) {
+        fprintf(stderr, "No answer from appimaged\n");
+    }
+    g_string_free(input, TRUE);
+    return exit_code;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <glib.h>
+
+#include "workqueue.h"
+
+/* Unix domain socket through which a running daemon can be queried and driven,
+ * e.g., by "appimaged --control list".
+ *
+ * Every request is a single line, and is answered with any number of lines
+ * starting with "DATA ", followed by "OK" or "ERROR <message>":
+ *   list               one "DATA <type>\t<registered|pending>\t<path>" line per AppImage in the registry
+ *   register PATH      register PATH, and answer once the registration is complete
+ *   unregister PATH    remove the integration of PATH
+ *   rescan DIR         look at the watched directories at or below DIR again
+ *   purge              remove the integration of all AppImages in the registry
+ *   reconcile          remove the integration files of AppImages which don't exist anymore, "DATA <count>"
+ *   stats              the statistics of the daemon, one DATA line per line of text
+ *
+ * Clients may send several requests without waiting for the answers. Register and
+ * unregister requests received together are queued at once and answered in order
+ * when all of them are done. */
+
+typedef struct control_server control_server_t;
+
+// rescan the watched directories at or below dir_path, returns FALSE if there are none
+typedef gboolean (*control_rescan_func_t)(const char* dir_path, void* user_data);
+
+// remove the integration files of AppImages which don't exist anymore, returns how many AppImages were cleaned up
+typedef guint (*control_reconcile_func_t)(void* user_data);
+
+/* Listen on socket_path, unless another daemon listens there already. Requests are
+ * handled by threads of their own, jobs are pushed to queue. */
+control_server_t* control_server_new(const char* socket_path, workqueue_t* queue, control_rescan_func_t rescan,
+                                     control_reconcile_func_t reconcile, void* user_data);
+
+void control_server_free(control_server_t* server);
+
+// send request to the daemon listening on socket_path and print the answer; returns the exit code
+int control_client_run(const char* socket_path, const char* request);
@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <sys/sysmacros.h>
+
+#include <glib.h>
+
+#include "devices.h"
+
+// st_dev -> whether the device is rotational
+static GHashTable* rotational_devices = NULL;
+static GMutex devices_mutex;
+
+// the value of a sysfs attribute which is 0 or 1, -1 if it can't be read
+static int read_flag(const char* path) {
+    gchar* contents = NULL;
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        return -1;
+    }
+    int flag = contents[0] == '1' ? 1 : (contents[0] == '0' ? 0 : -1);
+    g_free(contents);
+    return flag;
+}
+
+static gboolean lookup_rotational(dev_t dev) {
+    // anonymous devices, which have no queue
+    if (major(dev) == 0) {
+        return FALSE;
+    }
+
+    gchar* device_dir = g_strdup_printf("/sys/dev/block/%u:%u", major(dev), minor(dev));
+    gchar* path = g_build_filename(device_dir, "queue", "rotational", NULL);
+    int rotational = read_flag(path);
+    g_free(path);
+
+    // partitions have no queue of their own, their directory is inside that of the disk
+    if (rotational < 0) {
+        path = g_build_filename(device_dir, "..", "queue", "rotational", NULL);
+        rotational = read_flag(path);
+        g_free(path);
+    }
+    g_free(device_dir);
+
+    return rotational == 1;
+}
+
+gboolean device_is_rotational(dev_t dev) {
+    guint64 key = dev;
+
+    g_mutex_lock(&devices_mutex);
+    if (rotational_devices == NULL) {
+        rotational_devices = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+    }
+
+    gpointer value;
+    if (!g_hash_table_lookup_extended(rotational_devices, &key, NULL, &value)) {
+        guint64* stored_key = g_new(guint64, 1);
+        *stored_key = key;
+        value = GINT_TO_POINTER(lookup_rotational(dev));
+        g_hash_table_insert(rotational_devices, stored_key, value);
+    }
+    g_mutex_unlock(&devices_mutex);
+
+    return GPOINTER_TO_INT(value);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <glib.h>
+
+/* Tells rotational disks apart from SSDs, so that work on files on spinning disks
+ * can be serialized instead of making the heads seek between parallel reads.
+ *
+ * The answer comes from /sys/dev/block/<major>:<minor>/queue/rotational, or the one
+ * of the whole disk for a partition, and is cached per device. File systems without
+ * a block device (tmpfs, FUSE, network file systems, btrfs subvolumes, ...) count
+ * as non-rotational, the kernel doesn't know where their data ends up. */
+
+// whether dev, the st_dev of a file, is a rotational disk; safe to call from any thread
+gboolean device_is_rotational(dev_t dev);
@@ -0,0 +1,107 @@
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "fingerprint.h"
+
+#define ELF_HEADER_SIZE 64
+#define SQUASHFS_SUPERBLOCK_SIZE 96
+#define ISO9660_DESCRIPTOR_OFFSET 32768
+#define ISO9660_DESCRIPTOR_SIZE 2048
+
+#define HASH_CHUNK_SIZE (64 * 1024)
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static guint64 hash_bytes(guint64 hash, const unsigned char* data, gsize length) {
+    for (gsize i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+// hash length bytes at offset, or as many as there are
+static guint64 hash_region(guint64 hash, int fd, off_t offset, gsize length) {
+    unsigned char buffer[ISO9660_DESCRIPTOR_SIZE];
+    ssize_t n = pread(fd, buffer, MIN(length, sizeof(buffer)), offset);
+    return n > 0 ? hash_bytes(hash, buffer, (gsize) n) : hash;
+}
+
+static guint64 read_number(const unsigned char* data, gsize size, gboolean big_endian) {
+    guint64 value = 0;
+    for (gsize i = 0; i < size; i++) {
+        value |= (guint64) data[big_endian ? size - 1 - i : i] << (8 * i);
+    }
+    return value;
+}
+
+// where the ELF file ends, i.e., the offset of the image appended to the runtime, 0 if it isn't an ELF file
+static off_t get_elf_size(const unsigned char* header, gsize length) {
+    if (length < ELF_HEADER_SIZE || memcmp(header, "\x7f" "ELF", 4) != 0) {
+        return 0;
+    }
+
+    // the section headers come last in the runtime
+    gboolean is_64_bit = header[4] == 2;
+    gboolean big_endian = header[5] == 2;
+    guint64 section_headers = read_number(header + (is_64_bit ? 0x28 : 0x20), is_64_bit ? 8 : 4, big_endian);
+    guint64 section_header_size = read_number(header + (is_64_bit ? 0x3a : 0x2e), 2, big_endian);
+    guint64 n_section_headers = read_number(header + (is_64_bit ? 0x3c : 0x30), 2, big_endian);
+
+    return (off_t) (section_headers + section_header_size * n_section_headers);
+}
+
+guint64 fingerprint_compute(int fd, const struct stat* st) {
+    guint64 size = (guint64) st->st_size;
+    guint64 hash = hash_bytes(FNV_OFFSET_BASIS, (const unsigned char*) &size, sizeof(size));
+
+    unsigned char header[ELF_HEADER_SIZE];
+    ssize_t n = pread(fd, header, sizeof(header), 0);
+    if (n > 0) {
+        hash = hash_bytes(hash, header, (gsize) n);
+    }
+
+    off_t elf_size = get_elf_size(header, n > 0 ? (gsize) n : 0);
+    if (elf_size > 0 && elf_size < st->st_size) {
+        hash = hash_region(hash, fd, elf_size, SQUASHFS_SUPERBLOCK_SIZE);
+    }
+    if (st->st_size > ISO9660_DESCRIPTOR_OFFSET) {
+        hash = hash_region(hash, fd, ISO9660_DESCRIPTOR_OFFSET, ISO9660_DESCRIPTOR_SIZE);
+    }
+
+    return hash != 0 ? hash : 1;
+}
+
+gboolean fingerprint_compute_content_hash(int fd, const struct stat* st, guint8 content_hash[CONTENT_HASH_SIZE]) {
+    unsigned char header[ELF_HEADER_SIZE];
+    ssize_t n = pread(fd, header, sizeof(header), 0);
+    unsigned char iso_magic[5];
+
+    // a type 1 AppImage is an ISO 9660 image as a whole, a type 2 one has its squashfs image appended to the runtime
+    off_t offset = 0;
+    if (pread(fd, iso_magic, sizeof(iso_magic), ISO9660_DESCRIPTOR_OFFSET + 1) != sizeof(iso_magic)
+        || memcmp(iso_magic, "CD001", sizeof(iso_magic)) != 0) {
+        offset = get_elf_size(header, n > 0 ? (gsize) n : 0);
+        if (offset <= 0 || offset >= st->st_size) {
+            return FALSE;
+        }
+    }
+
+    GChecksum* checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    unsigned char* buffer = g_malloc(HASH_CHUNK_SIZE);
+    gboolean success = TRUE;
+    while (success && offset < st->st_size) {
+        size_t length = (size_t) MIN(st->st_size - offset, HASH_CHUNK_SIZE);
+        success = pread(fd, buffer, length, offset) == (ssize_t) length;
+        g_checksum_update(checksum, buffer, (gssize) length);
+        offset += (off_t) length;
+    }
+
+    gsize digest_length = CONTENT_HASH_SIZE;
+    g_checksum_get_digest(checksum, content_hash, &digest_length);
+    g_free(buffer);
+    g_checksum_free(checksum);
+    return success;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <glib.h>
+
+/* Cheap fingerprint of the contents of an AppImage, which tells a file that was
+ * replaced by another build apart from one that was only touched or rewritten as is.
+ *
+ * It covers the size, the ELF header of the runtime, the superblock of the squashfs
+ * image appended to it (type 2) and the ISO 9660 primary volume descriptor (type 1).
+ * The superblock and the volume descriptor hold the creation time and the size of the
+ * image, so any rebuild changes them; only a few kilobytes are read, never the whole file. */
+
+// the fingerprint of the file open as fd, st is its status; never 0, 0 means no fingerprint is known
+guint64 fingerprint_compute(int fd, const struct stat* st);
+
+// SHA-256
+#define CONTENT_HASH_SIZE 32
+
+/* Hash the file system image of the AppImage open as fd, i.e., everything its integration files are extracted
+ * from: the squashfs image after the runtime (type 2) or the ISO 9660 image (type 1). Reads the whole image, so
+ * it is computed once per registered AppImage and kept in the registry. Returns FALSE if the file can't be read. */
+gboolean fingerprint_compute_content_hash(int fd, const struct stat* st, guint8 content_hash[CONTENT_HASH_SIZE]);
@@ -0,0 +1,1040 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include <appimage/appimage.h>
+#include <xdg-basedir.h>
+
+#include "integration.h"
+#include "logger.h"
+#include "refresh.h"
+#include "transform.h"
+
+#define INTEGRATION_FILE_PREFIX "appimagekit_"
+// marks a desktop entry deployed by integration_deploy_preliminary_entry()
+#define PRELIMINARY_ENTRY_KEY "X-AppImaged-Preliminary"
+#define PRELIMINARY_ICON "application-x-executable"
+// length of the hex encoded MD5 digest following INTEGRATION_FILE_PREFIX
+#define DIGEST_LENGTH 32
+// integration files without a desktop entry are left alone for a while, they may belong to an ongoing registration
+#define ORPHAN_MIN_AGE 60
+
+struct move_context {
+    const char* old_path;
+    const char* path;
+    gchar* old_prefix;
+    gchar* new_prefix;
+    const char* old_md5;
+    const char* new_md5;
+    // link or copy the files instead of moving them, the AppImage at old_path keeps its integration files
+    gboolean copy;
+    guint moved_desktop_files;
+    gboolean failed;
+};
+
+// characters which require an argument in Exec to be quoted, according to the Desktop Entry Specification
+#define EXEC_RESERVED_CHARACTERS " \t\n\"'\\><~|&;$*?#()`"
+
+/* Quote path as an argument in Exec: in double quotes if it contains reserved characters, with ", `, $ and \
+ * escaped inside them, and with % doubled, which would start a field code otherwise. The result still needs
+ * to be escaped as a string, i.e., stored with g_key_file_set_string(). */
+static gchar* quote_exec_argument(const char* path) {
+    gboolean needs_quotes = strpbrk(path, EXEC_RESERVED_CHARACTERS) != NULL;
+    GString* quoted = g_string_new(needs_quotes ? "\"" : NULL);
+    for (const char* c = path; *c != '\0'; c++) {
+        if (needs_quotes && strchr("\"`$\\", *c) != NULL) {
+            g_string_append_c(quoted, '\\');
+        } else if (*c == '%') {
+            g_string_append_c(quoted, '%');
+        }
+        g_string_append_c(quoted, *c);
+    }
+    if (needs_quotes) {
+        g_string_append_c(quoted, '"');
+    }
+    return g_string_free(quoted, FALSE);
+}
+
+// the arguments following the program in Exec, which may be quoted itself
+static const gchar* get_exec_arguments(const gchar* exec) {
+    const gchar* c = exec;
+    if (*c == '"') {
+        for (c++; *c != '\0' && *c != '"'; c++) {
+            if (*c == '\\' && c[1] != '\0') {
+                c++;
+            }
+        }
+        return *c == '"' ? c + 1 : c;
+    }
+    return strchr(exec, ' ');
+}
+
+/* The program in Exec, without the quotes and escapes added by quote_exec_argument(). *arguments is set to the
+ * arguments following it, see get_exec_arguments(). */
+static gchar* get_exec_program(const gchar* exec, const gchar** arguments) {
+    *arguments = get_exec_arguments(exec);
+    const gchar* end = *arguments != NULL ? *arguments : exec + strlen(exec);
+    gboolean quoted = *exec == '"';
+
+    GString* program = g_string_new(NULL);
+    for (const gchar* c = quoted ? exec + 1 : exec; c < end && !(quoted && *c == '"'); c++) {
+        if ((quoted && *c == '\\' && c + 1 < end) || (*c == '%' && c[1] == '%')) {
+            c++;
+        }
+        g_string_append_c(program, *c);
+    }
+    return g_string_free(program, FALSE);
+}
+
+// Exec with quoted_path as the program if the program is old_path, NULL if it is another one
+static gchar* rewrite_exec(const gchar* exec, const char* old_path, const gchar* quoted_path) {
+    const gchar* arguments;
+    gchar* program = get_exec_program(exec, &arguments);
+    gboolean matches = strcmp(program, old_path) == 0;
+    g_free(program);
+
+    // entries written by libappimage may have a path with spaces in it which isn't quoted
+    gsize length = strlen(old_path);
+    if (!matches && *exec != '"' && strncmp(exec, old_path, length) == 0
+        && (exec[length] == ' ' || exec[length] == '\0')) {
+        matches = TRUE;
+        arguments = exec + length;
+    }
+
+    return matches ? g_strconcat(quoted_path, arguments, NULL) : NULL;
+}
+
+// the name an icon deployed for the AppImage at old_path has for the one at path, NULL if it isn't such an icon
+static gchar* rename_moved_icon(const gchar* name, gpointer data) {
+    const struct move_context* context = data;
+    gsize length = strlen(context->old_prefix);
+    if (strncmp(name, context->old_prefix, length) != 0 || name[length] != '_') {
+        return NULL;
+    }
+    return g_strconcat(context->new_prefix, name + length, NULL);
+}
+
+// whether the attribute at match, which starts with "icon", belongs to an icon or a generic-icon element
+static gboolean is_icon_element(const gchar* contents, const gchar* match) {
+    static const char generic[] = "<generic-";
+    gsize offset = match - contents;
+    return (offset >= 1 && match[-1] == '<')
+           || (offset >= strlen(generic) && strncmp(match - strlen(generic), generic, strlen(generic)) == 0);
+}
+
+/* Rewrite the names in the icon and generic-icon elements of a MIME package. rename_icon returns the new name of
+ * an icon, or NULL to keep it. */
+static gchar* rewrite_mime_package_icons(const gchar* contents, gchar* (*rename_icon)(const gchar* name, gpointer data),
+                                         gpointer data) {
+    static const char attribute[] = "icon name=\"";
+    GString* result = g_string_new(NULL);
+    const gchar* rest = contents;
+    const gchar* match;
+    while ((match = strstr(rest, attribute)) != NULL) {
+        const gchar* value = match + strlen(attribute);
+        const gchar* end = strchr(value, '"');
+        if (end == NULL) {
+            break;
+        }
+
+        g_string_append_len(result, rest, value - rest);
+        gchar* name = g_strndup(value, end - value);
+        gchar* new_name = is_icon_element(contents, match) ? rename_icon(name, data) : NULL;
+        g_string_append(result, new_name != NULL ? new_name : name);
+        g_free(new_name);
+        g_free(name);
+        rest = end;
+    }
+    g_string_append(result, rest);
+    return g_string_free(result, FALSE);
+}
+
+// write the file at to and remove the one at from, unless the files are copied
+static gboolean replace_moved_file(struct move_context* context, const gchar* from, const gchar* to,
+                                   const gchar* contents, gsize length) {
+    return g_file_set_contents(to, contents, (gssize) length, NULL) && (context->copy || unlink(from) == 0);
+}
+
+/* Desktop entries refer to the AppImage by its path (Exec, TryExec) and by its digest (Icon, X-AppImage-Identifier),
+ * in the main group and in the actions. Only those values are rewritten, and only if they refer to the AppImage as
+ * a whole, so that a path which merely starts with that of the AppImage, or an argument, is left alone. */
+static gboolean move_desktop_file(struct move_context* context, const gchar* from, const gchar* to) {
+    GKeyFile* desktop_entry = g_key_file_new();
+    if (!g_key_file_load_from_file(desktop_entry, from, G_KEY_FILE_KEEP_COMMENTS | G_KEY_FILE_KEEP_TRANSLATIONS,
+                                   NULL)) {
+        g_key_file_unref(desktop_entry);
+        return FALSE;
+    }
+
+    gchar* quoted_path = quote_exec_argument(context->path);
+    gchar** groups = g_key_file_get_groups(desktop_entry, NULL);
+    for (gchar** group = groups; *group != NULL; group++) {
+        gchar* exec = g_key_file_get_string(desktop_entry, *group, G_KEY_FILE_DESKTOP_KEY_EXEC, NULL);
+        gchar* new_exec = exec != NULL ? rewrite_exec(exec, context->old_path, quoted_path) : NULL;
+        if (new_exec != NULL) {
+            g_key_file_set_string(desktop_entry, *group, G_KEY_FILE_DESKTOP_KEY_EXEC, new_exec);
+        }
+
+        gchar* try_exec = g_key_file_get_string(desktop_entry, *group, G_KEY_FILE_DESKTOP_KEY_TRY_EXEC, NULL);
+        if (try_exec != NULL && strcmp(try_exec, context->old_path) == 0) {
+            g_key_file_set_string(desktop_entry, *group, G_KEY_FILE_DESKTOP_KEY_TRY_EXEC, context->path);
+        }
+
+        gchar* icon = g_key_file_get_string(desktop_entry, *group, G_KEY_FILE_DESKTOP_KEY_ICON, NULL);
+        gchar* new_icon = icon != NULL ? rename_moved_icon(icon, context) : NULL;
+        if (new_icon != NULL) {
+            g_key_file_set_string(desktop_entry, *group, G_KEY_FILE_DESKTOP_KEY_ICON, new_icon);
+        }
+
+        g_free(new_icon);
+        g_free(icon);
+        g_free(try_exec);
+        g_free(new_exec);
+        g_free(exec);
+    }
+    g_strfreev(groups);
+    g_free(quoted_path);
+
+    gchar* identifier = g_key_file_get_string(desktop_entry, G_KEY_FILE_DESKTOP_GROUP, "X-AppImage-Identifier", NULL);
+    if (identifier != NULL && strcmp(identifier, context->old_md5) == 0) {
+        g_key_file_set_string(desktop_entry, G_KEY_FILE_DESKTOP_GROUP, "X-AppImage-Identifier", context->new_md5);
+    }
+    g_free(identifier);
+
+    gsize length = 0;
+    gchar* contents = g_key_file_to_data(desktop_entry, &length, NULL);
+    gboolean success = replace_moved_file(context, from, to, contents, length);
+
+    g_free(contents);
+    g_key_file_unref(desktop_entry);
+    return success;
+}
+
+// MIME packages refer to the AppImage by its digest, in the names of the icons deployed for it
+static gboolean move_mime_package(struct move_context* context, const gchar* from, const gchar* to) {
+    gchar* contents = NULL;
+    if (!g_file_get_contents(from, &contents, NULL, NULL)) {
+        return FALSE;
+    }
+
+    gchar* rewritten = rewrite_mime_package_icons(contents, rename_moved_icon, context);
+    gboolean success = replace_moved_file(context, from, to, rewritten, strlen(rewritten));
+
+    g_free(rewritten);
+    g_free(contents);
+    return success;
+}
+
+/* Files which don't refer to the AppImage, i.e., icons, have the same contents for every copy of it, so they
+ * are stored once and hard linked. */
+static gboolean link_or_copy(const gchar* from, const gchar* to) {
+    unlink(to);
+    if (link(from, to) == 0) {
+        return TRUE;
+    }
+
+    gchar* contents = NULL;
+    gsize length = 0;
+    gboolean success = g_file_get_contents(from, &contents, &length, NULL)
+                       && g_file_set_contents(to, contents, (gssize) length, NULL);
+    g_free(contents);
+    return success;
+}
+
+static void move_files_in_dir(struct move_context* context, const gchar* dir_path, gboolean recursive) {
+    GDir* dir = g_dir_open(dir_path, 0, NULL);
+    if (dir == NULL) {
+        return;
+    }
+
+    const gchar* name;
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        gchar* from = g_build_filename(dir_path, name, NULL);
+
+        if (recursive && g_file_test(from, G_FILE_TEST_IS_DIR)) {
+            move_files_in_dir(context, from, recursive);
+        } else if (g_str_has_prefix(name, context->old_prefix)) {
+            gchar* new_name = g_strconcat(context->new_prefix, name + strlen(context->old_prefix), NULL);
+            gchar* to = g_build_filename(dir_path, new_name, NULL);
+
+            gboolean is_desktop_file = g_str_has_suffix(name, ".desktop");
+            gboolean success;
+            if (is_desktop_file) {
+                success = move_desktop_file(context, from, to);
+            } else if (g_str_has_suffix(name, ".xml")) {
+                success = move_mime_package(context, from, to);
+            } else if (context->copy) {
+                success = link_or_copy(from, to);
+            } else {
+                success = rename(from, to) == 0;
+            }
+
+            if (success) {
+                if (is_desktop_file) {
+                    context->moved_desktop_files++;
+                }
+                logger_print(LOGGER_LEVEL_DEBUG, "%s integration file %s to %s", context->copy ? "Copied" : "Moved",
+                             from, to);
+            } else {
+                logger_print(LOGGER_LEVEL_ERROR, "Failed to %s integration file %s to %s: %s",
+                             context->copy ? "copy" : "move", from, to, strerror(errno));
+                context->failed = TRUE;
+            }
+
+            g_free(to);
+            g_free(new_name);
+        }
+
+        g_free(from);
+    }
+
+    g_dir_close(dir);
+}
+
+static int transfer(const char* old_path, const char* path, gboolean copy) {
+    char* old_md5 = appimage_get_md5(old_path);
+    char* new_md5 = appimage_get_md5(path);
+    if (old_md5 == NULL || new_md5 == NULL) {
+        free(old_md5);
+        free(new_md5);
+        return 1;
+    }
+
+    struct move_context context;
+    memset(&context, 0, sizeof(context));
+    context.old_path = old_path;
+    context.path = path;
+    context.old_md5 = old_md5;
+    context.new_md5 = new_md5;
+    context.old_prefix = g_strconcat(INTEGRATION_FILE_PREFIX, old_md5, NULL);
+    context.new_prefix = g_strconcat(INTEGRATION_FILE_PREFIX, new_md5, NULL);
+    context.copy = copy;
+
+    char* data_home = xdg_data_home();
+    gchar* applications_dir = g_build_filename(data_home, "applications", NULL);
+    gchar* icons_dir = g_build_filename(data_home, "icons", NULL);
+    gchar* mime_packages_dir = g_build_filename(data_home, "mime", "packages", NULL);
+    free(data_home);
+
+    if (copy) {
+        // the desktop entry marks the AppImage as registered, so it comes last
+        move_files_in_dir(&context, icons_dir, TRUE);
+        move_files_in_dir(&context, mime_packages_dir, FALSE);
+        if (!context.failed) {
+            move_files_in_dir(&context, applications_dir, FALSE);
+        }
+    } else {
+        move_files_in_dir(&context, applications_dir, FALSE);
+
+        // without a desktop file there's nothing worth moving, let the caller register the AppImage properly
+        if (context.moved_desktop_files > 0) {
+            move_files_in_dir(&context, icons_dir, TRUE);
+            move_files_in_dir(&context, mime_packages_dir, FALSE);
+        }
+    }
+
+    int result = (context.failed || context.moved_desktop_files == 0) ? 1 : 0;
+
+    g_free(mime_packages_dir);
+    g_free(icons_dir);
+    g_free(applications_dir);
+    g_free(context.old_prefix);
+    g_free(context.new_prefix);
+    free(old_md5);
+    free(new_md5);
+
+    return result;
+}
+
+int integration_move(const char* old_path, const char* path) {
+    return transfer(old_path, path, FALSE);
+}
+
+int integration_copy(const char* source_path, const char* path) {
+    return transfer(source_path, path, TRUE);
+}
+
+gchar* integration_get_file_prefix(const char* path) {
+    char* md5 = appimage_get_md5(path);
+    if (md5 == NULL) {
+        return NULL;
+    }
+
+    gchar* prefix = g_strconcat(INTEGRATION_FILE_PREFIX, md5, NULL);
+    free(md5);
+    return prefix;
+}
+
+gboolean integration_has_mime_packages(const char* path) {
+    gchar* prefix = integration_get_file_prefix(path);
+    if (prefix == NULL) {
+        return FALSE;
+    }
+
+    char* data_home = xdg_data_home();
+    gchar* mime_packages_dir = g_build_filename(data_home, "mime", "packages", NULL);
+    free(data_home);
+
+    gboolean found = FALSE;
+    GDir* dir = g_dir_open(mime_packages_dir, 0, NULL);
+    if (dir != NULL) {
+        const gchar* name;
+        while (!found && (name = g_dir_read_name(dir)) != NULL) {
+            found = g_str_has_prefix(name, prefix);
+        }
+        g_dir_close(dir);
+    }
+
+    g_free(prefix);
+    g_free(mime_packages_dir);
+    return found;
+}
+
+// name of the desktop file in the root directory of the AppImage, NULL if there is none
+static gchar* find_desktop_file(const char* path) {
+    char** files = appimage_list_files(path);
+    if (files == NULL) {
+        return NULL;
+    }
+
+    gchar* desktop_file = NULL;
+    for (char** file = files; *file != NULL && desktop_file == NULL; file++) {
+        const char* name = **file == '/' ? *file + 1 : *file;
+        if (strchr(name, '/') == NULL && g_str_has_suffix(name, ".desktop")) {
+            desktop_file = g_strdup(*file);
+        }
+    }
+    appimage_string_list_free(files);
+
+    return desktop_file;
+}
+
+// the main group and the actions launch the AppImage
+static gboolean is_launcher_group(const gchar* group) {
+    return strcmp(group, G_KEY_FILE_DESKTOP_GROUP) == 0 || g_str_has_prefix(group, "Desktop Action ");
+}
+
+// point Exec of the entry and of all its actions to the AppImage, keeping the arguments, and TryExec to the AppImage
+static void set_exec(GKeyFile* desktop_entry, const char* path) {
+    gchar* quoted_path = quote_exec_argument(path);
+
+    gchar** groups = g_key_file_get_groups(desktop_entry, NULL);
+    for (gchar** group = groups; *group != NULL; group++) {
+        if (!is_launcher_group(*group)) {
+            continue;
+        }
+
+        gchar* old_exec = g_key_file_get_string(desktop_entry, *group, G_KEY_FILE_DESKTOP_KEY_EXEC, NULL);
+        // an action without Exec can't be launched anyway
+        if (old_exec == NULL && strcmp(*group, G_KEY_FILE_DESKTOP_GROUP) != 0) {
+            continue;
+        }
+
+        const gchar* arguments = old_exec != NULL ? get_exec_arguments(old_exec) : NULL;
+        gchar* exec = g_strconcat(quoted_path, arguments, NULL);
+        g_key_file_set_string(desktop_entry, *group, G_KEY_FILE_DESKTOP_KEY_EXEC, exec);
+        g_free(exec);
+        g_free(old_exec);
+    }
+    g_strfreev(groups);
+
+    g_key_file_set_string(desktop_entry, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_TRY_EXEC, path);
+    g_free(quoted_path);
+}
+
+// the same check as appimage_shall_not_be_integrated(), which would read the desktop file from the AppImage again
+static gboolean shall_not_be_integrated(GKeyFile* desktop_entry) {
+    gchar* integrate = g_key_file_get_value(desktop_entry, G_KEY_FILE_DESKTOP_GROUP, "X-AppImage-Integrate", NULL);
+    gboolean result = integrate != NULL && g_ascii_strcasecmp(g_strstrip(integrate), "false") == 0;
+    g_free(integrate);
+    return result;
+}
+
+int integration_deploy_preliminary_entry(const probe_t* probe) {
+    const char* path = probe->path;
+    if (probe->md5 == NULL) {
+        return 1;
+    }
+
+    gchar* desktop_file = find_desktop_file(path);
+    if (desktop_file == NULL) {
+        return 1;
+    }
+
+    char* buffer = NULL;
+    unsigned long buffer_size = 0;
+    if (!appimage_read_file_into_buffer_following_symlinks(path, desktop_file, &buffer, &buffer_size)) {
+        g_free(desktop_file);
+        return 1;
+    }
+
+    gchar* prefix = g_strconcat(INTEGRATION_FILE_PREFIX, probe->md5, NULL);
+    GKeyFile* desktop_entry = g_key_file_new();
+    int result = 1;
+
+    if (g_key_file_load_from_data(desktop_entry, buffer, buffer_size,
+                                  G_KEY_FILE_KEEP_COMMENTS | G_KEY_FILE_KEEP_TRANSLATIONS, NULL)
+        && !shall_not_be_integrated(desktop_entry)) {
+        set_exec(desktop_entry, path);
+        g_key_file_set_value(desktop_entry, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_ICON, PRELIMINARY_ICON);
+        g_key_file_set_boolean(desktop_entry, G_KEY_FILE_DESKTOP_GROUP, PRELIMINARY_ENTRY_KEY, TRUE);
+        transform_apply(desktop_entry);
+
+        char* data_home = xdg_data_home();
+        gchar* applications_dir = g_build_filename(data_home, "applications", NULL);
+        gchar* basename = g_path_get_basename(desktop_file);
+        gchar* desktop_file_name = g_strdup_printf("%s-%s", prefix, basename);
+        gchar* desktop_file_path = g_build_filename(applications_dir, desktop_file_name, NULL);
+        free(data_home);
+
+        GError* error = NULL;
+        g_mkdir_with_parents(applications_dir, 0755);
+        if (g_key_file_save_to_file(desktop_entry, desktop_file_path, &error)) {
+            result = 0;
+            logger_print(LOGGER_LEVEL_DEBUG, "Deployed preliminary desktop entry %s", desktop_file_path);
+        } else {
+            logger_print(LOGGER_LEVEL_ERROR, "Failed to save the preliminary desktop entry %s: %s", desktop_file_path,
+                         error->message);
+            g_error_free(error);
+        }
+
+        g_free(desktop_file_path);
+        g_free(desktop_file_name);
+        g_free(basename);
+        g_free(applications_dir);
+    }
+
+    g_key_file_unref(desktop_entry);
+    g_free(prefix);
+    free(buffer);
+    g_free(desktop_file);
+    return result;
+}
+
+// file in the AppImage without a leading slash, appimage_list_files() returns both forms depending on the type
+static const char* strip_root(const char* file) {
+    return *file == '/' ? file + 1 : file;
+}
+
+static void make_parent_dirs(const gchar* target) {
+    gchar* target_dir = g_path_get_dirname(target);
+    g_mkdir_with_parents(target_dir, 0755);
+    g_free(target_dir);
+}
+
+// extract file from the AppImage to target, which is recorded in deployed so that it can be removed again
+static gboolean extract_to(const char* path, const char* file, const gchar* target, GPtrArray* deployed) {
+    make_parent_dirs(target);
+    unlink(target);
+    appimage_extract_file_following_symlinks(path, file, target);
+    if (!g_file_test(target, G_FILE_TEST_IS_REGULAR)) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to extract %s from %s to %s", file, path, target);
+        return FALSE;
+    }
+
+    g_ptr_array_add(deployed, g_strdup(target));
+    logger_print(LOGGER_LEVEL_DEBUG, "Extracted %s from %s to %s", file, path, target);
+    return TRUE;
+}
+
+// write the contents of an integration file to target, which is recorded in deployed so that it can be removed again
+static gboolean write_to(const gchar* target, const gchar* contents, gsize length, GPtrArray* deployed) {
+    make_parent_dirs(target);
+    GError* error = NULL;
+    if (!g_file_set_contents(target, contents, (gssize) length, &error)) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to write %s: %s", target, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    g_ptr_array_add(deployed, g_strdup(target));
+    return TRUE;
+}
+
+// the icon name of an icon file, i.e., without its extension, NULL if it isn't an icon
+static gchar* get_icon_name(const gchar* file_name) {
+    static const char* const extensions[] = {".png", ".svg", ".svgz", ".xpm"};
+    for (gsize i = 0; i < G_N_ELEMENTS(extensions); i++) {
+        if (g_str_has_suffix(file_name, extensions[i])) {
+            return g_strndup(file_name, strlen(file_name) - strlen(extensions[i]));
+        }
+    }
+    return NULL;
+}
+
+/* Deploy all icons of the AppImage, of any theme and context (applications, MIME types, actions, ...), below
+ * icons_dir, with their names prefixed. The names of the deployed icons are added to icon_names. Like libappimage,
+ * the .DirIcon stands in for the icon of the application if the AppImage doesn't contain it.
+ * Returns FALSE if an icon couldn't be deployed. */
+static gboolean deploy_icons(const char* path, char** files, const gchar* icon_name, const gchar* icons_dir,
+                             const gchar* prefix, GHashTable* icon_names, GPtrArray* deployed) {
+    const char* dir_icon = NULL;
+
+    for (char** file = files; *file != NULL; file++) {
+        const char* name = strip_root(*file);
+        if (strcmp(name, ".DirIcon") == 0) {
+            dir_icon = *file;
+            continue;
+        }
+
+        // usr/share/icons/<theme>/<size>/<context>/<icon name>.<extension>
+        if (!g_str_has_prefix(name, "usr/share/icons/")) {
+            continue;
+        }
+        gchar* base_name = g_path_get_basename(name);
+        gchar* name_of_icon = get_icon_name(base_name);
+        if (name_of_icon != NULL) {
+            gchar* relative_dir = g_path_get_dirname(name + strlen("usr/share/icons/"));
+            gchar* icon_file_name = g_strdup_printf("%s_%s", prefix, base_name);
+            gchar* target = g_build_filename(icons_dir, relative_dir, icon_file_name, NULL);
+            gboolean success = extract_to(path, *file, target, deployed);
+            g_free(target);
+            g_free(icon_file_name);
+            g_free(relative_dir);
+            if (!success) {
+                g_free(name_of_icon);
+                g_free(base_name);
+                return FALSE;
+            }
+            g_hash_table_add(icon_names, name_of_icon);
+        }
+        g_free(base_name);
+    }
+
+    if (icon_name == NULL || g_hash_table_contains(icon_names, icon_name) || dir_icon == NULL) {
+        return TRUE;
+    }
+
+    char* buffer = NULL;
+    unsigned long buffer_size = 0;
+    if (!appimage_read_file_into_buffer_following_symlinks(path, dir_icon, &buffer, &buffer_size)) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to read the .DirIcon of %s", path);
+        return FALSE;
+    }
+
+    // the .DirIcon is either a PNG of the largest size, usually, or an SVG
+    gboolean is_png = buffer_size >= 4 && memcmp(buffer, "\x89PNG", 4) == 0;
+    gchar* icon_file_name = g_strdup_printf("%s_%s.%s", prefix, icon_name, is_png ? "png" : "svg");
+    gchar* target = g_build_filename(icons_dir, "hicolor", is_png ? "256x256" : "scalable", "apps", icon_file_name,
+                                     NULL);
+    gboolean success = write_to(target, buffer, buffer_size, deployed);
+    if (success) {
+        g_hash_table_add(icon_names, g_strdup(icon_name));
+    }
+
+    g_free(target);
+    g_free(icon_file_name);
+    free(buffer);
+    return success;
+}
+
+struct deployed_icons {
+    const gchar* prefix;
+    // names of the icons deployed, without the prefix
+    GHashTable* icon_names;
+};
+
+// refer to the deployed icons in the icon and generic-icon elements of a MIME package, see rewrite_mime_package_icons()
+static gchar* prefix_deployed_icon(const gchar* name, gpointer data) {
+    const struct deployed_icons* icons = data;
+    return g_hash_table_contains(icons->icon_names, name) ? g_strdup_printf("%s_%s", icons->prefix, name) : NULL;
+}
+
+// deploy the MIME packages of the AppImage, returns FALSE if one of them couldn't be deployed
+static gboolean deploy_mime_packages(const char* path, char** files, const gchar* mime_packages_dir,
+                                     const gchar* prefix, GHashTable* icon_names, GPtrArray* deployed) {
+    static const char packages_dir[] = "usr/share/mime/packages/";
+    for (char** file = files; *file != NULL; file++) {
+        const char* name = strip_root(*file);
+        if (!g_str_has_prefix(name, packages_dir) || !g_str_has_suffix(name, ".xml")
+            || strchr(name + strlen(packages_dir), '/') != NULL) {
+            continue;
+        }
+
+        char* buffer = NULL;
+        unsigned long buffer_size = 0;
+        if (!appimage_read_file_into_buffer_following_symlinks(path, *file, &buffer, &buffer_size)) {
+            logger_print(LOGGER_LEVEL_ERROR, "Failed to read %s from %s", *file, path);
+            return FALSE;
+        }
+
+        gchar* contents = g_strndup(buffer, buffer_size);
+        struct deployed_icons icons = {prefix, icon_names};
+        gchar* rewritten = rewrite_mime_package_icons(contents, prefix_deployed_icon, &icons);
+        gchar* package_file_name = g_strdup_printf("%s_%s", prefix, name + strlen(packages_dir));
+        gchar* target = g_build_filename(mime_packages_dir, package_file_name, NULL);
+        gboolean success = write_to(target, rewritten, strlen(rewritten), deployed);
+
+        g_free(target);
+        g_free(package_file_name);
+        g_free(rewritten);
+        g_free(contents);
+        free(buffer);
+        if (!success) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* What write_edited_desktop_file() in libappimage does to the desktop entry, besides Exec and TryExec: the icons
+ * of the entry and its actions refer to the deployed ones, and the X-AppImage keys identify the AppImage. */
+static void set_integration_keys(GKeyFile* desktop_entry, const gchar* md5, const gchar* prefix,
+                                 GHashTable* icon_names) {
+    gchar** groups = g_key_file_get_groups(desktop_entry, NULL);
+    for (gchar** group = groups; *group != NULL; group++) {
+        if (!is_launcher_group(*group)) {
+            continue;
+        }
+
+        gchar* icon = g_key_file_get_string(desktop_entry, *group, G_KEY_FILE_DESKTOP_KEY_ICON, NULL);
+        if (icon == NULL) {
+            continue;
+        }
+
+        // some entries name the icon file rather than the icon
+        gchar* icon_name = get_icon_name(icon);
+        const gchar* name = icon_name != NULL ? icon_name : icon;
+        if (g_hash_table_contains(icon_names, name)) {
+            gchar* deployed_icon = g_strdup_printf("%s_%s", prefix, name);
+            g_key_file_set_string(desktop_entry, *group, G_KEY_FILE_DESKTOP_KEY_ICON, deployed_icon);
+            g_free(deployed_icon);
+            if (strcmp(*group, G_KEY_FILE_DESKTOP_GROUP) == 0) {
+                g_key_file_set_string(desktop_entry, *group, "X-AppImage-Old-Icon", icon);
+            }
+        }
+        g_free(icon_name);
+        g_free(icon);
+    }
+    g_strfreev(groups);
+
+    g_key_file_set_string(desktop_entry, G_KEY_FILE_DESKTOP_GROUP, "X-AppImage-Comment", "Generated by appimaged");
+    g_key_file_set_string(desktop_entry, G_KEY_FILE_DESKTOP_GROUP, "X-AppImage-Identifier", md5);
+}
+
+// write contents to a temporary file next to path and rename it over path, so that path is never missing or partial
+static gboolean replace_file(const gchar* path, const gchar* contents, gsize length) {
+    gchar* temp_path = g_strconcat(path, ".XXXXXX", NULL);
+    int fd = g_mkstemp(temp_path);
+    if (fd < 0) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to create a temporary file for %s: %s", path, strerror(errno));
+        g_free(temp_path);
+        return FALSE;
+    }
+
+    gboolean success = TRUE;
+    gsize written = 0;
+    while (success && written < length) {
+        ssize_t n = write(fd, contents + written, length - written);
+        if (n < 0 && errno != EINTR) {
+            success = FALSE;
+        } else if (n > 0) {
+            written += n;
+        }
+    }
+    success = success && fchmod(fd, 0644) == 0;
+    success = close(fd) == 0 && success;
+    success = success && rename(temp_path, path) == 0;
+
+    if (!success) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to replace %s: %s", path, strerror(errno));
+        unlink(temp_path);
+    }
+    g_free(temp_path);
+    return success;
+}
+
+int integration_complete_registration(const probe_t* probe) {
+    const char* path = probe->path;
+    if (probe->md5 == NULL || probe->desktop_file_path == NULL) {
+        return 1;
+    }
+
+    char** files = appimage_list_files(path);
+    if (files == NULL) {
+        return 1;
+    }
+
+    gchar* desktop_file = find_desktop_file(path);
+    char* buffer = NULL;
+    unsigned long buffer_size = 0;
+    if (desktop_file == NULL
+        || !appimage_read_file_into_buffer_following_symlinks(path, desktop_file, &buffer, &buffer_size)) {
+        g_free(desktop_file);
+        appimage_string_list_free(files);
+        return 1;
+    }
+
+    gchar* prefix = g_strconcat(INTEGRATION_FILE_PREFIX, probe->md5, NULL);
+    char* data_home = xdg_data_home();
+    gchar* icons_dir = g_build_filename(data_home, "icons", NULL);
+    gchar* mime_packages_dir = g_build_filename(data_home, "mime", "packages", NULL);
+    free(data_home);
+
+    GPtrArray* deployed = g_ptr_array_new_with_free_func(g_free);
+    GKeyFile* desktop_entry = g_key_file_new();
+    int result = 1;
+
+    if (g_key_file_load_from_data(desktop_entry, buffer, buffer_size,
+                                  G_KEY_FILE_KEEP_COMMENTS | G_KEY_FILE_KEEP_TRANSLATIONS, NULL)
+        && !shall_not_be_integrated(desktop_entry)) {
+        gchar* icon = g_key_file_get_string(desktop_entry, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_ICON, NULL);
+        gchar* icon_name = icon != NULL && strchr(icon, '/') == NULL ? get_icon_name(icon) : NULL;
+        if (icon_name == NULL && icon != NULL && *icon != '\0' && strchr(icon, '/') == NULL) {
+            icon_name = g_strdup(icon);
+        }
+
+        GHashTable* icon_names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        if (deploy_icons(path, files, icon_name, icons_dir, prefix, icon_names, deployed)
+            && deploy_mime_packages(path, files, mime_packages_dir, prefix, icon_names, deployed)) {
+            set_exec(desktop_entry, path);
+            set_integration_keys(desktop_entry, probe->md5, prefix, icon_names);
+            transform_apply(desktop_entry);
+
+            // the desktop entry marks the registration as completed, so it comes last
+            gsize length = 0;
+            gchar* data = g_key_file_to_data(desktop_entry, &length, NULL);
+            if (replace_file(probe->desktop_file_path, data, length)) {
+                result = 0;
+                logger_print(LOGGER_LEVEL_DEBUG, "Completed desktop entry %s", probe->desktop_file_path);
+            }
+            g_free(data);
+        }
+
+        g_hash_table_destroy(icon_names);
+        g_free(icon_name);
+        g_free(icon);
+    }
+
+    // the preliminary entry stays in place, without the files which were extracted for the complete one
+    if (result != 0) {
+        for (guint i = 0; i < deployed->len; i++) {
+            unlink(g_ptr_array_index(deployed, i));
+        }
+    }
+
+    g_ptr_array_unref(deployed);
+    g_key_file_unref(desktop_entry);
+    g_free(mime_packages_dir);
+    g_free(icons_dir);
+    g_free(prefix);
+    free(buffer);
+    g_free(desktop_file);
+    appimage_string_list_free(files);
+    return result;
+}
+
+gboolean integration_is_preliminary(const char* desktop_file_path) {
+    GKeyFile* desktop_entry = g_key_file_new();
+    gboolean preliminary = g_key_file_load_from_file(desktop_entry, desktop_file_path, G_KEY_FILE_NONE, NULL)
+                           && g_key_file_get_boolean(desktop_entry, G_KEY_FILE_DESKTOP_GROUP, PRELIMINARY_ENTRY_KEY, NULL);
+
+    g_key_file_unref(desktop_entry);
+    return preliminary;
+}
+
+// integration files of one AppImage, found by integration_remove_orphans()
+struct orphan_candidate {
+    // path of the AppImage according to its desktop entry, NULL if unknown
+    gchar* appimage_path;
+    gboolean has_desktop_entry;
+    GPtrArray* files;
+    guint categories;
+    time_t newest_ctime;
+};
+
+static void orphan_candidate_free(struct orphan_candidate* candidate) {
+    g_free(candidate->appimage_path);
+    g_ptr_array_unref(candidate->files);
+    g_free(candidate);
+}
+
+// the prefix of an integration file's name, NULL if it isn't named like one
+static gchar* get_prefix_of_name(const gchar* name) {
+    if (!g_str_has_prefix(name, INTEGRATION_FILE_PREFIX)) {
+        return NULL;
+    }
+
+    const gchar* digest = name + strlen(INTEGRATION_FILE_PREFIX);
+    for (int i = 0; i < DIGEST_LENGTH; i++) {
+        if (!g_ascii_isxdigit(digest[i])) {
+            return NULL;
+        }
+    }
+
+    return g_strndup(name, strlen(INTEGRATION_FILE_PREFIX) + DIGEST_LENGTH);
+}
+
+/* The path of the AppImage a desktop entry was created for, as referred to by TryExec or Exec.
+ * The path has to match the prefix of the desktop file's name, so that, e.g., an interpreter
+ * in Exec isn't mistaken for the AppImage. */
+static gchar* get_appimage_of_desktop_file(const gchar* desktop_file_path, const gchar* prefix) {
+    GKeyFile* desktop_entry = g_key_file_new();
+    if (!g_key_file_load_from_file(desktop_entry, desktop_file_path, G_KEY_FILE_NONE, NULL)) {
+        g_key_file_unref(desktop_entry);
+        return NULL;
+    }
+
+    GPtrArray* candidates = g_ptr_array_new_with_free_func(g_free);
+    gchar* try_exec = g_key_file_get_string(desktop_entry, G_KEY_FILE_DESKTOP_GROUP,
+                                            G_KEY_FILE_DESKTOP_KEY_TRY_EXEC, NULL);
+    if (try_exec != NULL) {
+        g_ptr_array_add(candidates, try_exec);
+    }
+
+    gchar* exec = g_key_file_get_string(desktop_entry, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_EXEC, NULL);
+    gchar** argv = NULL;
+    if (exec != NULL && g_shell_parse_argv(exec, NULL, &argv, NULL)) {
+        for (gchar** argument = argv; *argument != NULL; argument++) {
+            g_ptr_array_add(candidates, g_strdup(*argument));
+        }
+        g_strfreev(argv);
+    }
+    g_free(exec);
+
+    gchar* appimage_path = NULL;
+    for (guint i = 0; i < candidates->len && appimage_path == NULL; i++) {
+        const gchar* candidate = g_ptr_array_index(candidates, i);
+        if (!g_path_is_absolute(candidate)) {
+            continue;
+        }
+
+        gchar* candidate_prefix = integration_get_file_prefix(candidate);
+        if (candidate_prefix != NULL && strcmp(candidate_prefix, prefix) == 0) {
+            appimage_path = g_strdup(candidate);
+        }
+        g_free(candidate_prefix);
+    }
+
+    g_ptr_array_unref(candidates);
+    g_key_file_unref(desktop_entry);
+    return appimage_path;
+}
+
+static void collect_candidates(GHashTable* candidates, const gchar* dir_path, gboolean recursive, guint category) {
+    GDir* dir = g_dir_open(dir_path, 0, NULL);
+    if (dir == NULL) {
+        return;
+    }
+
+    const gchar* name;
+    while ((name = g_dir_read_name(dir)) != NULL) {
+        gchar* file_path = g_build_filename(dir_path, name, NULL);
+        struct stat st;
+
+        if (lstat(file_path, &st) != 0) {
+            g_free(file_path);
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            if (recursive) {
+                collect_candidates(candidates, file_path, recursive, category);
+            }
+            g_free(file_path);
+            continue;
+        }
+
+        gchar* prefix = get_prefix_of_name(name);
+        if (prefix == NULL) {
+            g_free(file_path);
+            continue;
+        }
+
+        struct orphan_candidate* candidate = g_hash_table_lookup(candidates, prefix);
+        if (candidate == NULL) {
+            candidate = g_new0(struct orphan_candidate, 1);
+            candidate->files = g_ptr_array_new_with_free_func(g_free);
+            g_hash_table_insert(candidates, g_strdup(prefix), candidate);
+        }
+
+        if (category == REFRESH_DESKTOP_ENTRIES && g_str_has_suffix(name, ".desktop")) {
+            candidate->has_desktop_entry = TRUE;
+            if (candidate->appimage_path == NULL) {
+                candidate->appimage_path = get_appimage_of_desktop_file(file_path, prefix);
+            }
+        }
+        candidate->categories |= category;
+        candidate->newest_ctime = MAX(candidate->newest_ctime, st.st_ctime);
+        g_ptr_array_add(candidate->files, file_path);
+        g_free(prefix);
+    }
+
+    g_dir_close(dir);
+}
+
+// whether the integration files of candidate belong to an AppImage which is gone
+static gboolean is_orphaned(const gchar* prefix, const struct orphan_candidate* candidate,
+                            GHashTable* protected_prefixes, time_t now) {
+    if (candidate->appimage_path != NULL) {
+        struct stat st;
+        return stat(candidate->appimage_path, &st) != 0 && (errno == ENOENT || errno == ENOTDIR);
+    }
+
+    // a desktop entry which can't be traced back to an AppImage isn't ours to judge
+    if (candidate->has_desktop_entry) {
+        return FALSE;
+    }
+
+    // icons or MIME packages without a desktop entry, e.g., left behind by an interrupted unregistration
+    return (protected_prefixes == NULL || !g_hash_table_contains(protected_prefixes, prefix))
+           && candidate->newest_ctime + ORPHAN_MIN_AGE < now;
+}
+
+GPtrArray* integration_remove_orphans(GHashTable* protected_prefixes, GPtrArray* orphaned_paths, guint* categories) {
+    char* data_home = xdg_data_home();
+    gchar* applications_dir = g_build_filename(data_home, "applications", NULL);
+    gchar* icons_dir = g_build_filename(data_home, "icons", NULL);
+    gchar* mime_packages_dir = g_build_filename(data_home, "mime", "packages", NULL);
+    free(data_home);
+
+    GHashTable* candidates = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                                   (GDestroyNotify) orphan_candidate_free);
+    collect_candidates(candidates, applications_dir, FALSE, REFRESH_DESKTOP_ENTRIES);
+    collect_candidates(candidates, icons_dir, TRUE, REFRESH_ICONS);
+    collect_candidates(candidates, mime_packages_dir, FALSE, REFRESH_MIME);
+
+    GPtrArray* removed_prefixes = g_ptr_array_new_with_free_func(g_free);
+    *categories = 0;
+    time_t now = time(NULL);
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, candidates);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const gchar* prefix = key;
+        struct orphan_candidate* candidate = value;
+
+        // checked right before removing anything, the AppImage may have reappeared in the meantime
+        if (!is_orphaned(prefix, candidate, protected_prefixes, now)) {
+            continue;
+        }
+
+        for (guint i = 0; i < candidate->files->len; i++) {
+            const gchar* file_path = g_ptr_array_index(candidate->files, i);
+            if (unlink(file_path) != 0 && errno != ENOENT) {
+                logger_print(LOGGER_LEVEL_ERROR, "Failed to remove orphaned integration file %s: %s", file_path,
+                             strerror(errno));
+            } else {
+                logger_print(LOGGER_LEVEL_DEBUG, "Removed orphaned integration file %s", file_path);
+            }
+        }
+
+        *categories |= candidate->categories;
+        g_ptr_array_add(removed_prefixes, g_strdup(prefix));
+        if (candidate->appimage_path != NULL && orphaned_paths != NULL) {
+            g_ptr_array_add(orphaned_paths, g_strdup(candidate->appimage_path));
+        }
+    }
+
+    g_hash_table_unref(candidates);
+    g_free(mime_packages_dir);
+    g_free(icons_dir);
+    g_free(applications_dir);
+    return removed_prefixes;
+}
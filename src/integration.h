@@ -0,0 +1,49 @@
+#pragma once
+
+#include <glib.h>
+
+#include "probe.h"
+
+/* Helpers which operate on the integration files libappimage creates for a
+ * registered AppImage (desktop file, icons, MIME packages) in $XDG_DATA_HOME.
+ * These files are named after the MD5 digest of the AppImage's path. */
+
+/* Move the integration files of an AppImage which was moved from old_path to path,
+ * rewriting the references to its path and digest instead of extracting everything again.
+ * Returns 0 on success, non-zero if the caller needs to fall back to re-registering the AppImage. */
+int integration_move(const char* old_path, const char* path);
+
+/* Register the AppImage at path with the integration files of the registered AppImage at source_path, which has
+ * the same contents, instead of extracting them again. Icons are hard linked, the files which refer to the
+ * AppImage are rewritten. Returns 0 on success, non-zero if the AppImage needs to be registered from scratch. */
+int integration_copy(const char* source_path, const char* path);
+
+// common prefix of the names of the integration files of the AppImage at path, NULL on error
+gchar* integration_get_file_prefix(const char* path);
+
+// whether MIME packages are installed for the AppImage at path, i.e., whether (un)registering it affects the MIME database
+gboolean integration_has_mime_packages(const char* path);
+
+/* Deploy a preliminary desktop entry for the probed AppImage, which is read straight from the AppImage
+ * and refers to a generic icon, so that the application shows up in the menu without waiting for icons
+ * and MIME packages to be extracted. The entry is replaced once the registration is completed.
+ * Returns 0 on success, non-zero if the AppImage has to be registered in one go. */
+int integration_deploy_preliminary_entry(const probe_t* probe);
+
+/* Complete the registration of an AppImage whose preliminary entry is deployed: deploy its icons and MIME
+ * packages, and replace the preliminary entry with the complete one by renaming a temporary file over it.
+ * The entry is edited like libappimage's write_edited_desktop_file() does.
+ * The probe needs to know the deployed desktop entry, see probe_find_desktop_file(). Returns 0 on success;
+ * on failure the extracted files are removed again and the preliminary entry is left in place. */
+int integration_complete_registration(const probe_t* probe);
+
+// whether the deployed desktop entry at desktop_file_path is a preliminary one
+gboolean integration_is_preliminary(const char* desktop_file_path);
+
+/* Remove the integration files of AppImages which don't exist anymore, e.g., because they were deleted while
+ * appimaged wasn't running. Files are traced back to their AppImage through the desktop entries, so only the
+ * integration directories are read, never the directories the AppImages are in. Files without a desktop entry
+ * are removed as well, unless their prefix is in protected_prefixes (if non-NULL).
+ * Returns the prefixes of the AppImages whose files were removed, and sets categories to the refresh_category_t
+ * flags affected. The paths of the AppImages, as far as they are known, are added to orphaned_paths. */
+GPtrArray* integration_remove_orphans(GHashTable* protected_prefixes, GPtrArray* orphaned_paths, guint* categories);
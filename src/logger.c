@@ -0,0 +1,346 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include <glib.h>
+
+#include "logger.h"
+
+// messages per thread, a power of two so that the indices can wrap around
+#define RING_SIZE 128
+#define MESSAGE_SIZE 512
+
+struct message {
+    // for ordering the messages of different threads
+    gint64 monotonic_time;
+    gint64 real_time;
+    logger_level_t level;
+    gchar text[MESSAGE_SIZE];
+};
+
+/* Single producer, single consumer: head is only written by the thread which owns the ring,
+ * tail only by the writer thread. */
+struct ring {
+    guint head;
+    guint tail;
+    guint dropped;
+    // the thread exited, the writer frees the ring once it is drained
+    gboolean released;
+    long thread_id;
+    // the head when the writer last drained the ring, only used by the writer
+    guint drained_head;
+    struct message messages[RING_SIZE];
+};
+
+// a message which was drained but isn't written yet
+struct pending_message {
+    const struct ring* ring;
+    guint index;
+};
+
+static struct {
+    logger_level_t level;
+    gboolean json;
+    FILE* stream;
+    gboolean started;
+
+    // eventfd the writer sleeps on
+    int wakeup_fd;
+    // a wakeup was signalled and the writer hasn't started draining yet
+    gboolean wakeup_pending;
+    guint64 n_dropped;
+
+    // protects the list of rings and the drain counters, never taken when logging
+    GMutex mutex;
+    // signalled when a drain finished
+    GCond cond;
+    GList* rings;
+    guint64 n_drains_started;
+    guint64 n_drains_finished;
+} logger = {LOGGER_LEVEL_INFO};
+
+static const char* const level_names[] = {"error", "warning", "info", "debug"};
+
+static void release_ring(gpointer data) {
+    struct ring* ring = data;
+    __atomic_store_n(&ring->released, TRUE, __ATOMIC_RELEASE);
+}
+
+static GPrivate thread_ring = G_PRIVATE_INIT(release_ring);
+
+gboolean logger_parse_level(const char* name, logger_level_t* level) {
+    for (gsize i = 0; i < G_N_ELEMENTS(level_names); i++) {
+        if (g_ascii_strcasecmp(name, level_names[i]) == 0) {
+            *level = (logger_level_t) i;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+gboolean logger_is_enabled(logger_level_t level) {
+    return level <= __atomic_load_n(&logger.level, __ATOMIC_RELAXED);
+}
+
+static void append_json_string(GString* output, const char* string) {
+    g_string_append_c(output, '"');
+    for (const char* c = string; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            g_string_append_c(output, '\\');
+            g_string_append_c(output, *c);
+        } else if (*c == '\n') {
+            g_string_append(output, "\\n");
+        } else if ((unsigned char) *c < 0x20) {
+            g_string_append_printf(output, "\\u%04x", (unsigned char) *c);
+        } else {
+            g_string_append_c(output, *c);
+        }
+    }
+    g_string_append_c(output, '"');
+}
+
+static void format_message(GString* output, gint64 real_time, logger_level_t level, long thread_id,
+                           const char* text) {
+    if (!logger.json) {
+        g_string_append(output, text);
+        g_string_append_c(output, '\n');
+        return;
+    }
+
+    time_t seconds = (time_t) (real_time / G_USEC_PER_SEC);
+    struct tm tm;
+    char timestamp[32];
+    gmtime_r(&seconds, &tm);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    g_string_append_printf(output, "{\"time\": \"%s.%06dZ\", \"level\": \"%s\", \"thread\": %ld, \"message\": ",
+                           timestamp, (int) (real_time % G_USEC_PER_SEC), level_names[level], thread_id);
+    append_json_string(output, text);
+    g_string_append(output, "}\n");
+}
+
+static void write_output(GString* output, FILE* stream) {
+    if (output->len > 0) {
+        fwrite(output->str, 1, output->len, stream);
+        fflush(stream);
+        g_string_truncate(output, 0);
+    }
+}
+
+static gint compare_pending(gconstpointer a, gconstpointer b) {
+    const struct pending_message* first = a;
+    const struct pending_message* second = b;
+    if (first->ring == second->ring) {
+        // the index wraps around, but a ring never holds more than RING_SIZE messages
+        return (gint) (first->index - second->index);
+    }
+
+    gint64 first_time = first->ring->messages[first->index % RING_SIZE].monotonic_time;
+    gint64 second_time = second->ring->messages[second->index % RING_SIZE].monotonic_time;
+    return first_time < second_time ? -1 : first_time > second_time ? 1 : 0;
+}
+
+static void* writer_main(void* arguments) {
+    GArray* pending = g_array_new(FALSE, FALSE, sizeof(struct pending_message));
+    GString* output = g_string_new(NULL);
+    GString* errors = g_string_new(NULL);
+
+    while (TRUE) {
+        guint64 n_wakeups;
+        if (read(logger.wakeup_fd, &n_wakeups, sizeof(n_wakeups)) < 0 && errno != EINTR) {
+            fprintf(stderr, "Failed to wait for log messages: %s\n", strerror(errno));
+            break;
+        }
+        // must be reset before draining, so that messages logged from now on signal another wakeup
+        __atomic_store_n(&logger.wakeup_pending, FALSE, __ATOMIC_SEQ_CST);
+
+        g_mutex_lock(&logger.mutex);
+        guint64 drain = ++logger.n_drains_started;
+
+        guint dropped = 0;
+        for (GList* link = logger.rings; link != NULL; link = link->next) {
+            struct ring* ring = link->data;
+            ring->drained_head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+            for (guint index = ring->tail; index != ring->drained_head; index++) {
+                struct pending_message message = {ring, index};
+                g_array_append_val(pending, message);
+            }
+            dropped += __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        }
+
+        // the messages of one thread are in order already, those of different threads are merged by time
+        g_array_sort(pending, compare_pending);
+        for (guint i = 0; i < pending->len; i++) {
+            const struct pending_message* message = &g_array_index(pending, struct pending_message, i);
+            const struct message* entry = &message->ring->messages[message->index % RING_SIZE];
+            GString* target = !logger.json && entry->level <= LOGGER_LEVEL_WARNING ? errors : output;
+            format_message(target, entry->real_time, entry->level, message->ring->thread_id, entry->text);
+        }
+        g_array_set_size(pending, 0);
+
+        if (dropped > 0) {
+            __atomic_fetch_add(&logger.n_dropped, dropped, __ATOMIC_RELAXED);
+            gchar* text = g_strdup_printf("Dropped %u log messages, the output couldn't keep up", dropped);
+            format_message(logger.json ? output : errors, g_get_real_time(), LOGGER_LEVEL_WARNING,
+                           syscall(SYS_gettid), text);
+            g_free(text);
+        }
+
+        // the messages are copied, so their slots can be reused, and the rings of threads which exited can go
+        GList* link = logger.rings;
+        while (link != NULL) {
+            GList* next = link->next;
+            struct ring* ring = link->data;
+            __atomic_store_n(&ring->tail, ring->drained_head, __ATOMIC_RELEASE);
+            if (__atomic_load_n(&ring->released, __ATOMIC_ACQUIRE)
+                && __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == ring->tail) {
+                logger.rings = g_list_delete_link(logger.rings, link);
+                g_free(ring);
+            }
+            link = next;
+        }
+        g_mutex_unlock(&logger.mutex);
+
+        write_output(errors, stderr);
+        write_output(output, logger.stream);
+
+        g_mutex_lock(&logger.mutex);
+        logger.n_drains_finished = drain;
+        g_cond_broadcast(&logger.cond);
+        g_mutex_unlock(&logger.mutex);
+    }
+
+    // don't let logger_flush() wait forever
+    g_mutex_lock(&logger.mutex);
+    logger.n_drains_finished = G_MAXUINT64;
+    g_cond_broadcast(&logger.cond);
+    g_mutex_unlock(&logger.mutex);
+
+    g_array_free(pending, TRUE);
+    g_string_free(output, TRUE);
+    g_string_free(errors, TRUE);
+    return NULL;
+}
+
+static void wake_writer(void) {
+    if (!__atomic_exchange_n(&logger.wakeup_pending, TRUE, __ATOMIC_SEQ_CST)) {
+        guint64 one = 1;
+        // can only fail if the counter overflows, in which case the writer is woken up anyway
+        if (write(logger.wakeup_fd, &one, sizeof(one)) < 0) {
+            return;
+        }
+    }
+}
+
+gboolean logger_start(logger_level_t level, gboolean json, FILE* stream) {
+    logger.json = json;
+    logger.stream = stream;
+    __atomic_store_n(&logger.level, level, __ATOMIC_RELAXED);
+
+    logger.wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (logger.wakeup_fd < 0) {
+        fprintf(stderr, "Failed to create the logger's eventfd: %s\n", strerror(errno));
+        return FALSE;
+    }
+
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        fprintf(stderr, "Failed to create logger thread\n");
+        close(logger.wakeup_fd);
+        return FALSE;
+    }
+    pthread_detach(writer);
+
+    // exit() may be called from anywhere
+    atexit(logger_flush);
+    __atomic_store_n(&logger.started, TRUE, __ATOMIC_RELEASE);
+    return TRUE;
+}
+
+static struct ring* get_ring(void) {
+    struct ring* ring = g_private_get(&thread_ring);
+    if (ring == NULL) {
+        ring = g_new0(struct ring, 1);
+        ring->thread_id = syscall(SYS_gettid);
+        g_private_set(&thread_ring, ring);
+
+        g_mutex_lock(&logger.mutex);
+        logger.rings = g_list_prepend(logger.rings, ring);
+        g_mutex_unlock(&logger.mutex);
+    }
+    return ring;
+}
+
+void logger_print(logger_level_t level, const char* format, ...) {
+    if (!logger_is_enabled(level)) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, format);
+
+    if (!__atomic_load_n(&logger.started, __ATOMIC_ACQUIRE)) {
+        gchar* text = g_strdup_vprintf(format, args);
+        GString* output = g_string_new(NULL);
+        format_message(output, g_get_real_time(), level, syscall(SYS_gettid), text);
+        write_output(output, !logger.json && level <= LOGGER_LEVEL_WARNING ? stderr : stdout);
+        g_string_free(output, TRUE);
+        g_free(text);
+        va_end(args);
+        return;
+    }
+
+    struct ring* ring = get_ring();
+    guint head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= RING_SIZE) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        va_end(args);
+        return;
+    }
+
+    struct message* message = &ring->messages[head % RING_SIZE];
+    message->monotonic_time = g_get_monotonic_time();
+    message->real_time = g_get_real_time();
+    message->level = level;
+    if (g_vsnprintf(message->text, MESSAGE_SIZE, format, args) >= MESSAGE_SIZE) {
+        memcpy(message->text + MESSAGE_SIZE - 4, "...", 4);
+    }
+    va_end(args);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+    wake_writer();
+}
+
+void logger_flush(void) {
+    if (!__atomic_load_n(&logger.started, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    // only a drain which starts after this point is guaranteed to see all messages logged so far
+    g_mutex_lock(&logger.mutex);
+    guint64 drain = logger.n_drains_started + 1;
+    g_mutex_unlock(&logger.mutex);
+
+    __atomic_store_n(&logger.wakeup_pending, TRUE, __ATOMIC_SEQ_CST);
+    guint64 one = 1;
+    if (write(logger.wakeup_fd, &one, sizeof(one)) < 0) {
+        return;
+    }
+
+    g_mutex_lock(&logger.mutex);
+    while (logger.n_drains_finished < drain) {
+        g_cond_wait(&logger.cond, &logger.mutex);
+    }
+    g_mutex_unlock(&logger.mutex);
+}
+
+guint64 logger_get_n_dropped(void) {
+    return __atomic_load_n(&logger.n_dropped, __ATOMIC_RELAXED);
+}
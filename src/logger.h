@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <glib.h>
+
+/* Asynchronous logging.
+ *
+ * Every thread writes its messages into a ring buffer of its own without taking any lock,
+ * and a writer thread drains the buffers, merges the messages in the order they were logged
+ * and writes them out. Threads never wait for the output: when a thread logs faster than
+ * the messages can be written, e.g., while journald applies backpressure, the messages which
+ * don't fit into its buffer are dropped and counted, and the writer reports how many were lost.
+ *
+ * Until logger_start() is called, and in processes which never call it, messages are written
+ * synchronously. */
+
+typedef enum {
+    LOGGER_LEVEL_ERROR,
+    LOGGER_LEVEL_WARNING,
+    LOGGER_LEVEL_INFO,
+    LOGGER_LEVEL_DEBUG,
+} logger_level_t;
+
+// parses "error", "warning", "info" or "debug"
+gboolean logger_parse_level(const char* name, logger_level_t* level);
+
+/* Log the messages up to level from now on and start the writer thread. In text mode, errors and
+ * warnings are written to stderr and all other messages to stream; with json, every message is
+ * written to stream as a JSON object on a line of its own, with its time, level and thread ID. */
+gboolean logger_start(logger_level_t level, gboolean json, FILE* stream);
+
+gboolean logger_is_enabled(logger_level_t level);
+
+// printf-like, without a trailing newline; messages longer than 511 bytes are truncated
+void logger_print(logger_level_t level, const char* format, ...) G_GNUC_PRINTF(2, 3);
+
+// waits until the messages logged so far are written
+void logger_flush(void);
+
+// messages dropped so far because a thread's buffer was full
+guint64 logger_get_n_dropped(void);
@@ -30,11 +30,8 @@
  * Optional daempon to watch directories for AppImages
  * and register/unregister them with the system
  *
- * TODO (feel free to send pull requests):
- * - Switch to https://developer.gnome.org/gio/stable/GFileMonitor.html (but with subdirectories)
- *   which would drop the dependency on libinotifytools.so.0
- * - Add and remove subdirectories on the fly at runtime -
- *   see https://github.com/paragone/configure-via-inotify/blob/master/inotify/src/inotifywatch.c
+ * Subdirectories of the watched directories are watched as well, watches for
+ * subdirectories which are created, moved or removed at runtime are updated accordingly.
  */
 
 #include <stdio.h>
@@ -43,11 +40,13 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/types.h>
-#include <dirent.h>
-#include <mntent.h>
-
-#include <inotifytools/inotifytools.h>
-#include <inotifytools/inotify.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
 #include <glib.h>
 #include <glib/gprintf.h>
@@ -57,7 +56,26 @@
 #include <appimage/appimage.h>
 #include <xdg-basedir.h>
 
+#include "coalesce.h"
+#include "checkpoint.h"
+#include "config.h"
+#include "control.h"
+#include "devices.h"
+#include "integration.h"
+#include "logger.h"
+#include "mounts.h"
 #include "notify.h"
+#include "priority.h"
+#include "probe.h"
+#include "refresh.h"
+#include "registry.h"
+#include "scanner.h"
+#include "scanpool.h"
+#include "sniff.h"
+#include "stats.h"
+#include "transform.h"
+#include "watcher.h"
+#include "workqueue.h"
 
 #ifndef RELEASE_NAME
 #define RELEASE_NAME "continuous build"
@@ -68,23 +86,19 @@ static gboolean showVersionOnly = FALSE;
 static gboolean install = FALSE;
 static gboolean uninstall = FALSE;
 static gboolean no_install = FALSE;
-static GMutex print_mutex;
-static GMutex time_mutex;
-static const gint64 time_update_interval = 3 * 1000000; // 3 seconds (in microseconds)
-static gint64 time_last_change = 0; // in microseconds
-static gint64 time_last_update = 0; // in microseconds
-static const gchar* program_update_desktop = "update-desktop-database";
-static const gchar* program_update_mime = "update-mime-database";
-static const gchar* program_gtk_update_icon_cache = "gtk-update-icon-cache";
-static const gchar* program_kbuildsycoca5 = "kbuildsycoca5";
-static const gchar* cmd_update_desktop = "update-desktop-database ~/.local/share/applications/";
-static const gchar* cmd_update_mime = "update-mime-database ~/.local/share/mime/";
-static const gchar* cmd_gtk_update_icon_cache = "gtk-update-icon-cache ~/.local/share/icons/hicolor/ -t";
-static const gchar* cmd_kbuildsycoca5 = "kbuildsycoca5";
-static gboolean is_update_desktop_available = FALSE;
-static gboolean is_update_mime_available = FALSE;
-static gboolean is_gtk_update_icon_cache_available = FALSE;
-static gboolean is_kbuildsycoca5_available = FALSE;
+static gint n_jobs = 0;
+static gint quiet_window_ms = 500;
+static gboolean external_cache_tools = FALSE;
+static gchar* control_request = NULL;
+static gchar* config_path = NULL;
+static gboolean scan_once = FALSE;
+static gchar* log_level_name = NULL;
+static gboolean log_json = FALSE;
+static const gint64 registry_save_delay = 3 * 1000000; // 3 seconds (in microseconds)
+static const time_t stats_write_interval = 10; // seconds
+static const gint64 checkpoint_save_interval = 5 * 1000000; // 5 seconds (in microseconds)
+static const gint64 fuse_scan_timeout = 60 * 1000000; // 60 seconds (in microseconds)
+static const gint64 remote_scan_timeout = 30 * 1000000; // 30 seconds (in microseconds)
 gchar** remaining_args = NULL;
 
 static GOptionEntry entries[] =
@@ -93,276 +107,729 @@ static GOptionEntry entries[] =
         {"install",          'i', 0, G_OPTION_ARG_NONE,           &install,         "Install this appimaged instance to $HOME",   NULL},
         {"uninstall",        'u', 0, G_OPTION_ARG_NONE,           &uninstall,       "Uninstall an appimaged instance from $HOME", NULL},
         {"no-install",       'n', 0, G_OPTION_ARG_NONE,           &no_install,      "Force run without installation",             NULL},
+        {"jobs",             'j', 0, G_OPTION_ARG_INT,            &n_jobs,          "Number of worker threads (default: number of CPU cores)", "N"},
+        {"quiet-window",     0,   0, G_OPTION_ARG_INT,            &quiet_window_ms, "Wait until no event for a file arrived for this long before handling it (default: 500)", "MS"},
+        {"external-cache-tools", 0, 0, G_OPTION_ARG_NONE,         &external_cache_tools, "Always rebuild the desktop database with update-desktop-database", NULL},
+        {"control",          'c', 0, G_OPTION_ARG_STRING,         &control_request, "Send a request (list, register PATH, unregister PATH, rescan DIR, purge, stats) to the running appimaged", "REQUEST"},
+        {"config",           0,   0, G_OPTION_ARG_FILENAME,       &config_path,     "Read the directories to watch from FILE (default: $XDG_CONFIG_HOME/appimaged/appimaged.conf)", "FILE"},
+        {"scan-once",        0,   0, G_OPTION_ARG_NONE,           &scan_once,       "Register the AppImages in the directories given as arguments, update the desktop once, print a JSON summary and exit", NULL},
+        {"log-level",        0,   0, G_OPTION_ARG_STRING,         &log_level_name,  "Log messages up to LEVEL (error, warning, info or debug, default: info, or debug with --verbose)", "LEVEL"},
+        {"log-json",         0,   0, G_OPTION_ARG_NONE,           &log_json,        "Log JSON objects, one per line, with the time, level and thread of each message", NULL},
         {"version",          0,   0, G_OPTION_ARG_NONE,           &showVersionOnly, "Show version number",                        NULL},
         {G_OPTION_REMAINING, 0,   0, G_OPTION_ARG_FILENAME_ARRAY, &remaining_args, NULL},
         {NULL}
     };
 
-#define EXCLUDE_CHUNK 1024
-#define WR_EVENTS (IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF)
-
-// to ensure we don't garble stdout, we have to use this in the threads
-#define THREADSAFE_G_PRINT(str, ...) \
-    g_mutex_lock(&print_mutex);\
-    g_print(str, ##__VA_ARGS__); \
-    g_mutex_unlock(&print_mutex)
-
-/* Run the actual work in treads;
- * pthread allows to pass only one argument to the thread function,
- * hence we use a struct as the argument in which the real arguments are */
-struct arg_struct {
-    char* path;
-    gboolean verbose;
-};
+// maximum number of jobs waiting for a worker before producers are blocked
+#define JOB_QUEUE_CAPACITY 256
+// jobs for files on FUSE and network file systems have workers of their own
+#define SLOW_JOB_WORKERS 2
+// editors either write the configuration file in place or replace it
+#define CONFIG_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE)
+#define WR_EVENTS (IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF | IN_CREATE \
+                   | IN_ONLYDIR)
+
+// registrations and unregistrations are run by a pool of worker threads
+static workqueue_t* job_queue = NULL;
+// new AppImages show up in the menu with a preliminary desktop entry while their registration is completed
+static gboolean preliminary_entries = TRUE;
+// path -> struct batch_file of the files handled by --scan-once, NULL otherwise
+static GHashTable* batch_files = NULL;
+static GMutex batch_mutex;
+// the inotify watches on the directories
+static watcher_t* watcher = NULL;
+// cookie -> watch descriptor of a directory for which an IN_MOVED_FROM event was seen in the current batch
+static GHashTable* directory_moves = NULL;
+// inotify events are debounced and paired up before they are turned into jobs
+static coalescer_t* event_coalescer = NULL;
+// runs the desktop's cache update tools once changes have settled
+static refresh_scheduler_t* desktop_refresh = NULL;
+// top-level directories collected by add_dir_to_watch()
+static GPtrArray* initial_scan_dirs = NULL;
+// progress of the initial scan, which lets it skip unchanged directories
+static checkpoint_t* scan_checkpoint = NULL;
+// which directories are watched, replaced when the configuration file changes
+static config_t* config = NULL;
+static GMutex config_mutex;
+// the mounted file systems, whose "Applications" directories are watched as they come and go
+static mount_table_t* mount_table = NULL;
+// the "Applications" directories of mounted file systems which are watched
+static GPtrArray* mount_roots = NULL;
+static GMutex mount_roots_mutex;
+// roots are scanned by the pool for the class of their file system, so that slow ones can't hold up the others
+static scanpool_t* scan_pools[MOUNT_CLASS_COUNT];
+
+// the current configuration, to be released with config_unref()
+config_t* get_config(void) {
+    g_mutex_lock(&config_mutex);
+    config_t* current = config_ref(config);
+    g_mutex_unlock(&config_mutex);
+    return current;
+}
 
-void update_desktop() {
-    const gchar* error_msgfmt = "Warning: %s retuned non-zero exit code:\n";
-    if (is_update_desktop_available && system(cmd_update_desktop) != 0) {
-        THREADSAFE_G_PRINT(error_msgfmt, program_update_desktop);
+// whether the file or directory at path is to be looked at according to the_config, below a root or a mount's root
+gboolean allows(const config_t* the_config, const char* path, gboolean is_dir) {
+    if (config_allows(the_config, path, is_dir)) {
+        return TRUE;
     }
-    if (is_update_mime_available && system(cmd_update_mime) != 0) {
-        THREADSAFE_G_PRINT(error_msgfmt, program_update_mime);
+
+    gboolean allowed = FALSE;
+    g_mutex_lock(&mount_roots_mutex);
+    for (guint i = 0; i < mount_roots->len && !allowed; i++) {
+        allowed = config_allows_below(the_config, g_ptr_array_index(mount_roots, i), path, is_dir);
     }
-    if (is_gtk_update_icon_cache_available && system(cmd_gtk_update_icon_cache) != 0) {
-        THREADSAFE_G_PRINT(error_msgfmt, program_gtk_update_icon_cache);
+    g_mutex_unlock(&mount_roots_mutex);
+    return allowed;
+}
+
+// same as allows() for the directory at path, sets *dir for checking its entries with config_allows_entry()
+gboolean locate(const config_t* the_config, const char* path, config_dir_t* dir) {
+    if (config_locate(the_config, NULL, path, dir)) {
+        return TRUE;
     }
-    if (is_kbuildsycoca5_available && system(cmd_kbuildsycoca5) != 0) {
-        THREADSAFE_G_PRINT(error_msgfmt, program_kbuildsycoca5);
+
+    gboolean allowed = FALSE;
+    g_mutex_lock(&mount_roots_mutex);
+    for (guint i = 0; i < mount_roots->len && !allowed; i++) {
+        allowed = config_locate(the_config, g_ptr_array_index(mount_roots, i), path, dir);
     }
+    g_mutex_unlock(&mount_roots_mutex);
+    return allowed;
 }
 
-void update_desktop_set_dirty() {
-    gint64 time = g_get_real_time();
-    g_mutex_lock(&time_mutex);
-    time_last_change = time;
-    // this is very unlikely to happen, but theoretically possible due to
-    // timer precision. in such an unlikely case we want to just run the update again.
-    if (time_last_change == time_last_update) {
-        time_last_change++;
+// whether the file or directory at path is to be looked at according to the current configuration
+gboolean is_allowed(const char* path, gboolean is_dir) {
+    config_t* current = get_config();
+    gboolean allowed = allows(current, path, is_dir);
+    config_unref(current);
+    return allowed;
+}
+
+// caches which are affected by (un)registering the AppImage at path
+guint get_refresh_categories(const char* path) {
+    guint categories = REFRESH_DESKTOP_ENTRIES | REFRESH_ICONS;
+    if (integration_has_mime_packages(path)) {
+        categories |= REFRESH_MIME;
     }
-    g_mutex_unlock(&time_mutex);
+    return categories;
 }
 
-bool is_appimage(char* path, gboolean verbose) {
-    return appimage_get_type(path, verbose) != -1;
+/* Remember what identifies copies of the registered AppImage, which is computed once per registration, as it reads
+ * the whole file system image; copies registered later only need to compare it. */
+void record_content_hash(probe_t* probe) {
+    registry_entry_t entry;
+    if (registry_lookup(probe->path, &probe->st, &entry) && entry.has_content_hash) {
+        return;
+    }
+    if (probe_compute_content_hash(probe)) {
+        registry_set_content_hash(probe->path, &probe->st, probe->content_hash);
+    }
 }
 
+/* Register the probed AppImage with the integration files of another registered copy of it, which costs hashing it
+ * and writing its desktop entry instead of extracting everything again. Returns FALSE if there is no such copy. */
+gboolean register_from_copy(probe_t* probe) {
+    // the fingerprint only covers the headers, reproducible builds of different versions may share it
+    if (!registry_may_have_registered_copy(probe->fingerprint, probe->path) || !probe_compute_content_hash(probe)) {
+        return FALSE;
+    }
+
+    gchar* copy_path = registry_find_registered_copy(probe->fingerprint, probe->content_hash, probe->path);
+    if (copy_path == NULL) {
+        return FALSE;
+    }
 
-GKeyFile* load_desktop_entry(const char* desktop_file_path) {
-    GKeyFile* key_file_structure = g_key_file_new();
-    gboolean success = g_key_file_load_from_file(key_file_structure, desktop_file_path,
-                                                 G_KEY_FILE_KEEP_COMMENTS | G_KEY_FILE_KEEP_TRANSLATIONS, NULL);
+    // the integration files must still be those of what was registered
+    struct stat copy_st;
+    gboolean is_unchanged = stat(copy_path, &copy_st) == 0 && registry_lookup(copy_path, &copy_st, NULL);
 
-    if (!success) {
-        // Don't remove the brackets or the macro will segfault
-        THREADSAFE_G_PRINT("Failed to load the deployed desktop entry, '%s'\n", "a");
+    gboolean registered = is_unchanged && integration_copy(copy_path, probe->path) == 0;
+    if (registered) {
+        logger_print(LOGGER_LEVEL_DEBUG, "Registered %s with the integration files of %s", probe->path, copy_path);
+        registry_record(probe->path, &probe->st, probe->type, TRUE, probe->fingerprint);
+        record_content_hash(probe);
+        refresh_scheduler_request(desktop_refresh, get_refresh_categories(probe->path), probe->path);
     }
 
-    return key_file_structure;
+    g_free(copy_path);
+    return registered;
 }
 
-void setup_firejail_on_desktop_entry(GKeyFile* key_file_structure) {
-    char* oldExecValue = g_key_file_get_value(key_file_structure,
-                                              G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_EXEC, NULL);
+void job_appimage_register_in_system(const char* path) {
+    logger_print(LOGGER_LEVEL_DEBUG, "%s (%s)", __FUNCTION__, path);
 
-    char* firejail_exec = g_strdup_printf("firejail --env=DESKTOPINTEGRATION=appimaged --noprofile --appimage %s",
-                                          oldExecValue);
-    g_key_file_set_value(key_file_structure, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_EXEC, firejail_exec);
-
-    gchar* firejail_profile_group = "Desktop Action FirejailProfile";
-    gchar* firejail_profile_exec = g_strdup_printf(
-        "firejail --env=DESKTOPINTEGRATION=appimaged --private --appimage %s", oldExecValue);
-    gchar* firejail_tryexec = "firejail";
-    g_key_file_set_value(key_file_structure, firejail_profile_group, G_KEY_FILE_DESKTOP_KEY_NAME,
-                         "Run without sandbox profile");
-    g_key_file_set_value(key_file_structure, firejail_profile_group, G_KEY_FILE_DESKTOP_KEY_EXEC,
-                         firejail_profile_exec);
-    g_key_file_set_value(key_file_structure, firejail_profile_group, G_KEY_FILE_DESKTOP_KEY_TRY_EXEC,
-                         firejail_tryexec);
-    g_key_file_set_value(key_file_structure, G_KEY_FILE_DESKTOP_GROUP, "Actions", "FirejailProfile;");
+    // the file is opened once, all steps of the job use what the probe finds out about it
+    probe_t* probe = probe_open(path);
+    if (probe == NULL) {
+        if (errno == EINVAL) {
+            logger_print(LOGGER_LEVEL_DEBUG, "appimage_register_in_system call skipped, not a regular file: %s", path);
+        } else {
+            logger_print(LOGGER_LEVEL_DEBUG, "appimage_register_in_system call skipped, failed to open %s: %s", path,
+                         strerror(errno));
+        }
+        return;
+    }
 
-    g_free(firejail_profile_exec);
-    g_free(oldExecValue);
-    g_free(firejail_exec);
-}
+    // most files in the watched directories aren't AppImages, reject them before calling into libappimage
+    gint64 stage_start = g_get_monotonic_time();
+    gboolean is_appimage = probe_read_header(probe);
+    stage_start = stats_record_since(STATS_STAGE_SNIFF, stage_start);
+    if (!is_appimage) {
+        logger_print(LOGGER_LEVEL_DEBUG, "appimage_register_in_system call skipped, not an AppImage: %s", path);
+        registry_record(path, &probe->st, -1, FALSE, 0);
+        probe_free(probe);
+        return;
+    }
 
-void save_desktop_entry(GKeyFile* key_file_structure, const char* desktop_file_path) {
-    gboolean success = g_key_file_save_to_file(key_file_structure, desktop_file_path, NULL);
+    probe_find_desktop_file(probe);
+    stats_record_since(STATS_STAGE_LOOKUP, stage_start);
+    bool is_registered_in_system = probe->desktop_file_path != NULL;
+
+    // the file was only touched or written again as is, e.g., by a sync tool, so the registration is up to date
+    registry_entry_t known;
+    gboolean is_known = registry_get(path, &known) && known.type != -1 && known.fingerprint != 0;
+    if (is_known && known.registered && known.fingerprint == probe->fingerprint && is_registered_in_system) {
+        logger_print(LOGGER_LEVEL_DEBUG, "appimage_register_in_system call skipped, contents unchanged: %s", path);
+        registry_record(path, &probe->st, probe->type, TRUE, probe->fingerprint);
+        record_content_hash(probe);
+        probe_free(probe);
+        return;
+    }
 
-    if (!success) {
-        // Don't remove the brackets or the macro will segfault
-        THREADSAFE_G_PRINT("Failed to save the deployed desktop entry\n");
+    // the AppImage was replaced by another version in place, its icons, actions and MIME types may have changed
+    if (is_registered_in_system && is_known && known.fingerprint != probe->fingerprint) {
+        logger_print(LOGGER_LEVEL_DEBUG, "Contents of %s changed, registering it again", path);
+        guint categories = get_refresh_categories(path);
+        appimage_unregister_in_system(path, verbose);
+        refresh_scheduler_request(desktop_refresh, categories, path);
+        is_registered_in_system = false;
     }
-}
 
+    // a preliminary entry, e.g., left behind by a previous run, still needs its registration to be completed
+    if (is_registered_in_system && integration_is_preliminary(probe->desktop_file_path)) {
+        registry_record(path, &probe->st, probe->type, FALSE, probe->fingerprint);
+        workqueue_push(job_queue, WORKQUEUE_JOB_COMPLETE, path);
+        probe_free(probe);
+        return;
+    }
 
-void enable_firejail_if_available(const char* appimage_path) {
-    /* If firejail is on the $PATH, then use it to run AppImages */
-    char* firejail_paht = g_find_program_in_path("firejail");
-    if (firejail_paht) {
-        const char* desktop_file_path = appimage_registered_desktop_file_path(appimage_path, NULL, false);
+    bool registered = is_registered_in_system;
+    if (!is_registered_in_system) {
+        stage_start = g_get_monotonic_time();
+        if (register_from_copy(probe)) {
+            stats_record_since(STATS_STAGE_REGISTER, stage_start);
+            probe_free(probe);
+            return;
+        }
 
-        if (desktop_file_path != NULL && g_file_test(desktop_file_path, G_FILE_TEST_EXISTS)) {
-            GKeyFile* key_file_structure = load_desktop_entry(desktop_file_path);
+        // show the application in the menu right away, extracting icons and MIME packages can take a while
+        if (preliminary_entries) {
+            stage_start = g_get_monotonic_time();
+            int preliminary_failed = integration_deploy_preliminary_entry(probe);
+            stats_record_since(STATS_STAGE_PRELIMINARY, stage_start);
+            if (preliminary_failed == 0) {
+                registry_record(path, &probe->st, probe->type, FALSE, probe->fingerprint);
+                refresh_scheduler_request(desktop_refresh, REFRESH_DESKTOP_ENTRIES, path);
+                workqueue_push(job_queue, WORKQUEUE_JOB_COMPLETE, path);
+                probe_free(probe);
+                return;
+            }
+        }
 
-            setup_firejail_on_desktop_entry(key_file_structure);
-            save_desktop_entry(key_file_structure, desktop_file_path);
+        stage_start = g_get_monotonic_time();
+        int failed = appimage_register_in_system(path, verbose);
+        stage_start = stats_record_since(STATS_STAGE_REGISTER, stage_start);
 
-            g_key_file_unref(key_file_structure);
-            g_free(firejail_paht);
+        if (!failed) {
+            // e.g., run the AppImage in firejail if it is installed
+            probe_find_desktop_file(probe);
+            transform_desktop_entry(probe->desktop_file_path);
+            stats_record_since(STATS_STAGE_TRANSFORM, stage_start);
+            refresh_scheduler_request(desktop_refresh, get_refresh_categories(path), path);
+            registered = TRUE;
         }
 
-        g_free(desktop_file_path);
+        logger_print(LOGGER_LEVEL_DEBUG, "appimage_register_in_system result: %d", failed);
+
+    } else {
+        logger_print(LOGGER_LEVEL_DEBUG, "appimage_register_in_system call skipped, registered already: %s", path);
     }
+
+    registry_record(path, &probe->st, probe->type, registered, probe->fingerprint);
+    if (registered) {
+        record_content_hash(probe);
+    }
+    probe_free(probe);
 }
 
-void* thread_appimage_register_in_system(void* arguments) {
-    struct arg_struct* args = arguments;
-    if (args->verbose) {
-        THREADSAFE_G_PRINT("%s (%s)\n", __FUNCTION__, args->path);
+// second phase of a registration, run in the background
+void job_appimage_complete_registration(const char* path) {
+    logger_print(LOGGER_LEVEL_DEBUG, "%s (%s)", __FUNCTION__, path);
+
+    probe_t* probe = probe_open(path);
+    if (probe == NULL) {
+        // the file is gone, its unregistration is on the way
+        return;
+    }
+
+    registry_entry_t entry;
+    if (!registry_lookup(path, &probe->st, &entry) || entry.type == -1) {
+        // the file changed since the preliminary entry was deployed
+        probe_free(probe);
+        job_appimage_register_in_system(path);
+        return;
     }
 
-    bool is_appimage_result = is_appimage(args->path, args->verbose);
-    bool appimage_is_registered_in_system_result = is_appimage_result && appimage_is_registered_in_system(args->path);
-    if (is_appimage_result && !appimage_is_registered_in_system_result) {
-        int failed = appimage_register_in_system(args->path, args->verbose);
+    // completed already, e.g., when a client of the control socket waits for the registration
+    if (entry.registered) {
+        probe_free(probe);
+        return;
+    }
 
-        if (!failed) {
-            enable_firejail_if_available(args->path);
-            update_desktop_set_dirty();
-        }
+    // the preliminary entry was removed in the meantime, e.g., by the orphan cleanup
+    probe_find_desktop_file(probe);
+    if (probe->desktop_file_path == NULL) {
+        probe_free(probe);
+        job_appimage_register_in_system(path);
+        return;
+    }
 
-        if (args->verbose) {
-            THREADSAFE_G_PRINT("appimage_register_in_system result: %d\n", failed);
+    /* The complete desktop entry replaces the preliminary one in one rename, so the application never disappears
+     * from the menu. If anything fails, the preliminary entry stays and the next scan tries again. */
+    gint64 stage_start = g_get_monotonic_time();
+    int failed = integration_complete_registration(probe);
+    stats_record_since(STATS_STAGE_REGISTER, stage_start);
+    logger_print(LOGGER_LEVEL_DEBUG, "integration_complete_registration result: %d", failed);
+
+    refresh_scheduler_request(desktop_refresh, get_refresh_categories(path), path);
+    registry_record(path, &probe->st, entry.type, !failed, entry.fingerprint);
+    if (!failed) {
+        record_content_hash(probe);
+    }
+    probe_free(probe);
+}
+
+void job_appimage_unregister_in_system(const char* path) {
+    logger_print(LOGGER_LEVEL_DEBUG, "%s (%s)", __FUNCTION__, path);
+
+    // files which are known not to be AppImages don't leave anything behind to clean up
+    registry_entry_t entry;
+    gboolean was_appimage = !registry_get(path, &entry) || entry.type != -1;
+    guint categories = was_appimage ? get_refresh_categories(path) : 0;
+
+    int result = appimage_unregister_in_system(path, verbose);
+    logger_print(LOGGER_LEVEL_DEBUG, "appimage_unregister_in_system (%s): %d", path, result);
+    registry_remove(path);
+    refresh_scheduler_request(desktop_refresh, categories, path);
+}
+
+void job_appimage_rename_in_system(const char* old_path, const char* path) {
+    logger_print(LOGGER_LEVEL_DEBUG, "%s (%s -> %s)", __FUNCTION__, old_path, path);
+
+    // whatever was registered at the destination has been replaced by the moved file
+    registry_entry_t replaced;
+    if (registry_get(path, &replaced) && replaced.type != -1) {
+        guint categories = get_refresh_categories(path);
+        appimage_unregister_in_system(path, verbose);
+        registry_remove(path);
+        refresh_scheduler_request(desktop_refresh, categories, path);
+    }
+
+    registry_entry_t entry;
+    if (registry_get(old_path, &entry)) {
+        if (entry.type == -1) {
+            registry_rename(old_path, path);
+            return;
         }
 
-    } else if (args->verbose) {
-        THREADSAFE_G_PRINT("appimage_register_in_system call skipped. "
-                           "is_appimage_result: %d appimage_is_registered_in_system_result: %d\n",
-                           is_appimage_result, appimage_is_registered_in_system_result);
+        // move the existing integration files instead of extracting everything again; the caches still refer to
+        // the files under the old prefix, so those are refreshed as well
+        guint old_categories = entry.registered ? get_refresh_categories(old_path) : 0;
+        if (entry.registered && integration_move(old_path, path) == 0) {
+            registry_rename(old_path, path);
+            refresh_scheduler_request(desktop_refresh, old_categories, old_path);
+            refresh_scheduler_request(desktop_refresh, get_refresh_categories(path), path);
+            return;
+        }
     }
 
-    pthread_exit(NULL);
+    logger_print(LOGGER_LEVEL_DEBUG, "Cannot move registration of %s, registering %s from scratch", old_path, path);
+    job_appimage_unregister_in_system(old_path);
+    job_appimage_register_in_system(path);
 }
 
-void* thread_appimage_unregister_in_system(void* arguments) {
-    struct arg_struct* args = arguments;
-    if (args->verbose) {
-        THREADSAFE_G_PRINT("%s (%s)\n", __FUNCTION__, args->path);
+struct batch_file {
+    // time spent on the jobs for the file
+    gint64 duration;
+    // the file was unchanged since it was last registered, no job was needed
+    gboolean unchanged;
+};
+
+// called by the worker threads of job_queue
+void handle_job(workqueue_job_type_t type, const char* path, const char* old_path, void* user_data) {
+    gint64 job_start = g_get_monotonic_time();
+
+    switch (type) {
+        case WORKQUEUE_JOB_REGISTER:
+            job_appimage_register_in_system(path);
+            break;
+        case WORKQUEUE_JOB_UNREGISTER:
+            job_appimage_unregister_in_system(path);
+            break;
+        case WORKQUEUE_JOB_RENAME:
+            job_appimage_rename_in_system(old_path, path);
+            break;
+        case WORKQUEUE_JOB_COMPLETE:
+            job_appimage_complete_registration(path);
+            break;
     }
 
-    bool result = appimage_unregister_in_system(args->path, args->verbose);
-    if (args->verbose) {
-        THREADSAFE_G_PRINT("appimage_unregister_in_system (%s): $d\n", __FUNCTION__, args->path, result);
+    if (batch_files != NULL) {
+        g_mutex_lock(&batch_mutex);
+        struct batch_file* file = g_hash_table_lookup(batch_files, path);
+        if (file != NULL) {
+            file->duration += g_get_monotonic_time() - job_start;
+        }
+        g_mutex_unlock(&batch_mutex);
     }
-    update_desktop_set_dirty();
-    pthread_exit(NULL);
 }
 
-// thread which checks if an update of the desktop is necessary and updates it accordingly.
-void* thread_update_desktop() {
-    while (TRUE) {
-        gboolean do_update = FALSE;
+// thread which persists the registry once changes have settled
+void* thread_save_registry() {
+    guint64 last_sniff_accepted = 0;
+    guint64 last_sniff_rejected = 0;
 
-        // update only after a specific interval (time_update_interval) has passed since the last change.
-        // the lock is here to ensure that the desktop is never in an inconsistent state.
-        g_mutex_lock(&time_mutex);
-        if (time_last_change != time_last_update && g_get_real_time() > time_last_change + time_update_interval) {
-            time_last_update = g_get_real_time();
-            time_last_change = time_last_update;
-            do_update = TRUE;
+    while (TRUE) {
+        registry_wait_until_settled(registry_save_delay);
+        registry_save_if_dirty(registry_save_delay);
+
+        if (logger_is_enabled(LOGGER_LEVEL_DEBUG)) {
+            guint64 sniff_accepted, sniff_rejected;
+            sniff_get_counters(&sniff_accepted, &sniff_rejected);
+            if (sniff_accepted != last_sniff_accepted || sniff_rejected != last_sniff_rejected) {
+                logger_print(LOGGER_LEVEL_DEBUG,
+                             "Pre-filter: %" G_GUINT64_FORMAT " candidates accepted, %" G_GUINT64_FORMAT
+                             " files rejected",
+                             sniff_accepted, sniff_rejected);
+                last_sniff_accepted = sniff_accepted;
+                last_sniff_rejected = sniff_rejected;
+            }
         }
-        g_mutex_unlock(&time_mutex);
+    }
+}
 
-        if (do_update) {
-            THREADSAFE_G_PRINT("Updating desktop...\n");
-            gint64 update_start = g_get_real_time();
-            update_desktop();
-            gint64 update_end = g_get_real_time();
-            THREADSAFE_G_PRINT("Finished updating desktop in %ld milliseconds.\n", (update_end - update_start) / 1000);
+struct scan_options {
+    // the root is watched already, and so are its subdirectories which have a watch
+    gboolean rescan;
+    // the files are queued as background jobs, so that they don't hold up live events
+    gboolean background;
+    // directories which are unchanged according to the checkpoint aren't read, and the progress is recorded
+    gboolean checkpoint;
+};
+
+static const struct scan_options initial_scan_options = {FALSE, TRUE, TRUE};
+static const struct scan_options new_directory_options = {FALSE, FALSE, FALSE};
+static const struct scan_options rescan_options = {TRUE, FALSE, FALSE};
+
+// a walk of scan_directory()
+struct scan {
+    const struct scan_options* options;
+    // the configuration as of the start of the walk, which the directories are located in
+    config_t* config;
+};
+
+// the data of a directory during a scan
+struct scan_dir {
+    int wd;
+    config_dir_t config_dir;
+};
+
+gboolean scan_enter_directory(const char* path, const char* name, int depth, gpointer parent_data, gpointer* data,
+                              void* user_data) {
+    const struct scan* scan = user_data;
+    const struct scan_dir* parent = parent_data;
+
+    if (scan->options->rescan && depth == 1) {
+        // watched subdirectories are rescanned on their own
+        watcher_lock(watcher);
+        gboolean is_watched = watcher_find_child(watcher, parent->wd, name) >= 0;
+        watcher_unlock(watcher);
+        if (is_watched) {
+            return FALSE;
         }
+    }
+
+    // excluded subtrees are neither walked nor watched; below the root, only the new component needs to be checked
+    config_dir_t config_dir;
+    gboolean allowed = depth == 0 ? locate(scan->config, path, &config_dir)
+                                  : config_allows_entry(scan->config, &parent->config_dir, path, TRUE, &config_dir);
+    if (!allowed) {
+        logger_print(LOGGER_LEVEL_DEBUG, "Excluded by the configuration, skipping: %s", path);
+        return FALSE;
+    }
 
-        // sleep one second
-        g_usleep(1000000);
+    // a rescanned root is watched already, its watch descriptor is passed as the parent's
+    int wd = parent->wd;
+    if (!scan->options->rescan || depth > 0) {
+        // watch the directory before looking at it, so that no file created in the meantime is missed
+        wd = watcher_add(watcher, parent->wd, path, WR_EVENTS);
+        int add_errno = errno;
+        if (wd < 0 && add_errno != ENOSPC) {
+            logger_print(LOGGER_LEVEL_ERROR, "Failed to watch %s: %s", path, strerror(add_errno));
+        }
     }
+
+    struct scan_dir* dir = g_new(struct scan_dir, 1);
+    dir->wd = wd;
+    dir->config_dir = config_dir;
+    *data = dir;
+    return TRUE;
 }
 
-// check the availability of a single program in the $PATH.
-gboolean check_for_program(const gchar* program_name) {
-    gboolean result = FALSE;
+// queue a file for registration unless it is known to be unchanged since it was last inspected
+void scan_file(const char* path, const struct stat* st, gpointer dir_data, void* user_data) {
+    const struct scan* scan = user_data;
+    const struct scan_dir* dir = dir_data;
+    const struct scan_options* options = scan->options;
+    registry_entry_t known;
+    if (!config_allows_entry(scan->config, &dir->config_dir, path, FALSE, NULL)) {
+        return;
+    } else if (registry_lookup(path, st, &known) && (known.type == -1 || known.registered)) {
+        logger_print(LOGGER_LEVEL_DEBUG, "Unchanged since last run, skipping: %s", path);
+    } else {
+        // the directory needs to be read again next time, in case the daemon is stopped before the job is done
+        if (options->checkpoint) {
+            gchar* dir_path = g_path_get_dirname(path);
+            checkpoint_invalidate(scan_checkpoint, dir_path);
+            g_free(dir_path);
+        }
 
-    gchar* tmp = g_find_program_in_path(program_name);
-    if (tmp != NULL) {
-        g_free(tmp);
-        result = TRUE;
+        // a rotational disk is read by one job at a time, in the order of the inodes, instead of seeking all over
+        if (options->background && device_is_rotational(st->st_dev)) {
+            workqueue_push_sequential(job_queue, WORKQUEUE_JOB_REGISTER, path, st->st_dev, st->st_ino);
+        } else if (options->background) {
+            workqueue_push_background(job_queue, WORKQUEUE_JOB_REGISTER, path);
+        } else {
+            workqueue_push(job_queue, WORKQUEUE_JOB_REGISTER, path);
+        }
     }
+}
 
-    return result;
+void scan_error(const char* path, int errnum, void* user_data) {
+    if (errnum == EACCES) {
+        logger_print(LOGGER_LEVEL_DEBUG, "_________________________\nPermission denied on dir '%s'", path);
+    } else {
+        logger_print(LOGGER_LEVEL_DEBUG, "_________________________\nFailed to read dir '%s': %s", path,
+                     strerror(errnum));
+    }
 }
 
-// check if update programs are available
-void check_update_programs() {
-    is_update_desktop_available = check_for_program(program_update_desktop);
-    is_update_mime_available = check_for_program(program_update_mime);
-    is_gtk_update_icon_cache_available = check_for_program(program_gtk_update_icon_cache);
-    is_kbuildsycoca5_available = check_for_program(program_kbuildsycoca5);
+gboolean scan_lookup_directory(const char* path, const struct stat* st, gchar*** subdirs, void* user_data) {
+    gboolean unchanged = checkpoint_lookup(scan_checkpoint, path, st, subdirs);
+    if (unchanged) {
+        logger_print(LOGGER_LEVEL_DEBUG, "Unchanged since last run, skipping files in: %s", path);
+    }
+    return unchanged;
 }
 
-/* Recursively process the files in this directory and its subdirectories,
- * http://stackoverflow.com/questions/8436841/how-to-recursively-list-directories-in-c-on-linux
+void scan_leave_directory(const char* path, const struct stat* st, GPtrArray* subdirs, void* user_data) {
+    checkpoint_record(scan_checkpoint, path, st, subdirs);
+    checkpoint_save(scan_checkpoint, checkpoint_save_interval);
+}
+
+static const scanner_callbacks_t scan_callbacks = {scan_enter_directory, scan_file, scan_error, NULL, NULL, g_free};
+static const scanner_callbacks_t checkpoint_scan_callbacks = {scan_enter_directory, scan_file, scan_error,
+                                                              scan_lookup_directory, scan_leave_directory, g_free};
+
+/* Recursively process the files in this directory and its subdirectories, and watch them.
+ * parent_wd is the watch descriptor of the parent directory, -1 for the top-level directories.
  */
-void initially_register(const char* name, int level) {
-    DIR* dir;
-    struct dirent* entry;
-
-    if (!(dir = opendir(name))) {
-        if (verbose) {
-            if (errno == EACCES) {
-                THREADSAFE_G_PRINT("_________________________\nPermission denied on dir '%s'\n", name);
-            } else {
-                THREADSAFE_G_PRINT("_________________________\nFailed to open dir '%s'\n", name);
-            }
-        }
-        closedir(dir);
+void scan_directory(const char* name, int parent_wd, const struct scan_options* options) {
+    const scanner_callbacks_t* callbacks = options->checkpoint ? &checkpoint_scan_callbacks : &scan_callbacks;
+    struct scan scan = {options, get_config()};
+    struct scan_dir root_parent = {parent_wd};
+    scanner_walk(name, callbacks, &root_parent, &scan);
+    config_unref(scan.config);
+}
+
+// what a scan pool does with a path handed over by the event loop, see scan_in_pool()
+struct pool_task {
+    // scan the directory below the watched directory parent_wd
+    int parent_wd;
+    const struct scan_options* options;
+    // if non-NULL, unregister those of these files which vanished instead
+    GPtrArray* known_paths;
+};
+
+// the pool for a file system which may block, NULL for local ones, which are dealt with right away
+scanpool_t* get_slow_scan_pool(const char* path) {
+    mount_class_t class = mount_table != NULL ? mount_table_classify(mount_table, path) : MOUNT_CLASS_LOCAL;
+    return class == MOUNT_CLASS_FUSE || class == MOUNT_CLASS_REMOTE ? scan_pools[class] : NULL;
+}
+
+/* Scan a directory below the watched directory parent_wd, on the pool of its file system if that may block,
+ * so that the event loop never waits for a hung server. */
+void scan_directory_without_blocking(const char* path, int parent_wd, const struct scan_options* options) {
+    scanpool_t* pool = get_slow_scan_pool(path);
+    if (pool == NULL) {
+        scan_directory(path, parent_wd, options);
         return;
     }
 
-    if (!(entry = readdir(dir))) {
-        if (verbose) {
-            THREADSAFE_G_PRINT("_________________________\nInvalid directory stream descriptor '%s'\n", name);
+    struct pool_task* task = g_new0(struct pool_task, 1);
+    task->parent_wd = parent_wd;
+    task->options = options;
+    scanpool_push_with_data(pool, path, task);
+}
+
+// look at the files inside a watched directory again, and at new subdirectories which aren't watched yet
+void rescan_watched_dir(int wd, const char* name, void* user_data) {
+    scan_directory_without_blocking(name, wd, &rescan_options);
+}
+
+// unregister the files among known_paths which have disappeared, takes ownership of known_paths
+void unregister_vanished_now(GPtrArray* known_paths) {
+    for (guint i = 0; i < known_paths->len; i++) {
+        const char* path = g_ptr_array_index(known_paths, i);
+        struct stat st;
+        if (stat(path, &st) != 0 && errno == ENOENT) {
+            workqueue_push(job_queue, WORKQUEUE_JOB_UNREGISTER, path);
         }
-        closedir(dir);
-        return;
     }
+    g_ptr_array_unref(known_paths);
+}
 
-    do {
-        if (entry->d_type == DT_DIR) {
-            char path[1024];
-            int len = snprintf(path, sizeof(path) - 1, "%s/%s", name, entry->d_name);
-            path[len] = 0;
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-                continue;
-            initially_register(path, level + 1);
-        } else {
-            int ret;
-            gchar* absolute_path = g_build_path(G_DIR_SEPARATOR_S, name, entry->d_name, NULL);
-            if (g_file_test(absolute_path, G_FILE_TEST_IS_REGULAR)) {
-                pthread_t some_thread;
-                struct arg_struct args;
-                args.path = absolute_path;
-                args.verbose = verbose;
-                ret = pthread_create(&some_thread, NULL, thread_appimage_register_in_system, &args);
-                if (!ret) {
-                    pthread_join(some_thread, NULL);
-                }
+/* Like unregister_vanished_now(), but the files on file systems which may block are looked at by the pools of
+ * their file systems, takes ownership of known_paths. */
+void unregister_vanished(GPtrArray* known_paths) {
+    GPtrArray* local_paths = g_ptr_array_new_with_free_func(g_free);
+    GHashTable* slow_paths = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, NULL);
+    for (guint i = 0; i < known_paths->len; i++) {
+        const char* path = g_ptr_array_index(known_paths, i);
+        scanpool_t* pool = get_slow_scan_pool(path);
+        GPtrArray* paths = pool != NULL ? g_hash_table_lookup(slow_paths, pool) : local_paths;
+        if (paths == NULL) {
+            paths = g_ptr_array_new_with_free_func(g_free);
+            g_hash_table_insert(slow_paths, pool, paths);
+        }
+        g_ptr_array_add(paths, g_strdup(path));
+    }
+    g_ptr_array_unref(known_paths);
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, slow_paths);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        GPtrArray* paths = value;
+        struct pool_task* task = g_new0(struct pool_task, 1);
+        task->known_paths = paths;
+        scanpool_push_with_data(key, g_ptr_array_index(paths, 0), task);
+    }
+    g_hash_table_destroy(slow_paths);
+
+    unregister_vanished_now(local_paths);
+}
+
+/* Too many FS events were received, some event notifications were potentially lost.
+ * Thanks to the registry, only files which actually changed in the meantime are handled again. */
+void recover_from_overflow() {
+    logger_print(LOGGER_LEVEL_WARNING, "Warning: inotify event queue overflowed, rescanning %u watched directories",
+                 watcher_get_n_watches(watcher));
+
+    watcher_foreach(watcher, rescan_watched_dir, NULL);
+    unregister_vanished(registry_get_paths());
+}
+
+struct watched_dirs {
+    const char* root;
+    GArray* wds;
+    GPtrArray* paths;
+};
+
+void collect_watched_dir(int wd, const char* dir_path, void* user_data) {
+    struct watched_dirs* dirs = user_data;
+    gsize root_length = strlen(dirs->root);
+
+    if (g_str_has_prefix(dir_path, dirs->root) && (dir_path[root_length] == '\0' || dir_path[root_length] == '/')) {
+        g_array_append_val(dirs->wds, wd);
+        g_ptr_array_add(dirs->paths, g_strdup(dir_path));
+    }
+}
+
+// called by the control socket, rescans the watched directories at or below dir_path
+gboolean control_rescan(const char* dir_path, void* user_data) {
+    gchar* root = g_strdup(dir_path);
+    gsize length = strlen(root);
+    while (length > 1 && root[length - 1] == '/') {
+        root[--length] = '\0';
+    }
+
+    struct watched_dirs dirs = {root, g_array_new(FALSE, FALSE, sizeof(int)), g_ptr_array_new_with_free_func(g_free)};
+    watcher_lock(watcher);
+    watcher_foreach(watcher, collect_watched_dir, &dirs);
+    watcher_unlock(watcher);
+
+    // scan without holding the lock, so that events are handled in the meantime
+    for (guint i = 0; i < dirs.wds->len; i++) {
+        scan_directory(g_ptr_array_index(dirs.paths, i), g_array_index(dirs.wds, int, i), &rescan_options);
+    }
+    gboolean found = dirs.wds->len > 0;
+    if (found) {
+        unregister_vanished(registry_get_paths_below(root));
+    }
+
+    g_array_free(dirs.wds, TRUE);
+    g_ptr_array_unref(dirs.paths);
+    g_free(root);
+    return found;
+}
+
+/* Remove the integration files of AppImages which were deleted while appimaged wasn't running, and forget about them.
+ * Files which belong to AppImages in the registry are protected, as long as these still exist. Returns the number of
+ * AppImages cleaned up. */
+guint reconcile_integration(void* user_data) {
+    GHashTable* protected_prefixes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    GPtrArray* paths = registry_get_paths();
+    for (guint i = 0; i < paths->len; i++) {
+        const char* path = g_ptr_array_index(paths, i);
+        registry_entry_t entry;
+        // whether a file on a file system which may block still exists isn't checked, its files are kept
+        if (registry_get(path, &entry) && entry.type != -1
+            && (get_slow_scan_pool(path) != NULL || g_file_test(path, G_FILE_TEST_EXISTS))) {
+            gchar* prefix = integration_get_file_prefix(path);
+            if (prefix != NULL) {
+                g_hash_table_add(protected_prefixes, prefix);
             }
-            g_free(absolute_path);
         }
-    } while ((entry = readdir(dir)) != NULL);
-    closedir(dir);
+    }
+    g_ptr_array_unref(paths);
+
+    GPtrArray* orphaned_paths = g_ptr_array_new_with_free_func(g_free);
+    guint categories = 0;
+    GPtrArray* prefixes = integration_remove_orphans(protected_prefixes, orphaned_paths, &categories);
+
+    for (guint i = 0; i < orphaned_paths->len; i++) {
+        registry_remove(g_ptr_array_index(orphaned_paths, i));
+    }
+    // the requests are collected into a single refresh
+    for (guint i = 0; i < prefixes->len; i++) {
+        refresh_scheduler_request_prefix(desktop_refresh, categories, g_ptr_array_index(prefixes, i));
+    }
+
+    guint n_orphans = prefixes->len;
+    if (n_orphans > 0) {
+        logger_print(LOGGER_LEVEL_INFO, "Removed the integration files of %u AppImages which don't exist anymore",
+                     n_orphans);
+    }
+
+    g_ptr_array_unref(prefixes);
+    g_ptr_array_unref(orphaned_paths);
+    g_hash_table_unref(protected_prefixes);
+    return n_orphans;
 }
 
-void add_dir_to_watch(const char* directory) {
+// watch and scan a top-level directory
+void watch_dir(const char* directory) {
     GError* err = NULL;
 
     // XXX: Fails silently if file doesn’t exist.  Maybe log?
@@ -376,62 +843,775 @@ void add_dir_to_watch(const char* directory) {
       : directory;
 
     if (NULL != err) {
-        THREADSAFE_G_PRINT("Error #%d following symlink %s: %s\n",
-                           err->code, directory, err->message);
+        logger_print(LOGGER_LEVEL_ERROR, "Error #%d following symlink %s: %s",
+                     err->code, directory, err->message);
         return;
     }
 
     if (g_file_test(realdir, G_FILE_TEST_IS_DIR)) {
-        if (!inotifytools_watch_file(realdir, WR_EVENTS)) {
-            fprintf(stderr, "%s: %s\n", realdir, strerror(inotifytools_error()));
-            exit(1);
+        scan_directory(realdir, -1, &initial_scan_options);
+        logger_print(LOGGER_LEVEL_INFO, "Watching %s", realdir);
+    }
+}
+
+// the directory is watched and scanned by the initial scan thread
+void add_dir_to_watch(const char* directory) {
+    if (directory != NULL) {
+        g_ptr_array_add(initial_scan_dirs, g_strdup(directory));
+    }
+}
+
+// unregister the AppImages among paths, other files have nothing to clean up and are just forgotten
+void forget_paths(GPtrArray* paths) {
+    for (guint i = 0; i < paths->len; i++) {
+        const char* path = g_ptr_array_index(paths, i);
+        registry_entry_t entry;
+        if (!registry_get(path, &entry)) {
+            continue;
+        }
+        if (entry.type != -1) {
+            workqueue_push(job_queue, WORKQUEUE_JOB_UNREGISTER, path);
+        } else {
+            registry_remove(path);
+        }
+    }
+}
+
+// watch and scan a root, which is the "Applications" directory of a mount unless it is configured
+void watch_root(const char* path) {
+    config_t* current = get_config();
+    gboolean is_configured = config_is_root(current, path);
+    config_unref(current);
+
+    if (is_configured) {
+        watch_dir(path);
+        return;
+    }
+
+    // a mount's root may not exist, which can't be checked without blocking on a hung file system
+    char* resolved = realpath(path, NULL);
+    if (resolved != NULL && g_file_test(resolved, G_FILE_TEST_IS_DIR)) {
+        g_mutex_lock(&mount_roots_mutex);
+        g_ptr_array_add(mount_roots, g_strdup(resolved));
+        g_mutex_unlock(&mount_roots_mutex);
+        watch_dir(resolved);
+    }
+    free(resolved);
+}
+
+// registering an AppImage on a FUSE or network file system may block for as long as the server takes to answer
+gboolean is_on_slow_mount(const char* path, void* user_data) {
+    return get_slow_scan_pool(path) != NULL;
+}
+
+// data is a struct pool_task, or NULL for a root
+void scan_in_pool(const char* path, gpointer data, void* user_data) {
+    priority_lower_current_thread();
+    struct pool_task* task = data;
+    if (task == NULL) {
+        watch_root(path);
+    } else if (task->known_paths != NULL) {
+        unregister_vanished_now(task->known_paths);
+    } else {
+        scan_directory(path, task->parent_wd, task->options);
+    }
+    g_free(task);
+}
+
+/* Scan a root on the pool for the class of its file system, or right away in the calling thread if it
+ * is local and scan_local is set. Returns whether the root was handed to a pool. */
+gboolean scan_root(const char* path, gboolean scan_local) {
+    mount_class_t class = mount_table != NULL ? mount_table_classify(mount_table, path) : MOUNT_CLASS_LOCAL;
+    if (class == MOUNT_CLASS_LOCAL && scan_local) {
+        watch_root(path);
+        return FALSE;
+    }
+
+    logger_print(LOGGER_LEVEL_DEBUG, "Scanning %s on the %s file system pool", path, mount_class_get_name(class));
+    scanpool_push(scan_pools[class], path);
+    return TRUE;
+}
+
+// the "Applications" directories of the mounted file systems, pseudo file systems are left alone
+GPtrArray* get_mount_roots(GPtrArray* mounts) {
+    GPtrArray* roots = g_ptr_array_new_with_free_func(g_free);
+    for (guint i = 0; i < mounts->len; i++) {
+        const mount_t* mount = g_ptr_array_index(mounts, i);
+        if (mount->class != MOUNT_CLASS_VIRTUAL) {
+            g_ptr_array_add(roots, g_build_filename(mount->mount_point, "Applications", NULL));
         }
-        initially_register(realdir, 0);
-        THREADSAFE_G_PRINT("Watching %s\n", realdir);
     }
+    return roots;
+}
+
+// stop watching the mounts' roots at or below path (all of them if it is NULL), and unregister the AppImages in there
+void forget_mount_roots_below(const char* path) {
+    GPtrArray* forgotten = g_ptr_array_new_with_free_func(g_free);
+    gsize length = path != NULL ? strlen(path) : 0;
+
+    g_mutex_lock(&mount_roots_mutex);
+    for (guint i = 0; i < mount_roots->len;) {
+        const char* root = g_ptr_array_index(mount_roots, i);
+        if (path == NULL || (strncmp(root, path, length) == 0 && (root[length] == '/' || root[length] == '\0'))) {
+            g_ptr_array_add(forgotten, g_strdup(root));
+            g_ptr_array_remove_index_fast(mount_roots, i);
+        } else {
+            i++;
+        }
+    }
+    g_mutex_unlock(&mount_roots_mutex);
+
+    for (guint i = 0; i < forgotten->len; i++) {
+        const char* root = g_ptr_array_index(forgotten, i);
+        logger_print(LOGGER_LEVEL_INFO, "Not watching %s anymore", root);
+
+        GPtrArray* paths = registry_get_paths_below(root);
+        forget_paths(paths);
+        g_ptr_array_unref(paths);
+
+        // the kernel drops the watches of an unmounted file system by itself
+        struct watched_dirs dirs = {root, g_array_new(FALSE, FALSE, sizeof(int)),
+                                    g_ptr_array_new_with_free_func(g_free)};
+        watcher_lock(watcher);
+        watcher_foreach(watcher, collect_watched_dir, &dirs);
+        for (guint j = 0; j < dirs.wds->len; j++) {
+            int wd = g_array_index(dirs.wds, int, j);
+            if (watcher_resolve(watcher, wd, NULL) != NULL) {
+                watcher_remove_tree(watcher, wd);
+            }
+        }
+        watcher_unlock(watcher);
+        g_array_free(dirs.wds, TRUE);
+        g_ptr_array_unref(dirs.paths);
+    }
+
+    g_ptr_array_unref(forgotten);
+}
+
+// the mount table changed: watch the "Applications" directories of new mounts, and forget about those of the old ones
+void handle_mount_changes(void) {
+    GPtrArray* added = g_ptr_array_new_with_free_func((GDestroyNotify) mount_free);
+    GPtrArray* removed = g_ptr_array_new_with_free_func((GDestroyNotify) mount_free);
+    mount_table_update(mount_table, added, removed);
+
+    for (guint i = 0; i < removed->len; i++) {
+        const mount_t* mount = g_ptr_array_index(removed, i);
+        logger_print(LOGGER_LEVEL_DEBUG, "Unmounted %s (%s)", mount->mount_point, mount->fs_type);
+        forget_mount_roots_below(mount->mount_point);
+    }
+
+    config_t* current = get_config();
+    if (config_get_mount_applications(current)) {
+        GPtrArray* roots = get_mount_roots(added);
+        for (guint i = 0; i < roots->len; i++) {
+            scan_root(g_ptr_array_index(roots, i), FALSE);
+        }
+        g_ptr_array_unref(roots);
+    }
+    config_unref(current);
+
+    g_ptr_array_unref(added);
+    g_ptr_array_unref(removed);
+}
+
+struct prune_exceptions {
+    // directories whose files weren't looked up, as they were unchanged
+    GHashTable* skipped_dirs;
+    // roots handed to a pool, which may still be scanning them
+    GPtrArray* deferred_roots;
+};
+
+gboolean keep_unseen(const char* path, void* user_data) {
+    struct prune_exceptions* exceptions = user_data;
+
+    gchar* dir_path = g_path_get_dirname(path);
+    gboolean keep = g_hash_table_contains(exceptions->skipped_dirs, dir_path);
+    g_free(dir_path);
+
+    for (guint i = 0; i < exceptions->deferred_roots->len && !keep; i++) {
+        const char* root = g_ptr_array_index(exceptions->deferred_roots, i);
+        gsize length = strlen(root);
+        keep = strncmp(path, root, length) == 0 && path[length] == '/';
+    }
+    return keep;
+}
+
+/* Thread which watches and scans the top-level directories in the background, so that live events are handled
+ * right away instead of after the initial scan. The scan runs at a low priority and so do the jobs it queues.
+ * Roots on FUSE and remote file systems are scanned by pools of their own instead. */
+void* thread_initial_scan(void* arguments) {
+    GPtrArray* dirs = arguments;
+    GPtrArray* deferred_roots = g_ptr_array_new_with_free_func(g_free);
+
+    priority_lower_current_thread();
+
+    gint64 scan_start = g_get_monotonic_time();
+
+    // before any directory is watched, so that nothing is registered while the integration files are looked at
+    reconcile_integration(NULL);
+
+    config_t* current = get_config();
+    if (config_get_mount_applications(current) && mount_table != NULL) {
+        GPtrArray* mounts = mount_table_get_mounts(mount_table);
+        GPtrArray* roots = get_mount_roots(mounts);
+        for (guint i = 0; i < roots->len; i++) {
+            g_ptr_array_add(dirs, g_strdup(g_ptr_array_index(roots, i)));
+        }
+        g_ptr_array_unref(roots);
+        g_ptr_array_unref(mounts);
+    }
+    config_unref(current);
+
+    for (guint i = 0; i < dirs->len; i++) {
+        const char* root = g_ptr_array_index(dirs, i);
+        if (scan_root(root, TRUE)) {
+            g_ptr_array_add(deferred_roots, g_strdup(root));
+        }
+    }
+    g_ptr_array_unref(dirs);
+
+    /* Files which weren't found during the initial scan don't need to be remembered any more. The files in
+     * directories which were skipped haven't been looked up, but they are still there, and the files below
+     * the roots scanned by the pools may not have been looked up yet. */
+    struct prune_exceptions exceptions = {checkpoint_get_skipped_dirs(scan_checkpoint), deferred_roots};
+    registry_prune_unseen(keep_unseen, &exceptions);
+    checkpoint_prune_unseen(scan_checkpoint);
+    checkpoint_save(scan_checkpoint, 0);
+
+    logger_print(LOGGER_LEVEL_INFO,
+                 "Initial scan finished in %" G_GINT64_FORMAT " milliseconds, %u unchanged directories skipped",
+                 (g_get_monotonic_time() - scan_start) / 1000, g_hash_table_size(exceptions.skipped_dirs));
+    g_hash_table_unref(exceptions.skipped_dirs);
+    g_ptr_array_unref(deferred_roots);
+
+    return NULL;
+}
+
+struct config_change {
+    // roots which weren't watched before
+    GPtrArray* new_roots;
+    // roots below which directories may have been excluded before, but aren't anymore
+    GPtrArray* rescan_roots;
+};
+
+// thread which applies a new configuration to the file system, i.e., watches and scans what it adds
+void* thread_apply_config(void* arguments) {
+    struct config_change* change = arguments;
+
+    priority_lower_current_thread();
+
+    for (guint i = 0; i < change->new_roots->len; i++) {
+        scan_root(g_ptr_array_index(change->new_roots, i), TRUE);
+    }
+    for (guint i = 0; i < change->rescan_roots->len; i++) {
+        control_rescan(g_ptr_array_index(change->rescan_roots, i), NULL);
+    }
+
+    g_ptr_array_unref(change->new_roots);
+    g_ptr_array_unref(change->rescan_roots);
+    g_free(change);
+    return NULL;
 }
 
-void handle_event(struct inotify_event* event) {
-    int ret;
-    gchar* absolute_path = g_build_path(G_DIR_SEPARATOR_S, inotifytools_filename_from_wd(event->wd), event->name, NULL);
+void collect_excluded_dir(int wd, const char* dir_path, void* user_data) {
+    if (!allows(config, dir_path, TRUE)) {
+        g_array_append_val((GArray*) user_data, wd);
+    }
+}
+
+/* Load the configuration file again and apply it: AppImages which are excluded now are unregistered
+ * and their directories aren't watched anymore, new roots are watched and scanned in the background.
+ * The previous configuration is kept if the file is invalid. */
+void reload_config(void) {
+    config_t* new_config = config_load(config_path);
+    if (new_config == NULL) {
+        logger_print(LOGGER_LEVEL_WARNING, "Keeping the previous configuration");
+        return;
+    }
+
+    g_mutex_lock(&config_mutex);
+    config_t* old_config = config;
+    config = new_config;
+    g_mutex_unlock(&config_mutex);
+
+    logger_print(LOGGER_LEVEL_INFO, "Reloaded the configuration from %s", config_path);
+
+    gboolean watch_mounts = config_get_mount_applications(new_config);
+    if (!watch_mounts && config_get_mount_applications(old_config)) {
+        forget_mount_roots_below(NULL);
+    }
+
+    GPtrArray* paths = registry_get_paths();
+    GPtrArray* excluded_paths = g_ptr_array_new_with_free_func(g_free);
+    for (guint i = 0; i < paths->len; i++) {
+        const char* path = g_ptr_array_index(paths, i);
+        if (!allows(new_config, path, FALSE)) {
+            g_ptr_array_add(excluded_paths, g_strdup(path));
+        }
+    }
+    forget_paths(excluded_paths);
+    g_ptr_array_unref(excluded_paths);
+    g_ptr_array_unref(paths);
+
+    // the config variable is only ever replaced by this thread
+    GArray* excluded_wds = g_array_new(FALSE, FALSE, sizeof(int));
+    watcher_lock(watcher);
+    watcher_foreach(watcher, collect_excluded_dir, excluded_wds);
+    for (guint i = 0; i < excluded_wds->len; i++) {
+        int wd = g_array_index(excluded_wds, int, i);
+        // directories below an excluded one are gone with it
+        if (watcher_resolve(watcher, wd, NULL) != NULL) {
+            watcher_remove_tree(watcher, wd);
+        }
+    }
+    watcher_unlock(watcher);
+    g_array_free(excluded_wds, TRUE);
+
+    struct config_change* change = g_new0(struct config_change, 1);
+    change->new_roots = g_ptr_array_new_with_free_func(g_free);
+    change->rescan_roots = g_ptr_array_new_with_free_func(g_free);
+    gboolean may_allow_more = config_may_allow_more(old_config, new_config);
+    const GPtrArray* roots = config_get_roots(new_config);
+    for (guint i = 0; i < roots->len; i++) {
+        const char* root = g_ptr_array_index(roots, i);
+        if (!config_is_root(old_config, root)) {
+            g_ptr_array_add(change->new_roots, g_strdup(root));
+        } else if (may_allow_more) {
+            g_ptr_array_add(change->rescan_roots, g_strdup(root));
+        }
+    }
+
+    if (watch_mounts && mount_table != NULL) {
+        GPtrArray* mounts = mount_table_get_mounts(mount_table);
+        GPtrArray* mount_roots_now = get_mount_roots(mounts);
+        for (guint i = 0; i < mount_roots_now->len; i++) {
+            const char* root = g_ptr_array_index(mount_roots_now, i);
+            if (!config_get_mount_applications(old_config)) {
+                g_ptr_array_add(change->new_roots, g_strdup(root));
+            } else if (may_allow_more) {
+                g_ptr_array_add(change->rescan_roots, g_strdup(root));
+            }
+        }
+        g_ptr_array_unref(mount_roots_now);
+        g_ptr_array_unref(mounts);
+    }
+    config_unref(old_config);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, thread_apply_config, change) != 0) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to create thread to apply the configuration.");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
 
-    if ((event->mask & IN_CLOSE_WRITE) | (event->mask & IN_MOVED_TO)) {
-        if (g_file_test(absolute_path, G_FILE_TEST_IS_REGULAR)) {
-            pthread_t some_thread;
-            struct arg_struct args;
-            args.path = absolute_path;
-            args.verbose = verbose;
-            g_print("_________________________\n");
-            ret = pthread_create(&some_thread, NULL, thread_appimage_register_in_system, &args);
-            if (!ret) {
-                pthread_join(some_thread, NULL);
+// whether one of the events queued on fd concerns the configuration file
+gboolean config_file_changed(int fd, const char* config_name) {
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    gboolean changed = FALSE;
+
+    ssize_t length;
+    while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (char* ptr = buffer; ptr < buffer + length;) {
+            const struct inotify_event* event = (const struct inotify_event*) ptr;
+            if (event->len > 0 && strcmp(event->name, config_name) == 0) {
+                changed = TRUE;
             }
+            ptr += sizeof(struct inotify_event) + event->len;
         }
     }
 
-    if ((event->mask & IN_MOVED_FROM) | (event->mask & IN_DELETE)) {
-        pthread_t some_thread;
-        struct arg_struct args;
-        args.path = absolute_path;
-        args.verbose = verbose;
-        g_print("_________________________\n");
-        ret = pthread_create(&some_thread, NULL, thread_appimage_unregister_in_system, &args);
-        if (!ret) {
-            pthread_join(some_thread, NULL);
+    return changed;
+}
+
+void print_event(const struct inotify_event* event, const char* dir_path) {
+    static const struct {
+        guint32 mask;
+        const char* name;
+    } event_names[] = {
+        {IN_CREATE,      "CREATE"},
+        {IN_CLOSE_WRITE, "CLOSE_WRITE"},
+        {IN_MOVED_FROM,  "MOVED_FROM"},
+        {IN_MOVED_TO,    "MOVED_TO"},
+        {IN_DELETE,      "DELETE"},
+        {IN_DELETE_SELF, "DELETE_SELF"},
+        {IN_MOVE_SELF,   "MOVE_SELF"},
+        {IN_Q_OVERFLOW,  "Q_OVERFLOW"},
+        {IN_IGNORED,     "IGNORED"},
+        {IN_ISDIR,       "ISDIR"},
+    };
+
+    GString* names = g_string_new(NULL);
+    for (gsize i = 0; i < G_N_ELEMENTS(event_names); i++) {
+        if (event->mask & event_names[i].mask) {
+            if (names->len > 0) {
+                g_string_append_c(names, ',');
+            }
+            g_string_append(names, event_names[i].name);
         }
     }
 
-    g_free(absolute_path);
+    logger_print(LOGGER_LEVEL_DEBUG, "%s/%s %s", dir_path != NULL ? dir_path : "", event->len > 0 ? event->name : "",
+                 names->str);
+    g_string_free(names, TRUE);
+}
+
+// a directory appeared in a watched directory: watch it and everything below, and look for AppImages in there
+void handle_new_directory(const struct inotify_event* event) {
+    gchar* path = g_strdup(watcher_resolve(watcher, event->wd, event->name));
+    if (path != NULL) {
+        scan_directory_without_blocking(path, event->wd, &new_directory_options);
+    }
+    g_free(path);
+}
+
+// a watched directory was moved within the watched directories, the files in there just need to be renamed
+void handle_directory_moved(int wd, const struct inotify_event* event) {
+    gchar* old_path = g_strdup(watcher_resolve(watcher, wd, NULL));
+    watcher_move(watcher, wd, event->wd, event->name);
+    const char* new_path = watcher_resolve(watcher, wd, NULL);
+
+    GPtrArray* paths = registry_get_paths_below(old_path);
+    for (guint i = 0; i < paths->len; i++) {
+        const char* path = g_ptr_array_index(paths, i);
+        gchar* moved_path = g_strconcat(new_path, path + strlen(old_path), NULL);
+        workqueue_push_rename(job_queue, path, moved_path);
+        g_free(moved_path);
+    }
+    g_ptr_array_unref(paths);
+    g_free(old_path);
+}
+
+// a watched directory was moved elsewhere: stop watching it and unregister everything that was in there
+void handle_directory_gone(int wd) {
+    const char* path = watcher_resolve(watcher, wd, NULL);
+    if (path == NULL) {
+        return;
+    }
+
+    GPtrArray* paths = registry_get_paths_below(path);
+    for (guint i = 0; i < paths->len; i++) {
+        workqueue_push(job_queue, WORKQUEUE_JOB_UNREGISTER, g_ptr_array_index(paths, i));
+    }
+    g_ptr_array_unref(paths);
+
+    watcher_remove_tree(watcher, wd);
+}
+
+void handle_event(const struct inotify_event* event, void* user_data) {
+    if (logger_is_enabled(LOGGER_LEVEL_DEBUG)) {
+        print_event(event, event->wd >= 0 ? watcher_resolve(watcher, event->wd, NULL) : NULL);
+    }
+
+    stats_count(STATS_COUNTER_EVENTS, 1);
 
-    /* Too many FS events were received, some event notifications were potentially lost */
     if (event->mask & IN_Q_OVERFLOW) {
-        printf("Warning: AN OVERFLOW EVENT OCCURRED\n");
+        stats_count(STATS_COUNTER_OVERFLOWS, 1);
+        recover_from_overflow();
+        return;
+    }
+
+    if (event->mask & IN_ISDIR) {
+        if (event->mask & IN_CREATE) {
+            handle_new_directory(event);
+        }
+
+        if (event->mask & IN_MOVED_FROM) {
+            int wd = watcher_find_child(watcher, event->wd, event->name);
+            if (wd >= 0) {
+                g_hash_table_insert(directory_moves, GUINT_TO_POINTER(event->cookie), GINT_TO_POINTER(wd));
+            }
+        }
+
+        if (event->mask & IN_MOVED_TO) {
+            gpointer wd;
+            if (g_hash_table_lookup_extended(directory_moves, GUINT_TO_POINTER(event->cookie), NULL, &wd)) {
+                g_hash_table_remove(directory_moves, GUINT_TO_POINTER(event->cookie));
+                handle_directory_moved(GPOINTER_TO_INT(wd), event);
+            } else {
+                handle_new_directory(event);
+            }
+        }
+
+        return;
+    }
+
+    // events concerning the watched directory itself
+    if (event->mask & IN_DELETE_SELF) {
+        watcher_remove_tree(watcher, event->wd);
+        return;
+    }
+
+    if (event->mask & IN_MOVE_SELF) {
+        // directories moved within the watched directories have been taken care of by handle_directory_moved()
+        if (!watcher_is_intact(watcher, event->wd)) {
+            handle_directory_gone(event->wd);
+        }
+        return;
+    }
+
+    if (event->len == 0) {
+        return;
+    }
+
+    // the path is only valid until the next call to the watcher, the coalescer makes its own copy
+    const char* absolute_path = watcher_resolve(watcher, event->wd, event->name);
+    if (absolute_path == NULL || !is_allowed(absolute_path, FALSE)) {
+        return;
     }
 
-    if (event->mask & IN_IGNORED) {
-        printf("Warning: AN IN_IGNORED EVENT OCCURRED\n");
+    // the workers check whether the file is a regular one
+    if (event->mask & IN_CLOSE_WRITE) {
+        coalescer_add(event_coalescer, COALESCE_EVENT_WRITTEN, absolute_path, 0);
     }
 
+    if (event->mask & IN_MOVED_TO) {
+        coalescer_add(event_coalescer, COALESCE_EVENT_MOVED_TO, absolute_path, event->cookie);
+    }
+
+    if (event->mask & IN_MOVED_FROM) {
+        coalescer_add(event_coalescer, COALESCE_EVENT_MOVED_FROM, absolute_path, event->cookie);
+    }
+
+    if (event->mask & IN_DELETE) {
+        coalescer_add(event_coalescer, COALESCE_EVENT_REMOVED, absolute_path, 0);
+    }
+}
+
+guint64 get_queue_depth(void* user_data) {
+    return workqueue_get_n_queued(job_queue, FALSE);
+}
+
+guint64 get_background_queue_depth(void* user_data) {
+    return workqueue_get_n_queued(job_queue, TRUE);
+}
+
+guint64 get_slow_queue_depth(void* user_data) {
+    return workqueue_get_n_queued_slow(job_queue);
+}
+
+guint64 get_n_dropped_log_messages(void* user_data) {
+    return logger_get_n_dropped();
+}
+
+guint64 get_n_watches(void* user_data) {
+    watcher_lock(watcher);
+    guint n_watches = watcher_get_n_watches(watcher);
+    watcher_unlock(watcher);
+    return n_watches;
+}
+
+// NULL if there is no runtime directory
+gchar* get_control_socket_path() {
+    const gchar* runtime_dir = g_getenv("XDG_RUNTIME_DIR");
+    return runtime_dir != NULL ? g_build_filename(runtime_dir, "appimaged", "control.sock", NULL) : NULL;
+}
+
+struct batch_scan {
+    const config_t* config;
+    const char* root;
+    guint n_unreadable;
+};
+
+gboolean batch_enter_directory(const char* path, const char* name, int depth, gpointer parent_data, gpointer* data,
+                               void* user_data) {
+    struct batch_scan* scan = user_data;
+    config_dir_t* dir = g_new(config_dir_t, 1);
+    gboolean allowed = depth == 0 ? config_locate(scan->config, scan->root, path, dir)
+                                  : config_allows_entry(scan->config, parent_data, path, TRUE, dir);
+    if (!allowed) {
+        g_free(dir);
+        return FALSE;
+    }
+    *data = dir;
+    return TRUE;
+}
+
+void batch_file(const char* path, const struct stat* st, gpointer dir_data, void* user_data) {
+    struct batch_scan* scan = user_data;
+    if (!config_allows_entry(scan->config, dir_data, path, FALSE, NULL)) {
+        return;
+    }
+
+    registry_entry_t known;
+    gboolean unchanged = registry_lookup(path, st, &known) && (known.type == -1 || known.registered);
+
+    // the directories given may overlap
+    g_mutex_lock(&batch_mutex);
+    gboolean is_new = !g_hash_table_contains(batch_files, path);
+    if (is_new) {
+        struct batch_file* file = g_new0(struct batch_file, 1);
+        file->unchanged = unchanged;
+        g_hash_table_insert(batch_files, g_strdup(path), file);
+    }
+    g_mutex_unlock(&batch_mutex);
+
+    if (is_new && !unchanged) {
+        workqueue_push(job_queue, WORKQUEUE_JOB_REGISTER, path);
+    }
+}
+
+void batch_error(const char* path, int errnum, void* user_data) {
+    struct batch_scan* scan = user_data;
+    logger_print(LOGGER_LEVEL_ERROR, "Failed to read %s: %s", path, strerror(errnum));
+    scan->n_unreadable++;
+}
+
+static const scanner_callbacks_t batch_scan_callbacks = {batch_enter_directory, batch_file, batch_error, NULL, NULL,
+                                                         g_free};
+
+void append_json_string(GString* json, const char* string) {
+    g_string_append_c(json, '"');
+    for (const char* c = string; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            g_string_append_c(json, '\\');
+            g_string_append_c(json, *c);
+        } else if ((unsigned char) *c < 0x20) {
+            g_string_append_printf(json, "\\u%04x", (unsigned char) *c);
+        } else {
+            g_string_append_c(json, *c);
+        }
+    }
+    g_string_append_c(json, '"');
+}
+
+gint compare_paths(gconstpointer a, gconstpointer b) {
+    return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+/* Register the AppImages in dirs (--scan-once) with the worker threads, without watching anything, and refresh the
+ * desktop's caches once at the end. The JSON summary is the only output on stdout. Returns the exit status: 0 if
+ * every AppImage is registered, 1 if some couldn't be registered or a directory couldn't be read. */
+int run_scan_once(gchar** dirs) {
+    gint64 start = g_get_monotonic_time();
+    batch_files = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+    guint n_unreadable = 0;
+    config_t* current = get_config();
+    for (gchar** dir = dirs; *dir != NULL; dir++) {
+        char* root = realpath(*dir, NULL);
+        if (root == NULL) {
+            logger_print(LOGGER_LEVEL_ERROR, "Failed to read %s: %s", *dir, strerror(errno));
+            n_unreadable++;
+            continue;
+        }
+
+        struct batch_scan scan = {current, root, 0};
+        scanner_walk(root, &batch_scan_callbacks, NULL, &scan);
+        n_unreadable += scan.n_unreadable;
+        free(root);
+    }
+    config_unref(current);
+
+    workqueue_wait_idle(job_queue);
+    // runs the one refresh which collected all changes
+    refresh_scheduler_free(desktop_refresh);
+    desktop_refresh = NULL;
+    registry_save_if_dirty(0);
+
+    guint n_registered = 0;
+    guint n_unchanged = 0;
+    guint n_failed = 0;
+    guint n_other = 0;
+    GString* files_json = g_string_new(NULL);
+
+    guint n_paths = 0;
+    gpointer* paths = g_hash_table_get_keys_as_array(batch_files, &n_paths);
+    qsort(paths, n_paths, sizeof(gpointer), compare_paths);
+    for (guint i = 0; i < n_paths; i++) {
+        const char* path = paths[i];
+        const struct batch_file* file = g_hash_table_lookup(batch_files, path);
+
+        // files which vanished during the scan are reported as failures
+        registry_entry_t entry;
+        gboolean is_known = registry_get(path, &entry);
+        const char* result;
+        if (is_known && entry.type == -1) {
+            n_other++;
+            continue;
+        } else if (is_known && file->unchanged) {
+            result = "unchanged";
+            n_unchanged++;
+        } else if (is_known && entry.registered) {
+            result = "registered";
+            n_registered++;
+        } else {
+            result = "failed";
+            n_failed++;
+        }
+
+        g_string_append(files_json, files_json->len > 0 ? ",\n    {\"path\": " : "\n    {\"path\": ");
+        append_json_string(files_json, path);
+        g_string_append_printf(files_json, ", \"result\": \"%s\", \"duration_ms\": %.3f}", result,
+                               (double) file->duration / 1000);
+    }
+    g_free(paths);
+
+    GString* json = g_string_new("{\n");
+    g_string_append_printf(json, "  \"registered\": %u,\n", n_registered);
+    g_string_append_printf(json, "  \"unchanged\": %u,\n", n_unchanged);
+    g_string_append_printf(json, "  \"failed\": %u,\n", n_failed);
+    g_string_append_printf(json, "  \"not_appimages\": %u,\n", n_other);
+    g_string_append_printf(json, "  \"unreadable_directories\": %u,\n", n_unreadable);
+    g_string_append_printf(json, "  \"duration_ms\": %" G_GINT64_FORMAT ",\n", (g_get_monotonic_time() - start) / 1000);
+    g_string_append_printf(json, "  \"files\": [%s%s]\n}\n", files_json->str, files_json->len > 0 ? "\n  " : "");
+    fputs(json->str, stdout);
+    fflush(stdout);
+
+    g_string_free(json, TRUE);
+    g_string_free(files_json, TRUE);
+    g_hash_table_destroy(batch_files);
+    batch_files = NULL;
+
+    return n_failed > 0 || n_unreadable > 0 ? 1 : 0;
+}
+
+// send the request given with --control to the running daemon, relative paths are resolved first
+int run_control_client(const char* request) {
+    gchar* socket_path = get_control_socket_path();
+    if (socket_path == NULL) {
+        fprintf(stderr, "XDG_RUNTIME_DIR is not set, cannot find the control socket\n");
+        return 1;
+    }
+
+    gchar** parts = g_strsplit(request, " ", 2);
+    gchar* absolute_request;
+    if (parts[0] != NULL && parts[1] != NULL && !g_path_is_absolute(parts[1])) {
+        gchar* current_dir = g_get_current_dir();
+        gchar* path = g_build_filename(current_dir, parts[1], NULL);
+        absolute_request = g_strdup_printf("%s %s", parts[0], path);
+        g_free(path);
+        g_free(current_dir);
+    } else {
+        absolute_request = g_strdup(request);
+    }
+
+    int exit_code = control_client_run(socket_path, absolute_request);
+
+    g_free(absolute_request);
+    g_strfreev(parts);
+    g_free(socket_path);
+    return exit_code;
+}
+
+// SIGUSR1 prints the statistics, the JSON file is kept up to date for tools which want to poll them
+void dump_stats(const char* json_path, gboolean print) {
+    if (print) {
+        // logged line by line, the summary is longer than a log message may be
+        GString* text = stats_format_text();
+        gchar** lines = g_strsplit(text->str, "\n", -1);
+        for (gchar** line = lines; *line != NULL; line++) {
+            if (**line != '\0') {
+                logger_print(LOGGER_LEVEL_INFO, "%s", *line);
+            }
+        }
+        g_strfreev(lines);
+        g_string_free(text, TRUE);
+    }
+
+    if (json_path != NULL) {
+        stats_write_json(json_path);
+    }
 }
 
 int main(int argc, char** argv) {
@@ -446,6 +1626,29 @@ int main(int argc, char** argv) {
         exit(1);
     }
 
+    // SIGUSR1, SIGHUP and the signals to shut down are handled via a signalfd in the main loop, they must be
+    // blocked before any thread is created
+    sigset_t handled_signals;
+    sigemptyset(&handled_signals);
+    sigaddset(&handled_signals, SIGUSR1);
+    sigaddset(&handled_signals, SIGHUP);
+    if (!scan_once) {
+        sigaddset(&handled_signals, SIGTERM);
+        sigaddset(&handled_signals, SIGINT);
+    }
+    pthread_sigmask(SIG_BLOCK, &handled_signals, NULL);
+
+    if (control_request != NULL) {
+        exit(run_control_client(control_request));
+    }
+
+    if (scan_once) {
+        if (remaining_args == NULL || remaining_args[0] == NULL) {
+            fprintf(stderr, "--scan-once needs at least one directory\n");
+            exit(2);
+        }
+    }
+
     // always show version, but exit immediately if only the version number was requested
     fprintf(
         stderr,
@@ -456,10 +1659,23 @@ int main(int argc, char** argv) {
     if (showVersionOnly)
         exit(0);
 
-    if (!inotifytools_initialize()) {
-        fprintf(stderr, "inotifytools_initialize error\n");
+    logger_level_t log_level = verbose ? LOGGER_LEVEL_DEBUG : LOGGER_LEVEL_INFO;
+    if (log_level_name != NULL && !logger_parse_level(log_level_name, &log_level)) {
+        fprintf(stderr, "Invalid log level: %s\n", log_level_name);
         exit(1);
     }
+    // libappimage only knows whether to be verbose
+    verbose = log_level == LOGGER_LEVEL_DEBUG;
+    if (!logger_start(log_level, log_json, scan_once ? stderr : stdout)) {
+        exit(1);
+    }
+
+    watcher = watcher_new();
+    if (watcher == NULL) {
+        fprintf(stderr, "Failed to initialize inotify: %s\n", strerror(errno));
+        exit(1);
+    }
+    directory_moves = g_hash_table_new(g_direct_hash, g_direct_equal);
 
     gchar* user_bin_dir = g_build_filename(g_get_home_dir(), "/.local/bin", NULL);
     gchar* installed_appimaged_location = g_build_filename(user_bin_dir, "appimaged", NULL);
@@ -478,6 +1694,8 @@ int main(int argc, char** argv) {
         if (g_file_test(destination, G_FILE_TEST_EXISTS))
             fprintf(stderr, "* Please delete %s\n", destination);
         fprintf(stderr, "* To remove all AppImage desktop integration, run\n");
+        fprintf(stderr, "  %s --control purge\n", argv[0]);
+        fprintf(stderr, "  while appimaged is running, otherwise\n");
         fprintf(stderr, "  find ~/.local/share -name 'appimagekit_*' -exec rm {} \\;\n\n");
         exit(0);
     }
@@ -525,7 +1743,7 @@ int main(int argc, char** argv) {
 
     /* When we run from inside an AppImage, then we check if we are installed
      * in a per-user location and if not, we install ourselves there */
-    if (!no_install && (appimage_location != NULL && own_desktop_file_location != NULL)) {
+    if (!no_install && !scan_once && (appimage_location != NULL && own_desktop_file_location != NULL)) {
         if ((!g_file_test("/usr/bin/appimaged", G_FILE_TEST_EXISTS)) &&
             ((!g_file_test(global_autostart_file, G_FILE_TEST_EXISTS)) ||
              (!g_file_test(destination, G_FILE_TEST_EXISTS))) &&
@@ -541,61 +1759,224 @@ int main(int argc, char** argv) {
         }
     }
 
-    // check which update programs are available.
-    check_update_programs();
+    // look up the desktop's cache update tools
+    desktop_refresh = refresh_scheduler_new(!external_cache_tools);
+    if (desktop_refresh == NULL) {
+        exit(1);
+    }
+
+    // nobody is looking at the menu while a batch is registered, so everything is done in one go
+    if (scan_once) {
+        refresh_scheduler_defer(desktop_refresh);
+        preliminary_entries = FALSE;
+    }
+
+    // load what we know about the files from previous runs
+    char* cache_home = xdg_cache_home();
+    gchar* registry_index_path = g_build_filename(cache_home, "appimaged", "registry.idx", NULL);
+    registry_init(registry_index_path);
+    g_free(registry_index_path);
+
+    // and which directories haven't changed since they were scanned
+    gchar* checkpoint_path = g_build_filename(cache_home, "appimaged", "scan.checkpoint", NULL);
+    scan_checkpoint = checkpoint_load(checkpoint_path);
+    g_free(checkpoint_path);
+    free(cache_home);
     
     // Workaround for: Directory '/home/me/.local/share/mime/packages' does not exist! # https://github.com/AppImage/appimaged/issues/93
     g_mkdir_with_parents(g_build_filename(g_get_home_dir(), ".local/share/mime/packages", NULL), 0755);
 
-    // set the time
-    time_last_update = g_get_real_time();
-    time_last_change = time_last_update;
+    // launch the thread which saves the registry
+    pthread_t save_thread;
+    if (pthread_create(&save_thread, NULL, thread_save_registry, NULL) != 0) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to create registry save thread.");
+        exit(1);
+    }
 
-    // launch the update thread
-    pthread_t update_thread;
-    if (pthread_create(&update_thread, NULL, thread_update_desktop, NULL) != 0) {
-        THREADSAFE_G_PRINT("Failed to create update thread.");
+    // launch the workers which (un)register AppImages
+    if (n_jobs < 0) {
+        fprintf(stderr, "Invalid number of jobs: %d\n", n_jobs);
         exit(1);
     }
+    job_queue = workqueue_new((guint) n_jobs, 0, JOB_QUEUE_CAPACITY, handle_job, NULL);
+    if (job_queue == NULL) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to create worker threads.");
+        exit(1);
+    }
+    logger_print(LOGGER_LEVEL_DEBUG, "Using %u worker threads and %u background worker threads",
+                 workqueue_get_n_workers(job_queue), workqueue_get_n_background_workers(job_queue));
 
-    add_dir_to_watch(user_bin_dir);
-    add_dir_to_watch(g_get_user_special_dir(G_USER_DIRECTORY_DOWNLOAD));
-    add_dir_to_watch(g_build_filename(g_get_home_dir(), "/bin", NULL));
-    add_dir_to_watch(g_build_filename(g_get_home_dir(), "/.bin", NULL));
-    add_dir_to_watch(g_build_filename(g_get_home_dir(), "/Applications", NULL));
-    add_dir_to_watch(g_build_filename("/Applications", NULL));
-    add_dir_to_watch(g_build_filename("/opt", NULL));
-    add_dir_to_watch(g_build_filename("/usr/local/bin", NULL));
-
-    // Watch "/Applications" on all mounted partitions, if it exists.
-    // TODO: Notice when partitions are mounted and unmounted (patches welcome!)
-    struct mntent* ent;
-    FILE* aFile;
-    aFile = setmntent("/proc/mounts", "r");
-    if (aFile == NULL) {
-        perror("setmntent");
+    event_coalescer = coalescer_new((gint64) quiet_window_ms * 1000, job_queue);
+    if (event_coalescer == NULL) {
         exit(1);
     }
-    while (NULL != (ent = getmntent(aFile))) {
-        gchar* applicationsdir = NULL;
-        applicationsdir = g_build_filename(ent->mnt_dir, "Applications", NULL);
-        if (applicationsdir != NULL) {
-            if (g_file_test(applicationsdir, G_FILE_TEST_IS_DIR)) {
-                add_dir_to_watch(applicationsdir);
-            }
+
+    // the directories to watch, along with what to leave out
+    if (config_path == NULL) {
+        char* config_home = xdg_config_home();
+        config_path = g_build_filename(config_home, "appimaged", "appimaged.conf", NULL);
+        free(config_home);
+    }
+    config = config_load(config_path);
+    if (config == NULL) {
+        exit(1);
+    }
+
+    if (scan_once) {
+        exit(run_scan_once(remaining_args));
+    }
+
+    // the "Applications" directories of mounts come and go with them, slow file systems are scanned on their own
+    mount_roots = g_ptr_array_new_with_free_func(g_free);
+    mount_table = mount_table_new();
+    scan_pools[MOUNT_CLASS_LOCAL] = scanpool_new("local", 1, 0, scan_in_pool, NULL);
+    scan_pools[MOUNT_CLASS_FUSE] = scanpool_new("FUSE", 2, fuse_scan_timeout, scan_in_pool, NULL);
+    scan_pools[MOUNT_CLASS_REMOTE] = scanpool_new("remote", 2, remote_scan_timeout, scan_in_pool, NULL);
+    scan_pools[MOUNT_CLASS_VIRTUAL] = scan_pools[MOUNT_CLASS_LOCAL];
+    for (int i = 0; i < MOUNT_CLASS_COUNT; i++) {
+        if (scan_pools[i] == NULL) {
+            exit(1);
         }
-        g_free(applicationsdir);
     }
-    endmntent(aFile);
+    if (mount_table != NULL && !workqueue_start_slow_workers(job_queue, SLOW_JOB_WORKERS, is_on_slow_mount, NULL)) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to create worker threads for slow file systems.");
+        exit(1);
+    }
+
+    initial_scan_dirs = g_ptr_array_new_with_free_func(g_free);
+    const GPtrArray* roots = config_get_roots(config);
+    for (guint i = 0; i < roots->len; i++) {
+        add_dir_to_watch(g_ptr_array_index(roots, i));
+    }
+
+    stats_add_gauge("queue_depth", get_queue_depth, NULL);
+    stats_add_gauge("background_queue_depth", get_background_queue_depth, NULL);
+    stats_add_gauge("slow_queue_depth", get_slow_queue_depth, NULL);
+    stats_add_gauge("watches", get_n_watches, NULL);
+    stats_add_gauge("dropped_log_messages", get_n_dropped_log_messages, NULL);
+
+    // lets users and tools query and drive the daemon
+    control_server_t* control_server = NULL;
+    gchar* control_socket_path = get_control_socket_path();
+    if (control_socket_path != NULL) {
+        control_server = control_server_new(control_socket_path, job_queue, control_rescan, reconcile_integration,
+                                            NULL);
+        g_free(control_socket_path);
+    }
+
+    pthread_t scan_thread;
+    if (pthread_create(&scan_thread, NULL, thread_initial_scan, initial_scan_dirs) != 0) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to create initial scan thread.");
+        exit(1);
+    }
+    pthread_detach(scan_thread);
+    initial_scan_dirs = NULL;
 
-    struct inotify_event* event = inotifytools_next_event(-1);
-    while (event) {
-        if (verbose) {
-            inotifytools_printf(event, "%w%f %e\n");
+    int signal_fd = signalfd(-1, &handled_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0) {
+        perror("signalfd");
+        exit(1);
+    }
+
+    // the statistics are only written to a file if there is a runtime directory, which is usually a tmpfs
+    gchar* stats_json_path = NULL;
+    int timer_fd = -1;
+    if (g_getenv("XDG_RUNTIME_DIR") != NULL) {
+        stats_json_path = g_build_filename(g_getenv("XDG_RUNTIME_DIR"), "appimaged", "stats.json", NULL);
+
+        struct itimerspec interval = {{stats_write_interval, 0}, {stats_write_interval, 0}};
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timer_fd < 0 || timerfd_settime(timer_fd, 0, &interval, NULL) != 0) {
+            perror("timerfd");
+            exit(1);
         }
-        fflush(stdout);
-        handle_event(event);
-        fflush(stdout);
-        event = inotifytools_next_event(-1);
     }
+
+    // changes to the configuration file are picked up without a restart, as are SIGHUPs
+    gchar* config_dir = g_path_get_dirname(config_path);
+    gchar* config_name = g_path_get_basename(config_path);
+    g_mkdir_with_parents(config_dir, 0755);
+    int config_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (config_fd >= 0 && inotify_add_watch(config_fd, config_dir, CONFIG_EVENTS) < 0) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to watch %s: %s", config_dir, strerror(errno));
+        close(config_fd);
+        config_fd = -1;
+    }
+    g_free(config_dir);
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event inotify_epoll_event = {.events = EPOLLIN, .data.fd = watcher_get_fd(watcher)};
+    struct epoll_event signal_epoll_event = {.events = EPOLLIN, .data.fd = signal_fd};
+    struct epoll_event timer_epoll_event = {.events = EPOLLIN, .data.fd = timer_fd};
+    struct epoll_event config_epoll_event = {.events = EPOLLIN, .data.fd = config_fd};
+    // changes of the mount table are signalled as exceptional conditions
+    int mounts_fd = mount_table != NULL ? mount_table_get_fd(mount_table) : -1;
+    struct epoll_event mounts_epoll_event = {.events = EPOLLPRI, .data.fd = mounts_fd};
+    if (epoll_fd < 0
+        || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watcher_get_fd(watcher), &inotify_epoll_event) != 0
+        || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &signal_epoll_event) != 0
+        || (timer_fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &timer_epoll_event) != 0)
+        || (config_fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, config_fd, &config_epoll_event) != 0)
+        || (mounts_fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mounts_fd, &mounts_epoll_event) != 0)) {
+        perror("epoll");
+        exit(1);
+    }
+
+    gboolean running = TRUE;
+    while (running) {
+        struct epoll_event ready[8];
+        int n_ready = epoll_wait(epoll_fd, ready, G_N_ELEMENTS(ready), -1);
+        if (n_ready < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (int i = 0; i < n_ready; i++) {
+            if (ready[i].data.fd == watcher_get_fd(watcher)) {
+                gint64 dispatch_start = g_get_monotonic_time();
+                if (!watcher_dispatch(watcher, handle_event, NULL)) {
+                    perror("Failed to read inotify events");
+                    exit(1);
+                }
+                // the IN_MOVED_TO event belonging to an IN_MOVED_FROM event is part of the same batch
+                g_hash_table_remove_all(directory_moves);
+                stats_record_since(STATS_STAGE_EVENTS, dispatch_start);
+            } else if (ready[i].data.fd == signal_fd) {
+                struct signalfd_siginfo info;
+                while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                    if (info.ssi_signo == SIGTERM || info.ssi_signo == SIGINT) {
+                        running = FALSE;
+                    } else if (info.ssi_signo == SIGHUP) {
+                        reload_config();
+                    } else {
+                        dump_stats(stats_json_path, TRUE);
+                    }
+                }
+            } else if (ready[i].data.fd == timer_fd) {
+                uint64_t expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                    dump_stats(stats_json_path, FALSE);
+                }
+            } else if (ready[i].data.fd == config_fd) {
+                if (config_file_changed(config_fd, config_name)) {
+                    reload_config();
+                }
+            } else if (ready[i].data.fd == mounts_fd) {
+                handle_mount_changes();
+            }
+        }
+    }
+
+    logger_print(LOGGER_LEVEL_INFO, "Shutting down");
+
+    // removes the socket, so that clients don't try to connect to a daemon which is gone
+    control_server_free(control_server);
+
+    // jobs which are still queued or running are handled again at the next start, as they aren't recorded yet
+    registry_save_if_dirty(0);
+    checkpoint_save(scan_checkpoint, 0);
+
+    return 0;
 }
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "logger.h"
+#include "mimecache.h"
+
+#define MIMECACHE_FILE_NAME "mimeinfo.cache"
+#define MIMECACHE_GROUP "MIME Cache"
+
+static gboolean has_any_prefix(const char* name, const char* const* prefixes) {
+    for (const char* const* prefix = prefixes; *prefix != NULL; prefix++) {
+        if (g_str_has_prefix(name, *prefix)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void add_entry(GHashTable* cache, const char* mime_type, const char* desktop_id) {
+    GPtrArray* desktop_ids = g_hash_table_lookup(cache, mime_type);
+    if (desktop_ids == NULL) {
+        desktop_ids = g_ptr_array_new_with_free_func(g_free);
+        g_hash_table_insert(cache, g_strdup(mime_type), desktop_ids);
+    }
+
+    for (guint i = 0; i < desktop_ids->len; i++) {
+        if (strcmp(g_ptr_array_index(desktop_ids, i), desktop_id) == 0) {
+            return;
+        }
+    }
+    g_ptr_array_add(desktop_ids, g_strdup(desktop_id));
+}
+
+// mime type -> GPtrArray of desktop ids, NULL if the file doesn't exist or isn't a cache
+static GHashTable* load_cache(const char* cache_path, const char* const* prefixes) {
+    gchar* contents = NULL;
+    if (!g_file_get_contents(cache_path, &contents, NULL, NULL)) {
+        return NULL;
+    }
+
+    GHashTable* cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_ptr_array_unref);
+    gboolean in_group = FALSE;
+    gboolean valid = FALSE;
+
+    gchar** lines = g_strsplit(contents, "\n", -1);
+    for (gchar** line = lines; *line != NULL; line++) {
+        if (**line == '\0' || **line == '#') {
+            continue;
+        }
+
+        if (**line == '[') {
+            in_group = strcmp(*line, "[" MIMECACHE_GROUP "]") == 0;
+            valid |= in_group;
+            continue;
+        }
+
+        gchar* separator = strchr(*line, '=');
+        if (!in_group || separator == NULL) {
+            continue;
+        }
+        *separator = '\0';
+
+        gchar** desktop_ids = g_strsplit(separator + 1, ";", -1);
+        for (gchar** desktop_id = desktop_ids; *desktop_id != NULL; desktop_id++) {
+            if (**desktop_id != '\0' && !has_any_prefix(*desktop_id, prefixes)) {
+                add_entry(cache, *line, *desktop_id);
+            }
+        }
+        g_strfreev(desktop_ids);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+
+    if (!valid) {
+        g_hash_table_destroy(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+static void add_desktop_file(GHashTable* cache, const char* applications_dir, const char* desktop_id) {
+    gchar* path = g_build_filename(applications_dir, desktop_id, NULL);
+    GKeyFile* key_file = g_key_file_new();
+
+    // update-desktop-database skips hidden entries as well
+    if (g_key_file_load_from_file(key_file, path, G_KEY_FILE_NONE, NULL)
+        && !g_key_file_get_boolean(key_file, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_HIDDEN, NULL)) {
+        gchar** mime_types = g_key_file_get_string_list(key_file, G_KEY_FILE_DESKTOP_GROUP,
+                                                         G_KEY_FILE_DESKTOP_KEY_MIME_TYPE, NULL, NULL);
+        if (mime_types != NULL) {
+            for (gchar** mime_type = mime_types; *mime_type != NULL; mime_type++) {
+                g_strstrip(*mime_type);
+                if (**mime_type != '\0') {
+                    add_entry(cache, *mime_type, desktop_id);
+                }
+            }
+            g_strfreev(mime_types);
+        }
+    }
+
+    g_key_file_unref(key_file);
+    g_free(path);
+}
+
+static gint compare_strings(gconstpointer a, gconstpointer b) {
+    return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+static GString* serialize_cache(GHashTable* cache) {
+    GPtrArray* mime_types = g_ptr_array_sized_new(g_hash_table_size(cache));
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, cache);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (((GPtrArray*) value)->len > 0) {
+            g_ptr_array_add(mime_types, key);
+        }
+    }
+    // sorted like update-desktop-database does, so that the file doesn't change needlessly
+    g_ptr_array_sort(mime_types, compare_strings);
+
+    GString* data = g_string_new("[" MIMECACHE_GROUP "]\n");
+    for (guint i = 0; i < mime_types->len; i++) {
+        const char* mime_type = g_ptr_array_index(mime_types, i);
+        GPtrArray* desktop_ids = g_hash_table_lookup(cache, mime_type);
+
+        g_string_append(data, mime_type);
+        g_string_append_c(data, '=');
+        for (guint j = 0; j < desktop_ids->len; j++) {
+            g_string_append(data, g_ptr_array_index(desktop_ids, j));
+            g_string_append_c(data, ';');
+        }
+        g_string_append_c(data, '\n');
+    }
+    g_ptr_array_unref(mime_types);
+
+    return data;
+}
+
+gboolean mimecache_update(const char* applications_dir, const char* const* prefixes) {
+    gchar* cache_path = g_build_filename(applications_dir, MIMECACHE_FILE_NAME, NULL);
+
+    GHashTable* cache = load_cache(cache_path, prefixes);
+    if (cache == NULL) {
+        g_free(cache_path);
+        return FALSE;
+    }
+
+    GDir* dir = g_dir_open(applications_dir, 0, NULL);
+    if (dir != NULL) {
+        const gchar* name;
+        while ((name = g_dir_read_name(dir)) != NULL) {
+            if (g_str_has_suffix(name, ".desktop") && has_any_prefix(name, prefixes)) {
+                add_desktop_file(cache, applications_dir, name);
+            }
+        }
+        g_dir_close(dir);
+    }
+
+    // g_file_set_contents() writes to a temporary file and renames it, so readers never see a partial cache
+    GString* data = serialize_cache(cache);
+    GError* error = NULL;
+    gboolean success = g_file_set_contents(cache_path, data->str, data->len, &error);
+    if (!success) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to write %s: %s", cache_path, error->message);
+        g_error_free(error);
+    }
+
+    g_string_free(data, TRUE);
+    g_hash_table_destroy(cache);
+    g_free(cache_path);
+    return success;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <glib.h>
+
+/* Incremental maintenance of mimeinfo.cache, the MIME type -> desktop file
+ * index which update-desktop-database generates for an applications directory.
+ *
+ * Instead of parsing every desktop file in the directory, only the entries of
+ * the desktop files with the given name prefixes are dropped from the existing
+ * cache and read again from the files which are currently installed. */
+
+/* Replace the entries of the desktop files in applications_dir whose names start
+ * with one of prefixes (NULL-terminated) and write the cache atomically.
+ * Returns FALSE if there is no valid cache to start from or writing failed, in
+ * which case the cache has to be rebuilt by update-desktop-database. */
+gboolean mimecache_update(const char* applications_dir, const char* const* prefixes);
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "logger.h"
+#include "mounts.h"
+
+#define MOUNTINFO_PATH "/proc/self/mountinfo"
+
+struct mount_table {
+    GMutex mutex;
+    int fd;
+    // mount ID -> mount_t
+    GHashTable* mounts;
+};
+
+static const char* const remote_fs_types[] = {
+    "nfs", "nfs4", "cifs", "smb3", "smbfs", "ncpfs", "afs", "ceph", "glusterfs", "9p", "lustre", "gpfs", "davfs",
+};
+
+static const char* const virtual_fs_types[] = {
+    "proc", "sysfs", "cgroup", "cgroup2", "devpts", "devtmpfs", "securityfs", "debugfs", "tracefs", "pstore",
+    "bpf", "mqueue", "hugetlbfs", "configfs", "fusectl", "autofs", "binfmt_misc", "efivarfs", "rpc_pipefs",
+    "nsfs", "selinuxfs",
+};
+
+static gboolean is_one_of(const char* fs_type, const char* const* types, gsize n_types) {
+    for (gsize i = 0; i < n_types; i++) {
+        if (strcmp(fs_type, types[i]) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static mount_class_t classify_fs_type(const char* fs_type) {
+    if (g_str_has_prefix(fs_type, "fuse")) {
+        return strcmp(fs_type, "fusectl") == 0 ? MOUNT_CLASS_VIRTUAL : MOUNT_CLASS_FUSE;
+    }
+    if (is_one_of(fs_type, remote_fs_types, G_N_ELEMENTS(remote_fs_types))) {
+        return MOUNT_CLASS_REMOTE;
+    }
+    if (is_one_of(fs_type, virtual_fs_types, G_N_ELEMENTS(virtual_fs_types))) {
+        return MOUNT_CLASS_VIRTUAL;
+    }
+    return MOUNT_CLASS_LOCAL;
+}
+
+// mountinfo escapes spaces, tabs, newlines and backslashes in paths as octal numbers
+static gchar* unescape(const char* field) {
+    gchar* result = g_malloc(strlen(field) + 1);
+    gchar* out = result;
+    for (const char* in = field; *in != '\0'; in++) {
+        if (in[0] == '\\' && in[1] >= '0' && in[1] <= '3' && in[2] >= '0' && in[2] <= '7'
+            && in[3] >= '0' && in[3] <= '7') {
+            *out++ = (char) ((in[1] - '0') * 64 + (in[2] - '0') * 8 + (in[3] - '0'));
+            in += 3;
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+    return result;
+}
+
+/* A line looks like
+ *   36 35 98:0 /mnt1 /mnt/parent rw,noatime master:1 - ext3 /dev/root rw,errors=continue
+ * with any number of optional fields before the separator. */
+static mount_t* parse_line(const char* line) {
+    gchar** fields = g_strsplit(line, " ", -1);
+    guint n_fields = g_strv_length(fields);
+
+    guint separator = 6;
+    while (separator < n_fields && strcmp(fields[separator], "-") != 0) {
+        separator++;
+    }
+
+    mount_t* mount = NULL;
+    if (n_fields >= 5 && separator + 1 < n_fields) {
+        mount = g_new0(mount_t, 1);
+        mount->id = atoi(fields[0]);
+        mount->mount_point = unescape(fields[4]);
+        mount->fs_type = g_strdup(fields[separator + 1]);
+        mount->class = classify_fs_type(mount->fs_type);
+    }
+
+    g_strfreev(fields);
+    return mount;
+}
+
+// mount ID -> mount_t, NULL if the file can't be read
+static GHashTable* read_mounts(int fd) {
+    GString* data = g_string_new(NULL);
+    char buffer[4096];
+    ssize_t n;
+
+    if (lseek(fd, 0, SEEK_SET) != 0) {
+        g_string_free(data, TRUE);
+        return NULL;
+    }
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        g_string_append_len(data, buffer, n);
+    }
+    if (n < 0) {
+        g_string_free(data, TRUE);
+        return NULL;
+    }
+
+    GHashTable* mounts = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) mount_free);
+    gchar** lines = g_strsplit(data->str, "\n", -1);
+    for (gchar** line = lines; *line != NULL; line++) {
+        mount_t* mount = **line != '\0' ? parse_line(*line) : NULL;
+        if (mount != NULL) {
+            g_hash_table_replace(mounts, GINT_TO_POINTER(mount->id), mount);
+        }
+    }
+    g_strfreev(lines);
+    g_string_free(data, TRUE);
+
+    return mounts;
+}
+
+static mount_t* mount_copy(const mount_t* mount) {
+    mount_t* copy = g_new0(mount_t, 1);
+    copy->id = mount->id;
+    copy->mount_point = g_strdup(mount->mount_point);
+    copy->fs_type = g_strdup(mount->fs_type);
+    copy->class = mount->class;
+    return copy;
+}
+
+mount_table_t* mount_table_new(void) {
+    int fd = open(MOUNTINFO_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to open %s: %s", MOUNTINFO_PATH, strerror(errno));
+        return NULL;
+    }
+
+    GHashTable* mounts = read_mounts(fd);
+    if (mounts == NULL) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to read %s: %s", MOUNTINFO_PATH, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    mount_table_t* table = g_new0(mount_table_t, 1);
+    g_mutex_init(&table->mutex);
+    table->fd = fd;
+    table->mounts = mounts;
+    return table;
+}
+
+int mount_table_get_fd(mount_table_t* table) {
+    return table->fd;
+}
+
+void mount_table_update(mount_table_t* table, GPtrArray* added, GPtrArray* removed) {
+    GHashTable* mounts = read_mounts(table->fd);
+    if (mounts == NULL) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to read %s: %s", MOUNTINFO_PATH, strerror(errno));
+        return;
+    }
+
+    g_mutex_lock(&table->mutex);
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_hash_table_iter_init(&iter, mounts);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (!g_hash_table_contains(table->mounts, key)) {
+            g_ptr_array_add(added, mount_copy(value));
+        }
+    }
+
+    g_hash_table_iter_init(&iter, table->mounts);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (!g_hash_table_contains(mounts, key)) {
+            g_ptr_array_add(removed, mount_copy(value));
+        }
+    }
+
+    g_hash_table_unref(table->mounts);
+    table->mounts = mounts;
+    g_mutex_unlock(&table->mutex);
+}
+
+GPtrArray* mount_table_get_mounts(mount_table_t* table) {
+    GPtrArray* mounts = g_ptr_array_new_with_free_func((GDestroyNotify) mount_free);
+
+    g_mutex_lock(&table->mutex);
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, table->mounts);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        g_ptr_array_add(mounts, mount_copy(value));
+    }
+    g_mutex_unlock(&table->mutex);
+
+    return mounts;
+}
+
+mount_class_t mount_table_classify(mount_table_t* table, const char* path) {
+    mount_class_t class = MOUNT_CLASS_LOCAL;
+    gsize longest = 0;
+    int top_id = -1;
+
+    g_mutex_lock(&table->mutex);
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, table->mounts);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        const mount_t* mount = value;
+        gsize length = strlen(mount->mount_point);
+        if (strncmp(path, mount->mount_point, length) != 0
+            || (path[length] != '\0' && path[length] != '/' && length != 1)) {
+            continue;
+        }
+
+        // of the mounts stacked on the same mount point, the newer one (with the higher ID) is on top
+        if (length > longest || (length == longest && mount->id > top_id)) {
+            longest = length;
+            top_id = mount->id;
+            class = mount->class;
+        }
+    }
+    g_mutex_unlock(&table->mutex);
+
+    return class;
+}
+
+const char* mount_class_get_name(mount_class_t class) {
+    switch (class) {
+        case MOUNT_CLASS_LOCAL:
+            return "local";
+        case MOUNT_CLASS_FUSE:
+            return "FUSE";
+        case MOUNT_CLASS_REMOTE:
+            return "remote";
+        case MOUNT_CLASS_VIRTUAL:
+            return "virtual";
+        default:
+            return "unknown";
+    }
+}
+
+void mount_free(mount_t* mount) {
+    if (mount == NULL) {
+        return;
+    }
+    g_free(mount->mount_point);
+    g_free(mount->fs_type);
+    g_free(mount);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <glib.h>
+
+/* Tracks the mounted file systems through /proc/self/mountinfo.
+ *
+ * The kernel signals every change of the mount table with POLLPRI on that file,
+ * so the main loop polls the file descriptor and calls mount_table_update() to
+ * find out which mounts came and went. Mounts are classified by their file system
+ * type, so that slow or remote file systems can be scanned separately, and pseudo
+ * file systems aren't looked at (or, for autofs, triggered) at all. */
+
+typedef enum {
+    MOUNT_CLASS_LOCAL,
+    // FUSE file systems, which may be backed by anything, e.g., sshfs or a slow NTFS driver
+    MOUNT_CLASS_FUSE,
+    // network file systems such as NFS and CIFS, which may hang when the server is unreachable
+    MOUNT_CLASS_REMOTE,
+    // pseudo file systems such as proc and sysfs, and autofs mount points
+    MOUNT_CLASS_VIRTUAL,
+    MOUNT_CLASS_COUNT,
+} mount_class_t;
+
+typedef struct {
+    int id;
+    gchar* mount_point;
+    gchar* fs_type;
+    mount_class_t class;
+} mount_t;
+
+typedef struct mount_table mount_table_t;
+
+// reads the current mount table, returns NULL if /proc/self/mountinfo can't be opened
+mount_table_t* mount_table_new(void);
+
+// to be polled for POLLPRI (EPOLLPRI), which signals a change of the mount table
+int mount_table_get_fd(mount_table_t* table);
+
+/* Read the mount table again and add the mounts which appeared to added and those which
+ * disappeared to removed; the arrays take ownership and should free them with mount_free(). */
+void mount_table_update(mount_table_t* table, GPtrArray* added, GPtrArray* removed);
+
+// copies of all current mounts, the array frees them
+GPtrArray* mount_table_get_mounts(mount_table_t* table);
+
+// class of the file system path is on, judging by the mount points only, so that nothing blocks
+mount_class_t mount_table_classify(mount_table_t* table, const char* path);
+
+const char* mount_class_get_name(mount_class_t class);
+
+void mount_free(mount_t* mount);
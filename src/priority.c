@@ -0,0 +1,31 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "logger.h"
+#include "priority.h"
+
+// from linux/ioprio.h, which isn't available everywhere
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
+#define BACKGROUND_NICE 10
+
+void priority_lower_current_thread(void) {
+    // on Linux, both calls affect only the calling thread when given its thread ID
+    pid_t tid = (pid_t) syscall(SYS_gettid);
+
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to set idle I/O priority: %s", strerror(errno));
+    }
+
+    errno = 0;
+    int nice = getpriority(PRIO_PROCESS, tid);
+    if (errno == 0 && nice < BACKGROUND_NICE && setpriority(PRIO_PROCESS, tid, BACKGROUND_NICE) != 0) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to lower thread priority: %s", strerror(errno));
+    }
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+/* Threads doing background work (the initial scan, completing registrations)
+ * lower their CPU and I/O priority, so that they neither compete with the work
+ * caused by live events nor make the desktop sluggish, e.g., right after login.
+ * The priority can't be raised again by unprivileged processes, so this is
+ * meant for threads which only ever do background work. */
+
+// switch the calling thread to the idle I/O scheduling class and increase its nice value
+void priority_lower_current_thread(void);
@@ -0,0 +1,76 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include <appimage/appimage.h>
+
+#include "fingerprint.h"
+#include "probe.h"
+#include "sniff.h"
+
+probe_t* probe_open(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    probe_t* probe = g_new0(probe_t, 1);
+    probe->path = g_strdup(path);
+    probe->fd = fd;
+    probe->type = -1;
+
+    if (fstat(fd, &probe->st) != 0 || !S_ISREG(probe->st.st_mode)) {
+        probe_free(probe);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return probe;
+}
+
+gboolean probe_read_header(probe_t* probe) {
+    probe->type = sniff_get_appimage_type(probe->fd);
+    if (probe->type != -1) {
+        probe->fingerprint = fingerprint_compute(probe->fd, &probe->st);
+    }
+    return probe->type != -1;
+}
+
+void probe_find_desktop_file(probe_t* probe) {
+    if (probe->md5 == NULL) {
+        char* md5 = appimage_get_md5(probe->path);
+        probe->md5 = g_strdup(md5);
+        free(md5);
+    }
+
+    g_free(probe->desktop_file_path);
+    probe->desktop_file_path = NULL;
+
+    // searches the desktop entries for the digest, so this is only done once per step
+    char* desktop_file_path = probe->md5 != NULL
+                              ? appimage_registered_desktop_file_path(probe->path, probe->md5, false)
+                              : NULL;
+    probe->desktop_file_path = g_strdup(desktop_file_path);
+    free(desktop_file_path);
+}
+
+gboolean probe_compute_content_hash(probe_t* probe) {
+    if (!probe->has_content_hash) {
+        probe->has_content_hash = fingerprint_compute_content_hash(probe->fd, &probe->st, probe->content_hash);
+    }
+    return probe->has_content_hash;
+}
+
+void probe_free(probe_t* probe) {
+    if (probe == NULL) {
+        return;
+    }
+    close(probe->fd);
+    g_free(probe->path);
+    g_free(probe->md5);
+    g_free(probe->desktop_file_path);
+    g_free(probe);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "fingerprint.h"
+
+/* What a job finds out about a file, gathered through a single file descriptor.
+ *
+ * Handling a file used to open and parse it once for every question asked about it:
+ * whether it is an AppImage at all, its type, whether it is registered already and
+ * where its desktop entry is. A probe reads the header and the fingerprint through
+ * one file descriptor, takes the type from the magic bytes just like appimage_get_type()
+ * does, and looks up the deployed desktop entry once, so that the later steps of the
+ * job use what it found. Extracting the contents is still up to libappimage, which
+ * opens the AppImage by its path. */
+
+typedef struct {
+    gchar* path;
+    // open for reading until probe_free()
+    int fd;
+    // taken before the file is inspected, so that changes made in the meantime invalidate the registry entry
+    struct stat st;
+    // as returned by appimage_get_type(), -1 if the file is not an AppImage
+    gint type;
+    // fingerprint_compute() of the contents, 0 if the file is not an AppImage
+    guint64 fingerprint;
+    // MD5 digest of the path, which the integration files are named after; set by probe_find_desktop_file()
+    gchar* md5;
+    // the deployed desktop entry, NULL if the AppImage isn't registered; set by probe_find_desktop_file()
+    gchar* desktop_file_path;
+    // set by probe_compute_content_hash()
+    gboolean has_content_hash;
+    guint8 content_hash[CONTENT_HASH_SIZE];
+} probe_t;
+
+// NULL if path can't be opened (errno is set) or is not a regular file (errno is EINVAL)
+probe_t* probe_open(const char* path);
+
+// determine the type and the fingerprint, returns whether the file is an AppImage
+gboolean probe_read_header(probe_t* probe);
+
+// look up the deployed desktop entry of the AppImage, again after it was (un)registered
+void probe_find_desktop_file(probe_t* probe);
+
+// compute the content hash once, which reads the whole file; returns FALSE if it can't be read
+gboolean probe_compute_content_hash(probe_t* probe);
+
+void probe_free(probe_t* probe);
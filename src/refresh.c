@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+
+#include <xdg-basedir.h>
+
+#include "integration.h"
+#include "logger.h"
+#include "mimecache.h"
+#include "refresh.h"
+#include "stats.h"
+
+extern char** environ;
+
+// a single change is picked up after REFRESH_MIN_DELAY, every further change doubles the delay up to REFRESH_MAX_DELAY
+#define REFRESH_MIN_DELAY (250 * 1000)
+#define REFRESH_MAX_DELAY (3 * 1000 * 1000)
+// during a steady stream of changes, refresh at least this often
+#define REFRESH_MAX_LATENCY (15 * 1000 * 1000)
+
+struct tool {
+    // categories of changes the tool has to be run for
+    guint categories;
+    // NULL-terminated, the first element is the absolute path of the program
+    gchar** argv;
+    // the tool's work can be done by the built-in cache generation
+    gboolean has_builtin;
+};
+
+struct refresh_scheduler {
+    GMutex mutex;
+    GCond cond;
+    gboolean shutdown;
+    // changes are only collected, the refresh runs when the scheduler is freed
+    gboolean deferred;
+    pthread_t thread;
+
+    gboolean builtin_caches;
+    gchar* applications_dir;
+    // struct tool, only tools which are installed
+    GPtrArray* tools;
+
+    // categories changed since the last refresh
+    guint pending;
+    // set of integration file prefixes of the AppImages which changed since the last refresh
+    GHashTable* pending_prefixes;
+    // a change could not be attributed to an AppImage
+    gboolean pending_rebuild;
+    guint n_changes;
+    gint64 first_change;
+    gint64 deadline;
+};
+
+static void tool_free(gpointer data) {
+    struct tool* tool = data;
+    g_strfreev(tool->argv);
+    g_free(tool);
+}
+
+static void add_tool(refresh_scheduler_t* scheduler, guint categories, gboolean has_builtin, const char* program, ...) {
+    gchar* program_path = g_find_program_in_path(program);
+    if (program_path == NULL) {
+        logger_print(LOGGER_LEVEL_DEBUG, "%s not found, skipping it when updating the desktop", program);
+        return;
+    }
+
+    GPtrArray* argv = g_ptr_array_new();
+    g_ptr_array_add(argv, program_path);
+
+    va_list arguments;
+    va_start(arguments, program);
+    const char* argument;
+    while ((argument = va_arg(arguments, const char*)) != NULL) {
+        g_ptr_array_add(argv, g_strdup(argument));
+    }
+    va_end(arguments);
+    g_ptr_array_add(argv, NULL);
+
+    struct tool* tool = g_new0(struct tool, 1);
+    tool->categories = categories;
+    tool->has_builtin = has_builtin;
+    tool->argv = (gchar**) g_ptr_array_free(argv, FALSE);
+    g_ptr_array_add(scheduler->tools, tool);
+}
+
+static void run_tools(refresh_scheduler_t* scheduler, guint categories, GHashTable* prefixes, gboolean rebuild) {
+    logger_print(LOGGER_LEVEL_INFO, "Updating desktop...");
+    gint64 update_start = g_get_monotonic_time();
+
+    // update the existing desktop database in place, the tool has to parse every desktop file again
+    gboolean builtin_done = FALSE;
+    if (scheduler->builtin_caches && (categories & REFRESH_DESKTOP_ENTRIES) && !rebuild
+        && g_hash_table_size(prefixes) > 0) {
+        const char** prefix_array = (const char**) g_hash_table_get_keys_as_array(prefixes, NULL);
+        builtin_done = mimecache_update(scheduler->applications_dir, prefix_array);
+        g_free(prefix_array);
+
+        logger_print(LOGGER_LEVEL_DEBUG, "%s", builtin_done ? "Updated desktop database in place"
+                                                            : "Cannot update desktop database in place, rebuilding it");
+    }
+
+    // appimaged blocks the signals it handles via its signalfd, and a blocked mask survives exec, so the tools would
+    // not react to SIGTERM or SIGINT; spawn them with nothing blocked and the default dispositions instead
+    sigset_t empty_mask, default_signals;
+    sigemptyset(&empty_mask);
+    sigemptyset(&default_signals);
+    sigaddset(&default_signals, SIGUSR1);
+    sigaddset(&default_signals, SIGHUP);
+    sigaddset(&default_signals, SIGTERM);
+    sigaddset(&default_signals, SIGINT);
+
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setsigmask(&attributes, &empty_mask);
+    posix_spawnattr_setsigdefault(&attributes, &default_signals);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    // the tools work on separate caches, so they can all run at the same time
+    pid_t* pids = g_new(pid_t, scheduler->tools->len);
+    for (guint i = 0; i < scheduler->tools->len; i++) {
+        struct tool* tool = g_ptr_array_index(scheduler->tools, i);
+        pids[i] = -1;
+
+        if ((tool->categories & categories) == 0 || (tool->has_builtin && builtin_done)) {
+            continue;
+        }
+
+        logger_print(LOGGER_LEVEL_DEBUG, "Running %s", tool->argv[0]);
+
+        int error = posix_spawn(&pids[i], tool->argv[0], NULL, &attributes, tool->argv, environ);
+        if (error != 0) {
+            logger_print(LOGGER_LEVEL_ERROR, "Failed to run %s: %s", tool->argv[0], strerror(error));
+            pids[i] = -1;
+        }
+    }
+    posix_spawnattr_destroy(&attributes);
+
+    for (guint i = 0; i < scheduler->tools->len; i++) {
+        if (pids[i] < 0) {
+            continue;
+        }
+
+        struct tool* tool = g_ptr_array_index(scheduler->tools, i);
+        int status;
+        pid_t result;
+        do {
+            result = waitpid(pids[i], &status, 0);
+        } while (result < 0 && errno == EINTR);
+
+        if (result < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            logger_print(LOGGER_LEVEL_WARNING, "Warning: %s returned non-zero exit code", tool->argv[0]);
+        }
+    }
+    g_free(pids);
+
+    gint64 update_end = stats_record_since(STATS_STAGE_REFRESH, update_start);
+    logger_print(LOGGER_LEVEL_INFO, "Finished updating desktop in %" G_GINT64_FORMAT " milliseconds.",
+                 (update_end - update_start) / 1000);
+}
+
+static void* refresh_scheduler_main(void* arguments) {
+    refresh_scheduler_t* scheduler = arguments;
+
+    g_mutex_lock(&scheduler->mutex);
+    while (TRUE) {
+        if (scheduler->pending != 0
+            && (scheduler->shutdown || (!scheduler->deferred && g_get_monotonic_time() >= scheduler->deadline))) {
+            guint categories = scheduler->pending;
+            GHashTable* prefixes = scheduler->pending_prefixes;
+            gboolean rebuild = scheduler->pending_rebuild;
+            scheduler->pending = 0;
+            scheduler->pending_prefixes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+            scheduler->pending_rebuild = FALSE;
+
+            // changes signalled while the tools are running are collected for the next refresh
+            g_mutex_unlock(&scheduler->mutex);
+            run_tools(scheduler, categories, prefixes, rebuild);
+            g_hash_table_destroy(prefixes);
+            g_mutex_lock(&scheduler->mutex);
+            continue;
+        }
+
+        if (scheduler->shutdown) {
+            break;
+        }
+
+        if (scheduler->pending == 0 || scheduler->deferred) {
+            g_cond_wait(&scheduler->cond, &scheduler->mutex);
+        } else {
+            g_cond_wait_until(&scheduler->cond, &scheduler->mutex, scheduler->deadline);
+        }
+    }
+    g_mutex_unlock(&scheduler->mutex);
+
+    return NULL;
+}
+
+refresh_scheduler_t* refresh_scheduler_new(gboolean builtin_caches) {
+    refresh_scheduler_t* scheduler = g_new0(refresh_scheduler_t, 1);
+
+    g_mutex_init(&scheduler->mutex);
+    g_cond_init(&scheduler->cond);
+    scheduler->builtin_caches = builtin_caches;
+    scheduler->tools = g_ptr_array_new_with_free_func(tool_free);
+    scheduler->pending_prefixes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    char* data_home = xdg_data_home();
+    scheduler->applications_dir = g_build_filename(data_home, "applications", NULL);
+    gchar* mime_dir = g_build_filename(data_home, "mime", NULL);
+    gchar* hicolor_dir = g_build_filename(data_home, "icons", "hicolor", NULL);
+    free(data_home);
+
+    add_tool(scheduler, REFRESH_DESKTOP_ENTRIES, TRUE, "update-desktop-database", scheduler->applications_dir, NULL);
+    add_tool(scheduler, REFRESH_MIME, FALSE, "update-mime-database", mime_dir, NULL);
+    add_tool(scheduler, REFRESH_ICONS, FALSE, "gtk-update-icon-cache", hicolor_dir, "-t", NULL);
+    // KDE's system configuration cache contains both the applications and the MIME types
+    add_tool(scheduler, REFRESH_DESKTOP_ENTRIES | REFRESH_MIME, FALSE, "kbuildsycoca5", NULL);
+
+    g_free(hicolor_dir);
+    g_free(mime_dir);
+
+    if (pthread_create(&scheduler->thread, NULL, refresh_scheduler_main, scheduler) != 0) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to create desktop update thread");
+        g_ptr_array_unref(scheduler->tools);
+        g_hash_table_destroy(scheduler->pending_prefixes);
+        g_free(scheduler->applications_dir);
+        g_cond_clear(&scheduler->cond);
+        g_mutex_clear(&scheduler->mutex);
+        g_free(scheduler);
+        return NULL;
+    }
+
+    return scheduler;
+}
+
+void refresh_scheduler_defer(refresh_scheduler_t* scheduler) {
+    g_mutex_lock(&scheduler->mutex);
+    scheduler->deferred = TRUE;
+    g_mutex_unlock(&scheduler->mutex);
+}
+
+void refresh_scheduler_request(refresh_scheduler_t* scheduler, guint categories, const char* appimage_path) {
+    if (categories == 0) {
+        return;
+    }
+
+    gchar* prefix = appimage_path != NULL ? integration_get_file_prefix(appimage_path) : NULL;
+    refresh_scheduler_request_prefix(scheduler, categories, prefix);
+    g_free(prefix);
+}
+
+void refresh_scheduler_request_prefix(refresh_scheduler_t* scheduler, guint categories, const char* prefix) {
+    if (categories == 0) {
+        return;
+    }
+
+    gint64 now = g_get_monotonic_time();
+
+    g_mutex_lock(&scheduler->mutex);
+    if (prefix != NULL) {
+        g_hash_table_add(scheduler->pending_prefixes, g_strdup(prefix));
+    } else {
+        scheduler->pending_rebuild = TRUE;
+    }
+
+    if (scheduler->pending == 0) {
+        scheduler->n_changes = 0;
+        scheduler->first_change = now;
+    }
+    scheduler->pending |= categories;
+
+    gint64 delay = MIN((gint64) REFRESH_MIN_DELAY << MIN(scheduler->n_changes, 8), REFRESH_MAX_DELAY);
+    scheduler->n_changes++;
+    scheduler->deadline = MIN(now + delay, scheduler->first_change + REFRESH_MAX_LATENCY);
+
+    g_cond_signal(&scheduler->cond);
+    g_mutex_unlock(&scheduler->mutex);
+}
+
+void refresh_scheduler_free(refresh_scheduler_t* scheduler) {
+    if (scheduler == NULL) {
+        return;
+    }
+
+    g_mutex_lock(&scheduler->mutex);
+    scheduler->shutdown = TRUE;
+    g_cond_signal(&scheduler->cond);
+    g_mutex_unlock(&scheduler->mutex);
+
+    pthread_join(scheduler->thread, NULL);
+
+    g_ptr_array_unref(scheduler->tools);
+    g_hash_table_destroy(scheduler->pending_prefixes);
+    g_free(scheduler->applications_dir);
+    g_cond_clear(&scheduler->cond);
+    g_mutex_clear(&scheduler->mutex);
+    g_free(scheduler);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <glib.h>
+
+/* Refreshes the desktop's caches (desktop database, MIME database, icon cache,
+ * KDE's sycoca) after integration files have been added or removed.
+ *
+ * Changes are signalled per category, and once they have settled only the tools
+ * for the categories which changed are run, in parallel and without a shell.
+ * The delay adapts to the rate of changes: a single installation is picked up
+ * almost immediately, whereas a burst of changes (e.g., the initial scan) is
+ * collected for up to a few seconds, but never deferred indefinitely.
+ *
+ * Unless disabled, the desktop database (mimeinfo.cache) is updated in place
+ * for the AppImages which changed, update-desktop-database is only run if that
+ * isn't possible.
+ *
+ * The MIME database is not updated in place: whenever the MIME packages of an
+ * AppImage change, update-mime-database regenerates the files derived from
+ * mime/packages (globs2, magic, the binary mime.cache, ...) from scratch, since
+ * they have to stay consistent with each other. It is only run for AppImages
+ * which actually ship MIME packages, though, see integration_has_mime_packages(). */
+
+typedef enum {
+    REFRESH_DESKTOP_ENTRIES = 1 << 0,
+    REFRESH_MIME = 1 << 1,
+    REFRESH_ICONS = 1 << 2,
+    REFRESH_ALL = REFRESH_DESKTOP_ENTRIES | REFRESH_MIME | REFRESH_ICONS,
+} refresh_category_t;
+
+typedef struct refresh_scheduler refresh_scheduler_t;
+
+// looks up the tools in $PATH and starts the scheduler thread; tools which aren't installed are skipped
+refresh_scheduler_t* refresh_scheduler_new(gboolean builtin_caches);
+
+// collect all changes and refresh only once, when the scheduler is freed, e.g., at the end of a batch of registrations
+void refresh_scheduler_defer(refresh_scheduler_t* scheduler);
+
+/* categories is a combination of refresh_category_t flags, appimage_path the AppImage whose
+ * integration files changed, or NULL if the caches have to be rebuilt from scratch */
+void refresh_scheduler_request(refresh_scheduler_t* scheduler, guint categories, const char* appimage_path);
+
+// same as refresh_scheduler_request(), for an AppImage known only by the prefix of its integration files' names
+void refresh_scheduler_request_prefix(refresh_scheduler_t* scheduler, guint categories, const char* prefix);
+
+// runs a pending refresh right away and frees the scheduler
+void refresh_scheduler_free(refresh_scheduler_t* scheduler);
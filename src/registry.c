@@ -0,0 +1,510 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "fingerprint.h"
+#include "logger.h"
+#include "registry.h"
+
+/* Layout of the index file:
+ * header, n_entries fixed-size entries, string table with NUL-terminated paths.
+ * The file is a cache only, so it is stored in native byte order; any change to
+ * the layout must bump REGISTRY_FILE_VERSION, files with another version are ignored. */
+#define REGISTRY_FILE_MAGIC "AIDINDEX"
+#define REGISTRY_FILE_VERSION 3
+
+#define REGISTRY_FLAG_REGISTERED (1 << 0)
+#define REGISTRY_FLAG_CONTENT_HASH (1 << 1)
+
+struct registry_file_header {
+    char magic[8];
+    guint32 version;
+    guint32 n_entries;
+    guint64 strings_size;
+};
+
+struct registry_file_entry {
+    guint64 dev;
+    guint64 ino;
+    gint64 size;
+    gint64 mtime_sec;
+    guint32 mtime_nsec;
+    gint32 type;
+    guint32 flags;
+    guint32 path_offset;
+    guint32 path_length;
+    guint32 reserved;
+    guint64 fingerprint;
+    guint8 content_hash[CONTENT_HASH_SIZE];
+};
+
+struct registry_item {
+    registry_entry_t entry;
+    gboolean seen;
+};
+
+static GMutex registry_mutex;
+// signalled whenever the registry changes
+static GCond registry_cond;
+// path -> struct registry_item
+static GHashTable* registry = NULL;
+// fingerprint -> set of the paths of the registered AppImages with it, so that copies are found without a full scan
+static GHashTable* registered_by_fingerprint = NULL;
+static gchar* registry_file_path = NULL;
+static gboolean registry_dirty = FALSE;
+static gint64 registry_last_change = 0;
+
+static void fill_entry_from_stat(registry_entry_t* entry, const struct stat* st) {
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime_sec = st->st_mtim.tv_sec;
+    entry->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+static gboolean entry_matches_stat(const registry_entry_t* entry, const struct stat* st) {
+    return entry->dev == st->st_dev
+           && entry->ino == st->st_ino
+           && entry->size == st->st_size
+           && entry->mtime_sec == st->st_mtim.tv_sec
+           && entry->mtime_nsec == st->st_mtim.tv_nsec;
+}
+
+static gboolean is_indexed(const registry_entry_t* entry) {
+    return entry->registered && entry->type != -1 && entry->fingerprint != 0;
+}
+
+// must be called with the mutex held
+static void index_add_locked(const char* path, const registry_entry_t* entry) {
+    if (!is_indexed(entry)) {
+        return;
+    }
+
+    GHashTable* paths = g_hash_table_lookup(registered_by_fingerprint, &entry->fingerprint);
+    if (paths == NULL) {
+        paths = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+        guint64* fingerprint = g_new(guint64, 1);
+        *fingerprint = entry->fingerprint;
+        g_hash_table_insert(registered_by_fingerprint, fingerprint, paths);
+    }
+    if (!g_hash_table_contains(paths, path)) {
+        g_hash_table_add(paths, g_strdup(path));
+    }
+}
+
+// must be called with the mutex held
+static void index_remove_locked(const char* path, const registry_entry_t* entry) {
+    if (!is_indexed(entry)) {
+        return;
+    }
+
+    GHashTable* paths = g_hash_table_lookup(registered_by_fingerprint, &entry->fingerprint);
+    if (paths != NULL && g_hash_table_remove(paths, path) && g_hash_table_size(paths) == 0) {
+        g_hash_table_remove(registered_by_fingerprint, &entry->fingerprint);
+    }
+}
+
+// must be called with the mutex held
+static void clear_locked() {
+    g_hash_table_remove_all(registry);
+    g_hash_table_remove_all(registered_by_fingerprint);
+}
+
+// must be called with the mutex held
+static void mark_dirty_locked() {
+    registry_dirty = TRUE;
+    registry_last_change = g_get_monotonic_time();
+    g_cond_broadcast(&registry_cond);
+}
+
+static gboolean load_index_file(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return FALSE;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct registry_file_header)) {
+        close(fd);
+        return FALSE;
+    }
+
+    size_t file_size = (size_t) st.st_size;
+    const char* data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return FALSE;
+    }
+
+    gboolean success = FALSE;
+    const struct registry_file_header* header = (const struct registry_file_header*) data;
+
+    if (memcmp(header->magic, REGISTRY_FILE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != REGISTRY_FILE_VERSION) {
+        goto out;
+    }
+
+    size_t entries_size = (size_t) header->n_entries * sizeof(struct registry_file_entry);
+    if (entries_size / sizeof(struct registry_file_entry) != header->n_entries
+        || file_size - sizeof(*header) < entries_size
+        || file_size - sizeof(*header) - entries_size != header->strings_size) {
+        goto out;
+    }
+
+    const struct registry_file_entry* entries = (const struct registry_file_entry*) (data + sizeof(*header));
+    const char* strings = data + sizeof(*header) + entries_size;
+
+    for (guint32 i = 0; i < header->n_entries; i++) {
+        const struct registry_file_entry* file_entry = &entries[i];
+
+        if ((guint64) file_entry->path_offset + file_entry->path_length >= header->strings_size
+            || strings[file_entry->path_offset + file_entry->path_length] != '\0') {
+            clear_locked();
+            goto out;
+        }
+
+        struct registry_item* item = g_new0(struct registry_item, 1);
+        item->entry.dev = (dev_t) file_entry->dev;
+        item->entry.ino = (ino_t) file_entry->ino;
+        item->entry.size = (off_t) file_entry->size;
+        item->entry.mtime_sec = file_entry->mtime_sec;
+        item->entry.mtime_nsec = file_entry->mtime_nsec;
+        item->entry.type = file_entry->type;
+        item->entry.registered = (file_entry->flags & REGISTRY_FLAG_REGISTERED) != 0;
+        item->entry.fingerprint = file_entry->fingerprint;
+        item->entry.has_content_hash = (file_entry->flags & REGISTRY_FLAG_CONTENT_HASH) != 0;
+        memcpy(item->entry.content_hash, file_entry->content_hash, CONTENT_HASH_SIZE);
+
+        gchar* item_path = g_strndup(strings + file_entry->path_offset, file_entry->path_length);
+        struct registry_item* replaced = g_hash_table_lookup(registry, item_path);
+        if (replaced != NULL) {
+            index_remove_locked(item_path, &replaced->entry);
+        }
+        index_add_locked(item_path, &item->entry);
+        g_hash_table_replace(registry, item_path, item);
+    }
+
+    success = TRUE;
+
+out:
+    munmap((void*) data, file_size);
+    return success;
+}
+
+// must be called with the mutex held
+static GString* serialize_locked() {
+    guint32 n_entries = g_hash_table_size(registry);
+    GString* strings = g_string_new(NULL);
+    GString* data = g_string_sized_new(sizeof(struct registry_file_header)
+                                       + n_entries * sizeof(struct registry_file_entry));
+
+    struct registry_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, REGISTRY_FILE_MAGIC, sizeof(header.magic));
+    header.version = REGISTRY_FILE_VERSION;
+    header.n_entries = n_entries;
+    g_string_append_len(data, (const gchar*) &header, sizeof(header));
+
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, registry);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const char* path = key;
+        const struct registry_item* item = value;
+
+        struct registry_file_entry file_entry;
+        memset(&file_entry, 0, sizeof(file_entry));
+        file_entry.dev = item->entry.dev;
+        file_entry.ino = item->entry.ino;
+        file_entry.size = item->entry.size;
+        file_entry.mtime_sec = item->entry.mtime_sec;
+        file_entry.mtime_nsec = (guint32) item->entry.mtime_nsec;
+        file_entry.type = item->entry.type;
+        file_entry.flags = (item->entry.registered ? REGISTRY_FLAG_REGISTERED : 0)
+                           | (item->entry.has_content_hash ? REGISTRY_FLAG_CONTENT_HASH : 0);
+        file_entry.fingerprint = item->entry.fingerprint;
+        memcpy(file_entry.content_hash, item->entry.content_hash, CONTENT_HASH_SIZE);
+        file_entry.path_offset = (guint32) strings->len;
+        file_entry.path_length = (guint32) strlen(path);
+        g_string_append_len(data, (const gchar*) &file_entry, sizeof(file_entry));
+
+        g_string_append_len(strings, path, file_entry.path_length + 1);
+    }
+
+    ((struct registry_file_header*) data->str)->strings_size = strings->len;
+    g_string_append_len(data, strings->str, strings->len);
+    g_string_free(strings, TRUE);
+
+    return data;
+}
+
+void registry_init(const char* index_file_path) {
+    g_mutex_lock(&registry_mutex);
+
+    if (registry == NULL) {
+        registry = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+        registered_by_fingerprint = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free,
+                                                          (GDestroyNotify) g_hash_table_unref);
+    }
+
+    g_free(registry_file_path);
+    registry_file_path = g_strdup(index_file_path);
+
+    if (registry_file_path != NULL && !load_index_file(registry_file_path)) {
+        // unreadable or outdated index, start from scratch and replace it on the next save
+        clear_locked();
+        mark_dirty_locked();
+    }
+
+    g_mutex_unlock(&registry_mutex);
+}
+
+gboolean registry_lookup(const char* path, const struct stat* st, registry_entry_t* entry) {
+    gboolean result = FALSE;
+
+    g_mutex_lock(&registry_mutex);
+    struct registry_item* item = registry != NULL ? g_hash_table_lookup(registry, path) : NULL;
+    if (item != NULL) {
+        item->seen = TRUE;
+        if (entry_matches_stat(&item->entry, st)) {
+            if (entry != NULL) {
+                *entry = item->entry;
+            }
+            result = TRUE;
+        }
+    }
+    g_mutex_unlock(&registry_mutex);
+
+    return result;
+}
+
+gboolean registry_get(const char* path, registry_entry_t* entry) {
+    gboolean result = FALSE;
+
+    g_mutex_lock(&registry_mutex);
+    struct registry_item* item = registry != NULL ? g_hash_table_lookup(registry, path) : NULL;
+    if (item != NULL) {
+        if (entry != NULL) {
+            *entry = item->entry;
+        }
+        result = TRUE;
+    }
+    g_mutex_unlock(&registry_mutex);
+
+    return result;
+}
+
+void registry_record(const char* path, const struct stat* st, gint type, gboolean registered, guint64 fingerprint) {
+    g_mutex_lock(&registry_mutex);
+    if (registry != NULL) {
+        struct registry_item* item = g_hash_table_lookup(registry, path);
+        if (item == NULL) {
+            item = g_new0(struct registry_item, 1);
+            g_hash_table_insert(registry, g_strdup(path), item);
+        } else {
+            index_remove_locked(path, &item->entry);
+        }
+
+        // the content hash is only kept as long as the file is unchanged
+        if (!entry_matches_stat(&item->entry, st) || item->entry.type != type) {
+            item->entry.has_content_hash = FALSE;
+        }
+
+        fill_entry_from_stat(&item->entry, st);
+        item->entry.type = type;
+        item->entry.registered = registered;
+        item->entry.fingerprint = fingerprint;
+        item->seen = TRUE;
+        index_add_locked(path, &item->entry);
+        mark_dirty_locked();
+    }
+    g_mutex_unlock(&registry_mutex);
+}
+
+void registry_set_content_hash(const char* path, const struct stat* st, const guint8* content_hash) {
+    g_mutex_lock(&registry_mutex);
+    struct registry_item* item = registry != NULL ? g_hash_table_lookup(registry, path) : NULL;
+    if (item != NULL && entry_matches_stat(&item->entry, st)) {
+        memcpy(item->entry.content_hash, content_hash, CONTENT_HASH_SIZE);
+        item->entry.has_content_hash = TRUE;
+        mark_dirty_locked();
+    }
+    g_mutex_unlock(&registry_mutex);
+}
+
+void registry_remove(const char* path) {
+    g_mutex_lock(&registry_mutex);
+    struct registry_item* item = registry != NULL ? g_hash_table_lookup(registry, path) : NULL;
+    if (item != NULL) {
+        index_remove_locked(path, &item->entry);
+        g_hash_table_remove(registry, path);
+        mark_dirty_locked();
+    }
+    g_mutex_unlock(&registry_mutex);
+}
+
+void registry_rename(const char* old_path, const char* path) {
+    g_mutex_lock(&registry_mutex);
+    gpointer key, value;
+    if (registry != NULL && g_hash_table_lookup_extended(registry, old_path, &key, &value)) {
+        struct registry_item* item = value;
+        index_remove_locked(old_path, &item->entry);
+        g_hash_table_steal(registry, old_path);
+        g_free(key);
+        item->seen = TRUE;
+
+        struct registry_item* replaced = g_hash_table_lookup(registry, path);
+        if (replaced != NULL) {
+            index_remove_locked(path, &replaced->entry);
+        }
+        index_add_locked(path, &item->entry);
+        g_hash_table_replace(registry, g_strdup(path), item);
+        mark_dirty_locked();
+    }
+    g_mutex_unlock(&registry_mutex);
+}
+
+// prefix NULL returns all paths
+static GPtrArray* get_paths_with_prefix(const char* prefix) {
+    GPtrArray* paths = g_ptr_array_new_with_free_func(g_free);
+
+    g_mutex_lock(&registry_mutex);
+    if (registry != NULL) {
+        GHashTableIter iter;
+        gpointer key;
+        g_hash_table_iter_init(&iter, registry);
+        while (g_hash_table_iter_next(&iter, &key, NULL)) {
+            if (prefix == NULL || g_str_has_prefix(key, prefix)) {
+                g_ptr_array_add(paths, g_strdup(key));
+            }
+        }
+    }
+    g_mutex_unlock(&registry_mutex);
+
+    return paths;
+}
+
+/* Path of a registered AppImage other than path with the fingerprint whose content hash is known and, unless
+ * content_hash is NULL, equal to it; must be called with the mutex held. */
+static const gchar* find_copy_locked(guint64 fingerprint, const guint8* content_hash, const char* path) {
+    GHashTable* paths = registry != NULL && fingerprint != 0
+                        ? g_hash_table_lookup(registered_by_fingerprint, &fingerprint)
+                        : NULL;
+    if (paths == NULL) {
+        return NULL;
+    }
+
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, paths);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        const struct registry_item* item = g_hash_table_lookup(registry, key);
+        if (strcmp(key, path) != 0 && item != NULL && item->entry.has_content_hash
+            && (content_hash == NULL || memcmp(item->entry.content_hash, content_hash, CONTENT_HASH_SIZE) == 0)) {
+            return key;
+        }
+    }
+    return NULL;
+}
+
+gboolean registry_may_have_registered_copy(guint64 fingerprint, const char* path) {
+    g_mutex_lock(&registry_mutex);
+    gboolean result = find_copy_locked(fingerprint, NULL, path) != NULL;
+    g_mutex_unlock(&registry_mutex);
+    return result;
+}
+
+gchar* registry_find_registered_copy(guint64 fingerprint, const guint8* content_hash, const char* path) {
+    g_mutex_lock(&registry_mutex);
+    gchar* copy_path = g_strdup(find_copy_locked(fingerprint, content_hash, path));
+    g_mutex_unlock(&registry_mutex);
+    return copy_path;
+}
+
+GPtrArray* registry_get_paths(void) {
+    return get_paths_with_prefix(NULL);
+}
+
+GPtrArray* registry_get_paths_below(const char* dir_path) {
+    gchar* prefix = g_str_has_suffix(dir_path, G_DIR_SEPARATOR_S)
+                    ? g_strdup(dir_path)
+                    : g_strconcat(dir_path, G_DIR_SEPARATOR_S, NULL);
+    GPtrArray* paths = get_paths_with_prefix(prefix);
+    g_free(prefix);
+    return paths;
+}
+
+struct prune_filter {
+    registry_keep_func_t keep;
+    void* user_data;
+};
+
+static gboolean is_unseen(gpointer key, gpointer value, gpointer user_data) {
+    struct prune_filter* filter = user_data;
+    struct registry_item* item = value;
+    if (item->seen || (filter->keep != NULL && filter->keep(key, filter->user_data))) {
+        return FALSE;
+    }
+
+    // called with the mutex held
+    index_remove_locked(key, &item->entry);
+    return TRUE;
+}
+
+void registry_prune_unseen(registry_keep_func_t keep, void* user_data) {
+    struct prune_filter filter = {keep, user_data};
+    g_mutex_lock(&registry_mutex);
+    if (registry != NULL && g_hash_table_foreach_remove(registry, is_unseen, &filter) > 0) {
+        mark_dirty_locked();
+    }
+    g_mutex_unlock(&registry_mutex);
+}
+
+void registry_wait_until_settled(gint64 min_quiet_time) {
+    g_mutex_lock(&registry_mutex);
+    while (registry_file_path == NULL || !registry_dirty
+           || g_get_monotonic_time() < registry_last_change + min_quiet_time) {
+        if (registry_file_path == NULL || !registry_dirty) {
+            g_cond_wait(&registry_cond, &registry_mutex);
+        } else {
+            g_cond_wait_until(&registry_cond, &registry_mutex, registry_last_change + min_quiet_time);
+        }
+    }
+    g_mutex_unlock(&registry_mutex);
+}
+
+void registry_save_if_dirty(gint64 min_quiet_time) {
+    g_mutex_lock(&registry_mutex);
+    if (registry == NULL || registry_file_path == NULL || !registry_dirty
+        || g_get_monotonic_time() < registry_last_change + min_quiet_time) {
+        g_mutex_unlock(&registry_mutex);
+        return;
+    }
+
+    GString* data = serialize_locked();
+    registry_dirty = FALSE;
+    gchar* file_path = g_strdup(registry_file_path);
+    g_mutex_unlock(&registry_mutex);
+
+    // g_file_set_contents() writes to a temporary file and renames it, so readers never see a partial index
+    GError* error = NULL;
+    gchar* dirname = g_path_get_dirname(file_path);
+    g_mkdir_with_parents(dirname, 0755);
+    if (!g_file_set_contents(file_path, data->str, data->len, &error)) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to save registry index %s: %s", file_path, error->message);
+        g_error_free(error);
+
+        g_mutex_lock(&registry_mutex);
+        mark_dirty_locked();
+        g_mutex_unlock(&registry_mutex);
+    }
+
+    g_free(dirname);
+    g_free(file_path);
+    g_string_free(data, TRUE);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "fingerprint.h"
+
+/* In-memory registry of every file appimaged has inspected, along with the
+ * verdict of that inspection. It is persisted to a compact index file so that
+ * a restarted daemon only needs to stat files it has seen before, and runs the
+ * expensive libappimage checks only for files which have changed since. */
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    gint64 mtime_sec;
+    glong mtime_nsec;
+    // AppImage type as returned by appimage_get_type(), -1 if the file is not an AppImage
+    gint type;
+    // FALSE as long as the registration is incomplete, i.e., only a preliminary desktop entry is deployed
+    gboolean registered;
+    // fingerprint_compute() of the contents which were registered, 0 if unknown
+    guint64 fingerprint;
+    // fingerprint_compute_content_hash() of the contents, which identifies copies of the AppImage
+    gboolean has_content_hash;
+    guint8 content_hash[CONTENT_HASH_SIZE];
+} registry_entry_t;
+
+// load the index file if it is valid; entries are written back to the same file
+void registry_init(const char* index_file_path);
+
+/* Look up path and check whether the entry is still up to date with respect to st.
+ * Returns TRUE and fills entry (if non-NULL) only if the file is unchanged. */
+gboolean registry_lookup(const char* path, const struct stat* st, registry_entry_t* entry);
+
+// fetch the entry for path without checking whether it is up to date
+gboolean registry_get(const char* path, registry_entry_t* entry);
+
+/* Store the verdict for path, st must have been taken before inspecting the file. The content hash is kept
+ * as long as st shows that the file is unchanged. */
+void registry_record(const char* path, const struct stat* st, gint type, gboolean registered, guint64 fingerprint);
+
+// store the content hash of path, unless the file changed since st was taken
+void registry_set_content_hash(const char* path, const struct stat* st, const guint8* content_hash);
+
+void registry_remove(const char* path);
+
+// move the entry for old_path to path, replacing any entry for path
+void registry_rename(const char* old_path, const char* path);
+
+/* Whether there is a completely registered AppImage other than path with the given fingerprint and a known
+ * content hash, i.e., whether it is worth computing the content hash of path to look for a copy. */
+gboolean registry_may_have_registered_copy(guint64 fingerprint, const char* path);
+
+/* Path of a completely registered AppImage other than path with the given fingerprint and content hash,
+ * i.e., a copy of the same AppImage; NULL if there is none. */
+gchar* registry_find_registered_copy(guint64 fingerprint, const guint8* content_hash, const char* path);
+
+// paths of all entries, the array owns the strings
+GPtrArray* registry_get_paths(void);
+
+// paths of all entries below the directory dir_path
+GPtrArray* registry_get_paths_below(const char* dir_path);
+
+typedef gboolean (*registry_keep_func_t)(const char* path, void* user_data);
+
+/* Forget all entries which have not been looked up or recorded since registry_init(), except for
+ * those keep (may be NULL) returns TRUE for, e.g., because their directories weren't read. */
+void registry_prune_unseen(registry_keep_func_t keep, void* user_data);
+
+// block until there are unsaved changes and no change happened for min_quiet_time microseconds
+void registry_wait_until_settled(gint64 min_quiet_time);
+
+// write the index file if it changed, but only after no change happened for min_quiet_time microseconds
+void registry_save_if_dirty(gint64 min_quiet_time);
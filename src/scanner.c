@@ -0,0 +1,259 @@
+// statx() and getdents64() are only declared with _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+
+#include <glib.h>
+
+#include "scanner.h"
+
+// amount of directory entries read at once, and the initial size of the per-level buffers
+#define DIRENT_CHUNK_SIZE (32 * 1024)
+
+struct linux_dirent64 {
+    guint64 d_ino;
+    gint64 d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct walk {
+    const scanner_callbacks_t* callbacks;
+    void* user_data;
+    // the path of the entry which is currently looked at
+    GString* path;
+    // one buffer for the directory entries per level of the tree, reused for all directories on that level
+    GPtrArray* buffers;
+};
+
+#ifdef STATX_BASIC_STATS
+static gboolean statx_unsupported = FALSE;
+#endif
+
+// fills in the fields of st the callbacks need
+static int stat_entry(int dir_fd, const char* name, int flags, struct stat* st) {
+#ifdef STATX_BASIC_STATS
+    if (!statx_unsupported) {
+        struct statx stx;
+        // AT_STATX_DONT_SYNC avoids round trips to the server on network file systems
+        if (statx(dir_fd, name, flags | AT_STATX_DONT_SYNC,
+                  STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME, &stx) == 0) {
+            memset(st, 0, sizeof(*st));
+            st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+            st->st_ino = stx.stx_ino;
+            st->st_mode = stx.stx_mode;
+            st->st_size = stx.stx_size;
+            st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+            st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+            return 0;
+        }
+
+        if (errno != ENOSYS) {
+            return -1;
+        }
+        statx_unsupported = TRUE;
+    }
+#endif
+
+    return fstatat(dir_fd, name, st, flags);
+}
+
+static GByteArray* read_entries(struct walk* walk, int dir_fd, int depth) {
+    while (walk->buffers->len <= (guint) depth) {
+        g_ptr_array_add(walk->buffers, g_byte_array_sized_new(DIRENT_CHUNK_SIZE));
+    }
+
+    GByteArray* buffer = g_ptr_array_index(walk->buffers, depth);
+    g_byte_array_set_size(buffer, 0);
+
+    while (TRUE) {
+        guint used = buffer->len;
+        g_byte_array_set_size(buffer, used + DIRENT_CHUNK_SIZE);
+
+        long n = syscall(SYS_getdents64, dir_fd, buffer->data + used, DIRENT_CHUNK_SIZE);
+        if (n <= 0) {
+            int saved_errno = errno;
+            g_byte_array_set_size(buffer, used);
+            errno = saved_errno;
+            return n == 0 ? buffer : NULL;
+        }
+
+        g_byte_array_set_size(buffer, used + (guint) n);
+    }
+}
+
+static gint compare_inodes(gconstpointer a, gconstpointer b, gpointer user_data) {
+    const guint8* data = user_data;
+    guint64 inode_a = ((const struct linux_dirent64*) (data + *(const guint*) a))->d_ino;
+    guint64 inode_b = ((const struct linux_dirent64*) (data + *(const guint*) b))->d_ino;
+    return inode_a < inode_b ? -1 : (inode_a > inode_b ? 1 : 0);
+}
+
+/* Offsets of the entries in buffer, ordered by inode number. On most file systems, this is the order of
+ * the inodes on disk, so that a rotational disk doesn't seek back and forth to examine the entries. */
+static GArray* sort_entries(GByteArray* buffer) {
+    GArray* offsets = g_array_new(FALSE, FALSE, sizeof(guint));
+    for (guint offset = 0; offset < buffer->len;) {
+        g_array_append_val(offsets, offset);
+        offset += ((const struct linux_dirent64*) (buffer->data + offset))->d_reclen;
+    }
+    g_array_sort_with_data(offsets, compare_inodes, buffer->data);
+    return offsets;
+}
+
+static void report_error(struct walk* walk, int errnum) {
+    if (walk->callbacks->error != NULL) {
+        walk->callbacks->error(walk->path->str, errnum, walk->user_data);
+    }
+}
+
+static void free_data(struct walk* walk, gpointer data) {
+    if (walk->callbacks->free_data != NULL) {
+        walk->callbacks->free_data(data);
+    }
+}
+
+static void walk_directory(struct walk* walk, int dir_fd, int depth, gpointer dir_data);
+
+// the path of the walk is that of the subdirectory
+static void enter_subdirectory(struct walk* walk, int dir_fd, const char* name, int depth, gpointer dir_data) {
+    gpointer child_data = NULL;
+    if (!walk->callbacks->enter_directory(walk->path->str, name, depth + 1, dir_data, &child_data,
+                                          walk->user_data)) {
+        return;
+    }
+
+    int child_fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (child_fd < 0) {
+        report_error(walk, errno);
+    } else {
+        walk_directory(walk, child_fd, depth + 1, child_data);
+        close(child_fd);
+    }
+    free_data(walk, child_data);
+}
+
+static void walk_directory(struct walk* walk, int dir_fd, int depth, gpointer dir_data) {
+    gsize dir_length = walk->path->len;
+
+    // the directory is only looked up and recorded if someone is interested
+    struct stat dir_st;
+    gboolean track = (walk->callbacks->lookup_directory != NULL || walk->callbacks->leave_directory != NULL)
+                     && stat_entry(dir_fd, "", AT_EMPTY_PATH, &dir_st) == 0;
+    gchar** known_subdirs = NULL;
+    gboolean unchanged = track && walk->callbacks->lookup_directory != NULL
+                         && walk->callbacks->lookup_directory(walk->path->str, &dir_st, &known_subdirs,
+                                                              walk->user_data);
+
+    GByteArray* buffer = NULL;
+    if (!unchanged) {
+        buffer = read_entries(walk, dir_fd, depth);
+        if (buffer == NULL) {
+            report_error(walk, errno);
+            return;
+        }
+    }
+
+    gsize base_length = walk->path->len;
+    if (base_length == 0 || walk->path->str[base_length - 1] != G_DIR_SEPARATOR) {
+        g_string_append_c(walk->path, G_DIR_SEPARATOR);
+        base_length++;
+    }
+
+    if (unchanged) {
+        for (gchar** name = known_subdirs; *name != NULL; name++) {
+            g_string_truncate(walk->path, base_length);
+            g_string_append(walk->path, *name);
+            enter_subdirectory(walk, dir_fd, *name, depth, dir_data);
+        }
+        g_strfreev(known_subdirs);
+        g_string_truncate(walk->path, dir_length);
+        return;
+    }
+
+    GPtrArray* subdirs = track ? g_ptr_array_new_with_free_func(g_free) : NULL;
+    GArray* offsets = sort_entries(buffer);
+
+    for (guint i = 0; i < offsets->len; i++) {
+        const struct linux_dirent64* entry =
+            (const struct linux_dirent64*) (buffer->data + g_array_index(offsets, guint, i));
+
+        const char* name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+
+        g_string_truncate(walk->path, base_length);
+        g_string_append(walk->path, name);
+
+        struct stat st;
+        gboolean have_stat = FALSE;
+        unsigned char type = entry->d_type;
+
+        // not all file systems report the type of the entries
+        if (type == DT_UNKNOWN) {
+            if (stat_entry(dir_fd, name, AT_SYMLINK_NOFOLLOW, &st) != 0) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISLNK(st.st_mode) ? DT_LNK : DT_REG);
+            have_stat = type == DT_REG;
+        }
+
+        if (type == DT_DIR) {
+            if (subdirs != NULL) {
+                g_ptr_array_add(subdirs, g_strdup(name));
+            }
+            enter_subdirectory(walk, dir_fd, name, depth, dir_data);
+        } else if (type == DT_REG || type == DT_LNK) {
+            if (!have_stat && stat_entry(dir_fd, name, 0, &st) != 0) {
+                continue;
+            }
+            if (S_ISREG(st.st_mode)) {
+                walk->callbacks->file(walk->path->str, &st, dir_data, walk->user_data);
+            }
+        }
+    }
+
+    g_string_truncate(walk->path, dir_length);
+    g_array_unref(offsets);
+
+    if (subdirs != NULL) {
+        if (walk->callbacks->leave_directory != NULL) {
+            walk->callbacks->leave_directory(walk->path->str, &dir_st, subdirs, walk->user_data);
+        }
+        g_ptr_array_unref(subdirs);
+    }
+}
+
+void scanner_walk(const char* root, const scanner_callbacks_t* callbacks, gpointer root_parent_data, void* user_data) {
+    struct walk walk;
+    walk.callbacks = callbacks;
+    walk.user_data = user_data;
+    walk.path = g_string_new(root);
+    walk.buffers = g_ptr_array_new_with_free_func((GDestroyNotify) g_byte_array_unref);
+
+    gchar* name = g_path_get_basename(root);
+    gpointer data = NULL;
+    if (callbacks->enter_directory(root, name, 0, root_parent_data, &data, user_data)) {
+        int fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            walk_directory(&walk, fd, 0, data);
+            close(fd);
+        } else {
+            report_error(&walk, errno);
+        }
+        free_data(&walk, data);
+    }
+    g_free(name);
+
+    g_ptr_array_unref(walk.buffers);
+    g_string_free(walk.path, TRUE);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <glib.h>
+
+/* Walks a directory tree using file descriptors relative to the parent directory.
+ *
+ * Entries are read with getdents64() and examined with statx() (or fstatat() on
+ * older systems), so no path needs to be resolved by the kernel from the root
+ * again. The entries of a directory are examined in the order of their inode
+ * numbers. The paths passed to the callbacks are assembled in a single buffer
+ * which is reused for the whole walk; they are only valid during the callback.
+ * There is no limit to the length of the paths or the depth of the tree other
+ * than the number of file descriptors (one per level). */
+
+typedef struct {
+    /* Called for every directory, including the root (depth 0), before its contents are read.
+     * Return FALSE to skip the directory. *data is passed to the callbacks for its contents,
+     * parent_data is the data of the parent directory. Symlinks to directories are not followed. */
+    gboolean (*enter_directory)(const char* path, const char* name, int depth, gpointer parent_data,
+                                gpointer* data, void* user_data);
+
+    // called for every regular file (symlinks are followed), dir_data is the data of its directory
+    void (*file)(const char* path, const struct stat* st, gpointer dir_data, void* user_data);
+
+    // called if a directory cannot be read, may be NULL
+    void (*error)(const char* path, int errnum, void* user_data);
+
+    /* Called for every directory which was entered, before it is read, may be NULL. Return TRUE if the
+     * directory is known to be unchanged, and set *subdirs to the names of its subdirectories; the
+     * directory is not read then, only the subdirectories are entered. *subdirs is freed by the walk. */
+    gboolean (*lookup_directory)(const char* path, const struct stat* st, gchar*** subdirs, void* user_data);
+
+    /* Called for every directory which was read, once its files have been handled, may be NULL.
+     * subdirs holds the names of all its subdirectories, including those which were skipped. */
+    void (*leave_directory)(const char* path, const struct stat* st, GPtrArray* subdirs, void* user_data);
+
+    // frees the data set by enter_directory once the directory and everything below it are walked, may be NULL
+    GDestroyNotify free_data;
+} scanner_callbacks_t;
+
+void scanner_walk(const char* root, const scanner_callbacks_t* callbacks, gpointer root_parent_data, void* user_data);
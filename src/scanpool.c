@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <pthread.h>
+
+#include <glib.h>
+
+#include "logger.h"
+#include "scanpool.h"
+
+struct scan_task {
+    gchar* path;
+    // passed to func, which takes ownership
+    gpointer data;
+    gint64 started;
+    // the timeout expired and the thread was replaced
+    gboolean stuck;
+};
+
+struct scanpool {
+    gchar* name;
+    guint max_threads;
+    gint64 timeout;
+    scanpool_func_t func;
+    void* user_data;
+
+    GThreadPool* threads;
+    GMutex mutex;
+    // signalled when a task is started
+    GCond cond;
+    // struct scan_task of the tasks which are running
+    GList* running;
+    guint n_stuck;
+};
+
+static void scan_task_free(struct scan_task* task) {
+    g_free(task->path);
+    g_free(task);
+}
+
+// must be called with the mutex held
+static void update_max_threads_locked(scanpool_t* pool) {
+    g_thread_pool_set_max_threads(pool->threads, (gint) (pool->max_threads + MIN(pool->n_stuck, pool->max_threads)),
+                                  NULL);
+}
+
+static void run_task(gpointer data, gpointer user_data) {
+    scanpool_t* pool = user_data;
+    struct scan_task* task = data;
+
+    g_mutex_lock(&pool->mutex);
+    task->started = g_get_monotonic_time();
+    pool->running = g_list_prepend(pool->running, task);
+    g_cond_signal(&pool->cond);
+    g_mutex_unlock(&pool->mutex);
+
+    pool->func(task->path, task->data, pool->user_data);
+
+    g_mutex_lock(&pool->mutex);
+    pool->running = g_list_remove(pool->running, task);
+    if (task->stuck) {
+        logger_print(LOGGER_LEVEL_INFO, "Scanning %s on %s file system finished after %" G_GINT64_FORMAT " seconds",
+                     task->path, pool->name, (g_get_monotonic_time() - task->started) / G_USEC_PER_SEC);
+        pool->n_stuck--;
+        update_max_threads_locked(pool);
+    }
+    g_mutex_unlock(&pool->mutex);
+
+    scan_task_free(task);
+}
+
+// reports the tasks which take longer than the timeout, and lets the pool start further threads instead
+static void* watchdog_main(void* arguments) {
+    scanpool_t* pool = arguments;
+
+    g_mutex_lock(&pool->mutex);
+    while (TRUE) {
+        gint64 now = g_get_monotonic_time();
+        gint64 next_deadline = G_MAXINT64;
+
+        for (GList* link = pool->running; link != NULL; link = link->next) {
+            struct scan_task* task = link->data;
+            if (task->stuck) {
+                continue;
+            }
+
+            gint64 deadline = task->started + pool->timeout;
+            if (deadline <= now) {
+                task->stuck = TRUE;
+                pool->n_stuck++;
+                update_max_threads_locked(pool);
+                logger_print(LOGGER_LEVEL_WARNING,
+                             "Scanning %s on %s file system takes longer than %" G_GINT64_FORMAT
+                             " seconds, continuing with other directories",
+                             task->path, pool->name, pool->timeout / G_USEC_PER_SEC);
+            } else {
+                next_deadline = MIN(next_deadline, deadline);
+            }
+        }
+
+        if (next_deadline == G_MAXINT64) {
+            g_cond_wait(&pool->cond, &pool->mutex);
+        } else {
+            g_cond_wait_until(&pool->cond, &pool->mutex, next_deadline);
+        }
+    }
+
+    return NULL;
+}
+
+scanpool_t* scanpool_new(const char* name, guint max_threads, gint64 timeout, scanpool_func_t func, void* user_data) {
+    scanpool_t* pool = g_new0(scanpool_t, 1);
+    pool->name = g_strdup(name);
+    pool->max_threads = MAX(max_threads, 1);
+    pool->timeout = timeout;
+    pool->func = func;
+    pool->user_data = user_data;
+    g_mutex_init(&pool->mutex);
+    g_cond_init(&pool->cond);
+
+    GError* error = NULL;
+    pool->threads = g_thread_pool_new(run_task, pool, (gint) pool->max_threads, FALSE, &error);
+    if (pool->threads == NULL) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to create %s scan threads: %s", name, error->message);
+        g_error_free(error);
+        g_free(pool->name);
+        g_free(pool);
+        return NULL;
+    }
+
+    if (timeout > 0) {
+        pthread_t watchdog;
+        if (pthread_create(&watchdog, NULL, watchdog_main, pool) != 0) {
+            logger_print(LOGGER_LEVEL_ERROR, "Failed to create %s scan watchdog thread", name);
+            g_thread_pool_free(pool->threads, TRUE, FALSE);
+            g_free(pool->name);
+            g_free(pool);
+            return NULL;
+        }
+        pthread_detach(watchdog);
+    }
+
+    return pool;
+}
+
+void scanpool_push(scanpool_t* pool, const char* path) {
+    scanpool_push_with_data(pool, path, NULL);
+}
+
+void scanpool_push_with_data(scanpool_t* pool, const char* path, gpointer data) {
+    struct scan_task* task = g_new0(struct scan_task, 1);
+    task->path = g_strdup(path);
+    task->data = data;
+    g_thread_pool_push(pool->threads, task, NULL);
+}
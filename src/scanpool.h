@@ -0,0 +1,26 @@
+#pragma once
+
+#include <glib.h>
+
+/* Bounded pool of threads which scan directories on one class of file systems.
+ *
+ * Scans of slow or remote file systems run on pools of their own, so that a hung
+ * NFS server or FUSE daemon only ever holds up the scans of its class. A scan which
+ * takes longer than the pool's timeout can't be cancelled, as the thread is usually
+ * stuck in a system call, but it is reported and its thread is replaced (up to as
+ * many times as the pool has threads), so that the other directories in the queue
+ * are scanned in the meantime. */
+
+typedef struct scanpool scanpool_t;
+
+// data is what was pushed along with path, if anything, and is owned by the function
+typedef void (*scanpool_func_t)(const char* path, gpointer data, void* user_data);
+
+/* func is called for every path pushed, by at most max_threads threads at once.
+ * timeout is in microseconds, 0 disables it. */
+scanpool_t* scanpool_new(const char* name, guint max_threads, gint64 timeout, scanpool_func_t func, void* user_data);
+
+void scanpool_push(scanpool_t* pool, const char* path);
+
+// like scanpool_push(), with data for func, e.g., to tell what to do with path
+void scanpool_push_with_data(scanpool_t* pool, const char* path, gpointer data);
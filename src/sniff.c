@@ -0,0 +1,55 @@
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "sniff.h"
+
+// AppImages are ELF files, their type is stored as "AI" followed by the type number at offset 8
+#define ELF_MAGIC "\x7f" "ELF"
+#define APPIMAGE_MAGIC_OFFSET 8
+#define APPIMAGE_MAGIC "AI"
+
+// type 1 AppImages which predate the magic bytes are detected by their ISO 9660 primary volume descriptor
+#define ISO9660_MAGIC_OFFSET 32769
+#define ISO9660_MAGIC "CD001"
+
+static guint64 accepted_count = 0;
+static guint64 rejected_count = 0;
+
+static gint get_type(int fd) {
+    unsigned char header[16];
+    if (pread(fd, header, sizeof(header), 0) != sizeof(header)) {
+        return -1;
+    }
+
+    if (memcmp(header, ELF_MAGIC, strlen(ELF_MAGIC)) != 0) {
+        return -1;
+    }
+
+    if (memcmp(header + APPIMAGE_MAGIC_OFFSET, APPIMAGE_MAGIC, strlen(APPIMAGE_MAGIC)) == 0) {
+        unsigned char type = header[APPIMAGE_MAGIC_OFFSET + strlen(APPIMAGE_MAGIC)];
+        return type == 1 || type == 2 ? type : -1;
+    }
+
+    // only plain ELF binaries need a second read
+    char iso9660_magic[sizeof(ISO9660_MAGIC) - 1];
+    if (pread(fd, iso9660_magic, sizeof(iso9660_magic), ISO9660_MAGIC_OFFSET) != sizeof(iso9660_magic)) {
+        return -1;
+    }
+
+    return memcmp(iso9660_magic, ISO9660_MAGIC, sizeof(iso9660_magic)) == 0 ? 1 : -1;
+}
+
+gint sniff_get_appimage_type(int fd) {
+    gint type = get_type(fd);
+
+    __atomic_fetch_add(type != -1 ? &accepted_count : &rejected_count, 1, __ATOMIC_RELAXED);
+
+    return type;
+}
+
+void sniff_get_counters(guint64* accepted, guint64* rejected) {
+    *accepted = __atomic_load_n(&accepted_count, __ATOMIC_RELAXED);
+    *rejected = __atomic_load_n(&rejected_count, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <glib.h>
+
+/* Cheap check which looks at the first bytes of a file and tells whether it is
+ * an AppImage, and of which type. It applies the same rules as appimage_get_type()
+ * (the magic bytes, or an ISO 9660 image for type 1 AppImages which predate them),
+ * but reads through a file descriptor which is open already. */
+
+// the AppImage type of the file open as fd, -1 if it is not an AppImage
+gint sniff_get_appimage_type(int fd);
+
+// number of files accepted and rejected by sniff_get_appimage_type() so far
+void sniff_get_counters(guint64* accepted, guint64* rejected);
@@ -0,0 +1,249 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "logger.h"
+#include "stats.h"
+
+#define SUB_BUCKET_BITS 3
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+// values below SUB_BUCKETS get a bucket each, every power of two above is split into SUB_BUCKETS buckets
+#define N_BUCKETS ((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+#define MAX_GAUGES 8
+
+struct histogram {
+    guint64 counts[N_BUCKETS];
+    guint64 count;
+    guint64 sum;
+    guint64 max;
+};
+
+struct gauge {
+    const char* name;
+    stats_gauge_func_t func;
+    void* user_data;
+};
+
+static const char* const stage_names[STATS_N_STAGES] = {
+    "events", "queue_wait", "sniff", "lookup", "preliminary", "register", "transform", "refresh",
+};
+
+static const char* const counter_names[STATS_N_COUNTERS] = {
+    "events", "overflows", "jobs",
+};
+
+static struct histogram histograms[STATS_N_STAGES];
+static guint64 counters[STATS_N_COUNTERS];
+
+static struct gauge gauges[MAX_GAUGES];
+static guint n_gauges = 0;
+
+static gint64 start_time = 0;
+// state of the previous stats_format_json() call
+static gint64 last_json_time = 0;
+static guint64 last_json_events = 0;
+
+static guint bucket_index(guint64 value) {
+    if (value < SUB_BUCKETS) {
+        return (guint) value;
+    }
+
+    guint exponent = 63 - __builtin_clzll(value);
+    guint sub_bucket = (guint) (value >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub_bucket;
+}
+
+// smallest value in the bucket
+static guint64 bucket_lower_bound(guint index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+
+    guint exponent = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    guint sub_bucket = index % SUB_BUCKETS;
+    return ((guint64) (SUB_BUCKETS + sub_bucket)) << (exponent - SUB_BUCKET_BITS);
+}
+
+// largest value in the bucket
+static guint64 bucket_upper_bound(guint index) {
+    return index + 1 < N_BUCKETS ? bucket_lower_bound(index + 1) - 1 : G_MAXUINT64;
+}
+
+static void ensure_started() {
+    gint64 expected = 0;
+    __atomic_compare_exchange_n(&start_time, &expected, g_get_monotonic_time(), FALSE,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+void stats_record(stats_stage_t stage, gint64 duration_usec) {
+    struct histogram* histogram = &histograms[stage];
+    guint64 value = duration_usec > 0 ? (guint64) duration_usec : 0;
+
+    ensure_started();
+    __atomic_fetch_add(&histogram->counts[bucket_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+
+    guint64 max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while (value > max && !__atomic_compare_exchange_n(&histogram->max, &max, value, TRUE,
+                                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+gint64 stats_record_since(stats_stage_t stage, gint64 start) {
+    gint64 now = g_get_monotonic_time();
+    stats_record(stage, now - start);
+    return now;
+}
+
+void stats_count(stats_counter_t counter, guint64 n) {
+    ensure_started();
+    __atomic_fetch_add(&counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void stats_add_gauge(const char* name, stats_gauge_func_t func, void* user_data) {
+    g_return_if_fail(n_gauges < MAX_GAUGES);
+
+    gauges[n_gauges].name = name;
+    gauges[n_gauges].func = func;
+    gauges[n_gauges].user_data = user_data;
+    n_gauges++;
+}
+
+struct summary {
+    guint64 count;
+    guint64 mean;
+    guint64 p50;
+    guint64 p90;
+    guint64 p99;
+    guint64 p999;
+    guint64 max;
+};
+
+// the histogram keeps changing while it is read, so the summary is only approximately consistent
+static void summarize(const struct histogram* histogram, struct summary* summary) {
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    guint64* results[] = {&summary->p50, &summary->p90, &summary->p99, &summary->p999};
+
+    guint64 counts[N_BUCKETS];
+    guint64 total = 0;
+    for (guint i = 0; i < N_BUCKETS; i++) {
+        counts[i] = __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+        total += counts[i];
+    }
+
+    memset(summary, 0, sizeof(*summary));
+    summary->count = total;
+    summary->max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    if (total == 0) {
+        return;
+    }
+    summary->mean = __atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) / MAX(__atomic_load_n(&histogram->count, __ATOMIC_RELAXED), 1);
+
+    guint64 seen = 0;
+    gsize next = 0;
+    for (guint i = 0; i < N_BUCKETS && next < G_N_ELEMENTS(quantiles); i++) {
+        seen += counts[i];
+        while (next < G_N_ELEMENTS(quantiles) && seen >= (guint64) (quantiles[next] * total + 0.5) && seen > 0) {
+            *results[next] = MIN(bucket_upper_bound(i), summary->max);
+            next++;
+        }
+    }
+}
+
+static gint64 get_uptime() {
+    gint64 start = __atomic_load_n(&start_time, __ATOMIC_RELAXED);
+    return start != 0 ? g_get_monotonic_time() - start : 0;
+}
+
+GString* stats_format_text(void) {
+    GString* text = g_string_new(NULL);
+    gint64 uptime = get_uptime();
+
+    g_string_append_printf(text, "Statistics after %" G_GINT64_FORMAT " seconds:\n", uptime / G_USEC_PER_SEC);
+    for (guint i = 0; i < STATS_N_COUNTERS; i++) {
+        g_string_append_printf(text, "  %-12s %" G_GUINT64_FORMAT "\n", counter_names[i],
+                               __atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+    }
+    for (guint i = 0; i < n_gauges; i++) {
+        g_string_append_printf(text, "  %-12s %" G_GUINT64_FORMAT "\n", gauges[i].name,
+                               gauges[i].func(gauges[i].user_data));
+    }
+
+    g_string_append_printf(text, "  %-12s %10s %10s %10s %10s %10s %10s %10s (microseconds)\n",
+                           "stage", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (guint i = 0; i < STATS_N_STAGES; i++) {
+        struct summary summary;
+        summarize(&histograms[i], &summary);
+        g_string_append_printf(text, "  %-12s %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT
+                                     " %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT
+                                     " %10" G_GUINT64_FORMAT "\n",
+                               stage_names[i], summary.count, summary.mean, summary.p50, summary.p90,
+                               summary.p99, summary.p999, summary.max);
+    }
+
+    return text;
+}
+
+GString* stats_format_json(void) {
+    GString* json = g_string_new("{\n");
+    gint64 now = g_get_monotonic_time();
+    guint64 events = __atomic_load_n(&counters[STATS_COUNTER_EVENTS], __ATOMIC_RELAXED);
+
+    double events_per_second = 0;
+    if (last_json_time != 0 && now > last_json_time) {
+        events_per_second = (double) (events - last_json_events) * G_USEC_PER_SEC / (double) (now - last_json_time);
+    }
+    last_json_time = now;
+    last_json_events = events;
+
+    g_string_append_printf(json, "  \"uptime_seconds\": %" G_GINT64_FORMAT ",\n", get_uptime() / G_USEC_PER_SEC);
+    g_string_append_printf(json, "  \"events_per_second\": %.2f,\n", events_per_second);
+
+    g_string_append(json, "  \"counters\": {");
+    for (guint i = 0; i < STATS_N_COUNTERS; i++) {
+        g_string_append_printf(json, "%s\"%s\": %" G_GUINT64_FORMAT, i > 0 ? ", " : "", counter_names[i],
+                               __atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+    }
+    g_string_append(json, "},\n");
+
+    g_string_append(json, "  \"gauges\": {");
+    for (guint i = 0; i < n_gauges; i++) {
+        g_string_append_printf(json, "%s\"%s\": %" G_GUINT64_FORMAT, i > 0 ? ", " : "", gauges[i].name,
+                               gauges[i].func(gauges[i].user_data));
+    }
+    g_string_append(json, "},\n");
+
+    g_string_append(json, "  \"stages_us\": {\n");
+    for (guint i = 0; i < STATS_N_STAGES; i++) {
+        struct summary summary;
+        summarize(&histograms[i], &summary);
+        g_string_append_printf(json, "    \"%s\": {\"count\": %" G_GUINT64_FORMAT ", \"mean\": %" G_GUINT64_FORMAT
+                                     ", \"p50\": %" G_GUINT64_FORMAT ", \"p90\": %" G_GUINT64_FORMAT
+                                     ", \"p99\": %" G_GUINT64_FORMAT ", \"p999\": %" G_GUINT64_FORMAT
+                                     ", \"max\": %" G_GUINT64_FORMAT "}%s\n",
+                               stage_names[i], summary.count, summary.mean, summary.p50, summary.p90,
+                               summary.p99, summary.p999, summary.max, i + 1 < STATS_N_STAGES ? "," : "");
+    }
+    g_string_append(json, "  }\n}\n");
+
+    return json;
+}
+
+gboolean stats_write_json(const char* path) {
+    GString* json = stats_format_json();
+    gchar* dirname = g_path_get_dirname(path);
+    GError* error = NULL;
+
+    g_mkdir_with_parents(dirname, 0700);
+    gboolean success = g_file_set_contents(path, json->str, json->len, &error);
+    if (!success) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to write statistics to %s: %s", path, error->message);
+        g_error_free(error);
+    }
+
+    g_free(dirname);
+    g_string_free(json, TRUE);
+    return success;
+}
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "logger.h"
+#include "transform.h"
+
+#define FIREJAIL_PROGRAM "firejail"
+#define FIREJAIL_ACTION "FirejailProfile"
+
+// programs are added to and removed from a directory by creating, renaming or deleting entries, all of which update its mtime
+struct path_dir_state {
+    gboolean exists;
+    dev_t dev;
+    ino_t ino;
+    gint64 mtime_sec;
+    glong mtime_nsec;
+};
+
+static gboolean apply_firejail(GKeyFile* desktop_entry);
+
+static const desktop_transform_t transforms[] = {
+    {"firejail", FIREJAIL_PROGRAM, apply_firejail},
+};
+
+static GMutex lookup_mutex;
+// state of the directories in $PATH at the time of the last lookup, NULL before the first lookup
+static GArray* path_dir_states = NULL;
+// transforms[i] is available if available[i] is set
+static gboolean available[G_N_ELEMENTS(transforms)];
+
+static gboolean apply_firejail(GKeyFile* desktop_entry) {
+    gchar* old_exec = g_key_file_get_value(desktop_entry, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_EXEC, NULL);
+    if (old_exec == NULL || g_str_has_prefix(old_exec, FIREJAIL_PROGRAM " ")) {
+        g_free(old_exec);
+        return FALSE;
+    }
+
+    gchar* firejail_exec = g_strdup_printf(FIREJAIL_PROGRAM " --env=DESKTOPINTEGRATION=appimaged --noprofile --appimage %s",
+                                           old_exec);
+    g_key_file_set_value(desktop_entry, G_KEY_FILE_DESKTOP_GROUP, G_KEY_FILE_DESKTOP_KEY_EXEC, firejail_exec);
+
+    const gchar* profile_group = "Desktop Action " FIREJAIL_ACTION;
+    gchar* profile_exec = g_strdup_printf(FIREJAIL_PROGRAM " --env=DESKTOPINTEGRATION=appimaged --private --appimage %s",
+                                          old_exec);
+    g_key_file_set_value(desktop_entry, profile_group, G_KEY_FILE_DESKTOP_KEY_NAME, "Run without sandbox profile");
+    g_key_file_set_value(desktop_entry, profile_group, G_KEY_FILE_DESKTOP_KEY_EXEC, profile_exec);
+    g_key_file_set_value(desktop_entry, profile_group, G_KEY_FILE_DESKTOP_KEY_TRY_EXEC, FIREJAIL_PROGRAM);
+    g_key_file_set_value(desktop_entry, G_KEY_FILE_DESKTOP_GROUP, "Actions", FIREJAIL_ACTION ";");
+
+    g_free(profile_exec);
+    g_free(firejail_exec);
+    g_free(old_exec);
+    return TRUE;
+}
+
+static GArray* get_path_dir_states() {
+    GArray* states = g_array_new(FALSE, TRUE, sizeof(struct path_dir_state));
+
+    const gchar* path = g_getenv("PATH");
+    gchar** dirs = g_strsplit(path != NULL ? path : "", G_SEARCHPATH_SEPARATOR_S, -1);
+    for (gchar** dir = dirs; *dir != NULL; dir++) {
+        struct path_dir_state state;
+        memset(&state, 0, sizeof(state));
+
+        struct stat st;
+        if (stat(**dir != '\0' ? *dir : ".", &st) == 0) {
+            state.exists = TRUE;
+            state.dev = st.st_dev;
+            state.ino = st.st_ino;
+            state.mtime_sec = st.st_mtim.tv_sec;
+            state.mtime_nsec = st.st_mtim.tv_nsec;
+        }
+        g_array_append_val(states, state);
+    }
+    g_strfreev(dirs);
+
+    return states;
+}
+
+static gboolean path_dir_states_equal(GArray* a, GArray* b) {
+    return a->len == b->len && memcmp(a->data, b->data, a->len * sizeof(struct path_dir_state)) == 0;
+}
+
+// fills in which transforms are available, looking up their programs again only if $PATH has changed
+static void get_available_transforms(gboolean* result) {
+    GArray* states = get_path_dir_states();
+
+    g_mutex_lock(&lookup_mutex);
+    if (path_dir_states == NULL || !path_dir_states_equal(path_dir_states, states)) {
+        for (gsize i = 0; i < G_N_ELEMENTS(transforms); i++) {
+            gchar* program_path = transforms[i].program != NULL ? g_find_program_in_path(transforms[i].program) : NULL;
+            available[i] = transforms[i].program == NULL || program_path != NULL;
+            logger_print(LOGGER_LEVEL_DEBUG, "Desktop entry transform %s is %s", transforms[i].name,
+                         available[i] ? "enabled" : "disabled");
+            g_free(program_path);
+        }
+
+        if (path_dir_states != NULL) {
+            g_array_unref(path_dir_states);
+        }
+        path_dir_states = states;
+        states = NULL;
+    }
+    memcpy(result, available, sizeof(available));
+    g_mutex_unlock(&lookup_mutex);
+
+    if (states != NULL) {
+        g_array_unref(states);
+    }
+}
+
+// applies the enabled transforms and returns whether the entry was changed
+static gboolean apply_enabled(GKeyFile* desktop_entry, const gboolean* enabled) {
+    gboolean changed = FALSE;
+    for (gsize i = 0; i < G_N_ELEMENTS(transforms); i++) {
+        if (enabled[i] && transforms[i].apply(desktop_entry)) {
+            changed = TRUE;
+            logger_print(LOGGER_LEVEL_DEBUG, "Applied desktop entry transform %s", transforms[i].name);
+        }
+    }
+    return changed;
+}
+
+gboolean transform_apply(GKeyFile* desktop_entry) {
+    gboolean enabled[G_N_ELEMENTS(transforms)];
+    get_available_transforms(enabled);
+    return apply_enabled(desktop_entry, enabled);
+}
+
+int transform_desktop_entry(const char* desktop_file_path) {
+    gboolean enabled[G_N_ELEMENTS(transforms)];
+    get_available_transforms(enabled);
+
+    gboolean any_enabled = FALSE;
+    for (gsize i = 0; i < G_N_ELEMENTS(transforms); i++) {
+        any_enabled |= enabled[i];
+    }
+    if (!any_enabled) {
+        return 0;
+    }
+
+    if (desktop_file_path == NULL) {
+        return 0;
+    }
+
+    int result = 0;
+    GKeyFile* desktop_entry = g_key_file_new();
+    GError* error = NULL;
+
+    if (!g_key_file_load_from_file(desktop_entry, desktop_file_path,
+                                   G_KEY_FILE_KEEP_COMMENTS | G_KEY_FILE_KEEP_TRANSLATIONS, &error)) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to load the deployed desktop entry %s: %s", desktop_file_path,
+                     error->message);
+        g_error_free(error);
+        result = 1;
+    } else if (apply_enabled(desktop_entry, enabled)
+               && !g_key_file_save_to_file(desktop_entry, desktop_file_path, &error)) {
+        // g_key_file_save_to_file() replaces the file atomically, so a failure leaves the original entry in place
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to save the deployed desktop entry %s: %s", desktop_file_path,
+                     error->message);
+        g_error_free(error);
+        result = 1;
+    }
+
+    g_key_file_unref(desktop_entry);
+    return result;
+}
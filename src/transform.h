@@ -0,0 +1,26 @@
+#pragma once
+
+#include <glib.h>
+
+/* Transforms applied to the desktop entry libappimage deploys for an AppImage,
+ * e.g., to wrap the launcher into a sandbox such as firejail.
+ *
+ * A transform is only used if the program it depends on is installed. The
+ * lookup of these programs is cached and only repeated once one of the
+ * directories in $PATH has changed. All transforms are applied to the entry in
+ * memory, which is then written back once, and only if it changed. */
+
+typedef struct {
+    const char* name;
+    // program which needs to be in $PATH for the transform to be applied, NULL if none
+    const char* program;
+    // returns whether the entry was changed
+    gboolean (*apply)(GKeyFile* desktop_entry);
+} desktop_transform_t;
+
+// apply the available transforms to desktop_entry in memory, returns whether it was changed
+gboolean transform_apply(GKeyFile* desktop_entry);
+
+/* Apply the available transforms to the deployed desktop entry at desktop_file_path (may be NULL).
+ * Returns 0 on success or if there was nothing to do, non-zero if the entry couldn't be read or written. */
+int transform_desktop_entry(const char* desktop_file_path);
@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "logger.h"
+#include "watcher.h"
+
+// large enough for hundreds of events per read(), which saves a syscall per event during bursts
+#define WATCHER_BUFFER_SIZE (64 * 1024)
+
+#define MAX_USER_WATCHES_PATH "/proc/sys/fs/inotify/max_user_watches"
+
+struct watch_node {
+    int wd;
+    // full path for roots, the name of the directory otherwise
+    char* name;
+    struct watch_node* parent;
+    // name -> struct watch_node, created on demand
+    GHashTable* children;
+    dev_t dev;
+    ino_t ino;
+};
+
+struct watcher {
+    GRecMutex lock;
+    int fd;
+    // wd -> struct watch_node
+    GHashTable* nodes;
+    GString* path;
+    gboolean limit_reported;
+    char buffer[WATCHER_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+};
+
+static void detach_node(struct watch_node* node) {
+    if (node->parent != NULL && node->parent->children != NULL) {
+        g_hash_table_remove(node->parent->children, node->name);
+    }
+    node->parent = NULL;
+}
+
+static void attach_node(struct watch_node* node, struct watch_node* parent) {
+    node->parent = parent;
+    if (parent != NULL) {
+        if (parent->children == NULL) {
+            parent->children = g_hash_table_new(g_str_hash, g_str_equal);
+        }
+        g_hash_table_replace(parent->children, node->name, node);
+    }
+}
+
+static void append_node_path(GString* path, const struct watch_node* node) {
+    if (node->parent != NULL) {
+        append_node_path(path, node->parent);
+        g_string_append_c(path, G_DIR_SEPARATOR);
+    }
+    g_string_append(path, node->name);
+}
+
+static void report_watch_limit(watcher_t* watcher) {
+    if (watcher->limit_reported) {
+        return;
+    }
+    watcher->limit_reported = TRUE;
+
+    gchar* limit = NULL;
+    if (g_file_get_contents(MAX_USER_WATCHES_PATH, &limit, NULL, NULL)) {
+        g_strstrip(limit);
+    }
+    logger_print(LOGGER_LEVEL_WARNING, "Warning: reached the limit of inotify watches (%s = %s), "
+                                       "new directories will not be watched",
+                 MAX_USER_WATCHES_PATH, limit != NULL ? limit : "?");
+    g_free(limit);
+}
+
+// forget the node and everything below it and remove their inotify watches
+static void remove_subtree(watcher_t* watcher, struct watch_node* node) {
+    if (node->children != NULL) {
+        GList* children = g_hash_table_get_values(node->children);
+        for (GList* child = children; child != NULL; child = child->next) {
+            remove_subtree(watcher, child->data);
+        }
+        g_list_free(children);
+        g_hash_table_destroy(node->children);
+    }
+
+    // fails harmlessly if the kernel has removed the watch already
+    inotify_rm_watch(watcher->fd, node->wd);
+    g_hash_table_remove(watcher->nodes, GINT_TO_POINTER(node->wd));
+    g_free(node->name);
+    g_free(node);
+}
+
+watcher_t* watcher_new(void) {
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    watcher_t* watcher = g_new0(watcher_t, 1);
+    g_rec_mutex_init(&watcher->lock);
+    watcher->fd = fd;
+    watcher->nodes = g_hash_table_new(g_direct_hash, g_direct_equal);
+    watcher->path = g_string_sized_new(PATH_MAX);
+    return watcher;
+}
+
+int watcher_get_fd(watcher_t* watcher) {
+    return watcher->fd;
+}
+
+void watcher_lock(watcher_t* watcher) {
+    g_rec_mutex_lock(&watcher->lock);
+}
+
+void watcher_unlock(watcher_t* watcher) {
+    g_rec_mutex_unlock(&watcher->lock);
+}
+
+int watcher_add(watcher_t* watcher, int parent_wd, const char* path, guint32 mask) {
+    // inotify_add_watch() and stat() can block for a long time on network mounts, so the lock isn't held meanwhile
+    int wd = inotify_add_watch(watcher->fd, path, mask);
+    if (wd < 0) {
+        if (errno == ENOSPC) {
+            watcher_lock(watcher);
+            report_watch_limit(watcher);
+            watcher_unlock(watcher);
+        }
+        return -1;
+    }
+
+    struct stat st;
+    gboolean have_st = stat(path, &st) == 0;
+
+    watcher_lock(watcher);
+
+    // the directory is watched already, e.g., because it is reachable through two roots
+    if (g_hash_table_contains(watcher->nodes, GINT_TO_POINTER(wd))) {
+        watcher_unlock(watcher);
+        return wd;
+    }
+
+    struct watch_node* parent = NULL;
+    if (parent_wd >= 0) {
+        parent = g_hash_table_lookup(watcher->nodes, GINT_TO_POINTER(parent_wd));
+        // the parent was removed in the meantime, and the directory with it
+        if (parent == NULL) {
+            inotify_rm_watch(watcher->fd, wd);
+            watcher_unlock(watcher);
+            errno = ENOENT;
+            return -1;
+        }
+    }
+
+    struct watch_node* node = g_new0(struct watch_node, 1);
+    node->wd = wd;
+    node->name = parent != NULL ? g_path_get_basename(path) : g_strdup(path);
+    if (have_st) {
+        node->dev = st.st_dev;
+        node->ino = st.st_ino;
+    }
+
+    attach_node(node, parent);
+    g_hash_table_insert(watcher->nodes, GINT_TO_POINTER(wd), node);
+
+    watcher_unlock(watcher);
+    return wd;
+}
+
+int watcher_find_child(watcher_t* watcher, int parent_wd, const char* name) {
+    struct watch_node* parent = g_hash_table_lookup(watcher->nodes, GINT_TO_POINTER(parent_wd));
+    if (parent == NULL || parent->children == NULL) {
+        return -1;
+    }
+
+    struct watch_node* child = g_hash_table_lookup(parent->children, name);
+    return child != NULL ? child->wd : -1;
+}
+
+const char* watcher_resolve(watcher_t* watcher, int wd, const char* name) {
+    struct watch_node* node = g_hash_table_lookup(watcher->nodes, GINT_TO_POINTER(wd));
+    if (node == NULL) {
+        return NULL;
+    }
+
+    g_string_truncate(watcher->path, 0);
+    append_node_path(watcher->path, node);
+    if (name != NULL) {
+        g_string_append_c(watcher->path, G_DIR_SEPARATOR);
+        g_string_append(watcher->path, name);
+    }
+
+    return watcher->path->str;
+}
+
+void watcher_move(watcher_t* watcher, int wd, int new_parent_wd, const char* new_name) {
+    struct watch_node* node = g_hash_table_lookup(watcher->nodes, GINT_TO_POINTER(wd));
+    struct watch_node* new_parent = g_hash_table_lookup(watcher->nodes, GINT_TO_POINTER(new_parent_wd));
+    if (node == NULL || new_parent == NULL) {
+        return;
+    }
+
+    detach_node(node);
+    g_free(node->name);
+    node->name = g_strdup(new_name);
+    attach_node(node, new_parent);
+}
+
+gboolean watcher_is_intact(watcher_t* watcher, int wd) {
+    struct watch_node* node = g_hash_table_lookup(watcher->nodes, GINT_TO_POINTER(wd));
+    if (node == NULL) {
+        return FALSE;
+    }
+
+    struct stat st;
+    return stat(watcher_resolve(watcher, wd, NULL), &st) == 0 && st.st_dev == node->dev && st.st_ino == node->ino;
+}
+
+void watcher_remove_tree(watcher_t* watcher, int wd) {
+    struct watch_node* node = g_hash_table_lookup(watcher->nodes, GINT_TO_POINTER(wd));
+    if (node == NULL) {
+        return;
+    }
+
+    detach_node(node);
+    remove_subtree(watcher, node);
+}
+
+guint watcher_get_n_watches(watcher_t* watcher) {
+    return g_hash_table_size(watcher->nodes);
+}
+
+void watcher_foreach(watcher_t* watcher, watcher_path_func_t func, void* user_data) {
+    // the callback may add watches and resolve paths, so iterate over copies
+    GPtrArray* wds = g_ptr_array_new();
+    GPtrArray* paths = g_ptr_array_new_with_free_func(g_free);
+
+    GHashTableIter iter;
+    gpointer key;
+    g_hash_table_iter_init(&iter, watcher->nodes);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        g_ptr_array_add(wds, key);
+        g_ptr_array_add(paths, g_strdup(watcher_resolve(watcher, GPOINTER_TO_INT(key), NULL)));
+    }
+
+    for (guint i = 0; i < paths->len; i++) {
+        func(GPOINTER_TO_INT(g_ptr_array_index(wds, i)), g_ptr_array_index(paths, i), user_data);
+    }
+    g_ptr_array_unref(paths);
+    g_ptr_array_unref(wds);
+}
+
+gboolean watcher_dispatch(watcher_t* watcher, watcher_event_handler_t handler, void* user_data) {
+    while (TRUE) {
+        ssize_t length = read(watcher->fd, watcher->buffer, sizeof(watcher->buffer));
+
+        if (length < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN;
+        }
+
+        if (length == 0) {
+            return FALSE;
+        }
+
+        watcher_lock(watcher);
+        for (char* ptr = watcher->buffer; ptr < watcher->buffer + length;) {
+            const struct inotify_event* event = (const struct inotify_event*) ptr;
+
+            handler(event, user_data);
+
+            if (event->mask & IN_IGNORED) {
+                watcher_remove_tree(watcher, event->wd);
+            }
+
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+        watcher_unlock(watcher);
+    }
+}
+
+void watcher_free(watcher_t* watcher) {
+    if (watcher == NULL) {
+        return;
+    }
+
+    GList* nodes = g_hash_table_get_values(watcher->nodes);
+    for (GList* node = nodes; node != NULL; node = node->next) {
+        struct watch_node* watch_node = node->data;
+        g_free(watch_node->name);
+        if (watch_node->children != NULL) {
+            g_hash_table_destroy(watch_node->children);
+        }
+        g_free(watch_node);
+    }
+    g_list_free(nodes);
+
+    close(watcher->fd);
+    g_rec_mutex_clear(&watcher->lock);
+    g_hash_table_destroy(watcher->nodes);
+    g_string_free(watcher->path, TRUE);
+    g_free(watcher);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <sys/inotify.h>
+
+#include <glib.h>
+
+/* Owns the inotify instance and the tree of watched directories.
+ *
+ * Every watch is a node in a tree which mirrors the directory hierarchy: a node
+ * only stores its own name and a link to its parent, so the prefix shared by all
+ * directories below a root is stored once, and a directory that is renamed within
+ * the tree only needs its node to be moved. Paths are assembled on demand into a
+ * buffer owned by the watcher, which is why the event handlers don't allocate.
+ *
+ * The file descriptor is non-blocking and meant to be polled by the main loop,
+ * which then calls watcher_dispatch() to read all queued events in batches.
+ * Other threads (i.e., the initial scan) must hold the lock while using the
+ * watcher, except for watcher_add(), which takes it itself; the event handlers
+ * are called with the lock held. */
+
+typedef struct watcher watcher_t;
+
+typedef void (*watcher_event_handler_t)(const struct inotify_event* event, void* user_data);
+
+typedef void (*watcher_path_func_t)(int wd, const char* dir_path, void* user_data);
+
+watcher_t* watcher_new(void);
+
+int watcher_get_fd(watcher_t* watcher);
+
+// the lock is recursive
+void watcher_lock(watcher_t* watcher);
+
+void watcher_unlock(watcher_t* watcher);
+
+/* Watch the directory at path, below the directory watched by parent_wd (-1 for a root).
+ * Returns the watch descriptor, or -1 (and sets errno) on error. If the inotify watch
+ * limit is reached, a warning is printed once and ENOSPC is returned. The lock is only
+ * taken to insert the watch, so call this without holding it: adding a watch can block
+ * for a long time on a slow mount, which would hold up the event handlers. */
+int watcher_add(watcher_t* watcher, int parent_wd, const char* path, guint32 mask);
+
+// watch descriptor of the subdirectory name of the directory watched by parent_wd, or -1
+int watcher_find_child(watcher_t* watcher, int parent_wd, const char* name);
+
+/* Path of the watched directory wd, or of the entry name inside it if name is not NULL.
+ * The string is only valid until the next call, NULL is returned for unknown watches. */
+const char* watcher_resolve(watcher_t* watcher, int wd, const char* name);
+
+// the watched directory was renamed within the tree
+void watcher_move(watcher_t* watcher, int wd, int new_parent_wd, const char* new_name);
+
+// whether the path of the watched directory still refers to the directory the watch was added for
+gboolean watcher_is_intact(watcher_t* watcher, int wd);
+
+// remove the watches of the directory and all directories below it
+void watcher_remove_tree(watcher_t* watcher, int wd);
+
+guint watcher_get_n_watches(watcher_t* watcher);
+
+void watcher_foreach(watcher_t* watcher, watcher_path_func_t func, void* user_data);
+
+/* Read and handle all events currently queued. Watches removed by the kernel (IN_IGNORED)
+ * are forgotten after the event has been handled. Returns FALSE if reading failed. */
+gboolean watcher_dispatch(watcher_t* watcher, watcher_event_handler_t handler, void* user_data);
+
+void watcher_free(watcher_t* watcher);
@@ -0,0 +1,686 @@
+#include <stdio.h>
+#include <pthread.h>
+
+#include <glib.h>
+
+#include "logger.h"
+#include "priority.h"
+#include "stats.h"
+#include "workqueue.h"
+
+struct lane;
+
+struct job {
+    char* path;
+    char* old_path;
+    workqueue_job_type_t type;
+    gboolean background;
+    // run by the slow workers, regardless of background, see workqueue_start_slow_workers()
+    gboolean slow;
+    // the lane of the device the file is on if it is a sequential background job, NULL otherwise
+    struct lane* lane;
+    // where the file is on its device, sequential jobs are run in ascending order
+    guint64 position;
+    // when the job was submitted, merging with a more recent request keeps the original time
+    gint64 queued_at;
+    // batches waiting for this job, and for the jobs merged into it
+    GSList* batches;
+};
+
+// sequential background jobs for the files on one device, of which only one runs at a time
+struct lane {
+    guint64 device;
+    // sorted by position
+    GQueue jobs;
+    gboolean busy;
+    // position of the last job started, the next one continues from there
+    guint64 last_position;
+};
+
+struct workqueue_batch {
+    guint remaining;
+    GCond done;
+};
+
+struct workqueue {
+    GMutex mutex;
+    GCond not_empty;
+    GCond not_full;
+    GCond background_not_empty;
+    GCond background_not_full;
+    GCond slow_not_empty;
+    GCond idle;
+
+    GQueue jobs;
+    // run by the background workers only
+    GQueue background_jobs;
+    // run by the slow workers only, in the order they were submitted
+    GQueue slow_jobs;
+    // device -> struct lane, the lanes are kept until the queue is freed
+    GHashTable* lanes;
+    // number of jobs waiting in all lanes
+    guint n_sequential;
+    // path -> job waiting in jobs or background_jobs; rename jobs are never pending, they claim their paths in running instead
+    GHashTable* pending;
+    // path -> job deferred until the job for that path finishes (or NULL)
+    GHashTable* running;
+
+    guint capacity;
+    guint busy;
+    gboolean shutdown;
+
+    guint n_workers;
+    guint n_background_workers;
+    guint n_slow_workers;
+    pthread_t* workers;
+
+    workqueue_handler_t handler;
+    void* user_data;
+    workqueue_classifier_t is_slow;
+    void* classifier_user_data;
+};
+
+struct worker {
+    workqueue_t* queue;
+    gboolean background;
+    gboolean slow;
+};
+
+static struct job* job_new(workqueue_job_type_t type, const char* path, const char* old_path, gboolean background) {
+    struct job* job = g_new0(struct job, 1);
+    job->path = g_strdup(path);
+    job->old_path = g_strdup(old_path);
+    job->type = type;
+    job->background = background || type == WORKQUEUE_JOB_COMPLETE;
+    job->queued_at = g_get_monotonic_time();
+    return job;
+}
+
+static void job_free(struct job* job) {
+    g_free(job->path);
+    g_free(job->old_path);
+    g_free(job);
+}
+
+// the jobs merged into target are complete once target has run; must be called with the mutex held
+static void transfer_batches_locked(struct job* target, struct job* job) {
+    target->batches = g_slist_concat(target->batches, job->batches);
+    job->batches = NULL;
+}
+
+// must be called with the mutex held
+static void finish_batches_locked(struct job* job) {
+    for (GSList* item = job->batches; item != NULL; item = item->next) {
+        workqueue_batch_t* batch = item->data;
+        if (--batch->remaining == 0) {
+            g_cond_broadcast(&batch->done);
+        }
+    }
+    g_slist_free(job->batches);
+    job->batches = NULL;
+}
+
+static GQueue* get_jobs_for(workqueue_t* queue, const struct job* job) {
+    if (job->slow) {
+        return &queue->slow_jobs;
+    }
+    if (job->lane != NULL) {
+        return &job->lane->jobs;
+    }
+    return job->background ? &queue->background_jobs : &queue->jobs;
+}
+
+static gint compare_positions(gconstpointer a, gconstpointer b, gpointer user_data) {
+    guint64 position_a = ((const struct job*) a)->position;
+    guint64 position_b = ((const struct job*) b)->position;
+    return position_a < position_b ? -1 : (position_a > position_b ? 1 : 0);
+}
+
+static GCond* get_not_empty_for(workqueue_t* queue, const struct job* job) {
+    if (job->slow) {
+        return &queue->slow_not_empty;
+    }
+    return job->background ? &queue->background_not_empty : &queue->not_empty;
+}
+
+// must be called with the mutex held
+static guint get_n_queued_locked(workqueue_t* queue, gboolean background) {
+    if (!background) {
+        return g_queue_get_length(&queue->jobs);
+    }
+    return g_queue_get_length(&queue->background_jobs) + queue->n_sequential;
+}
+
+// must be called with the mutex held
+static void enqueue_locked(workqueue_t* queue, struct job* job) {
+    if (job->lane != NULL) {
+        g_queue_insert_sorted(&job->lane->jobs, job, compare_positions, NULL);
+        queue->n_sequential++;
+    } else {
+        g_queue_push_tail(get_jobs_for(queue, job), job);
+    }
+}
+
+// remove a waiting job from its queue, it runs as a parallel job from now on; must be called with the mutex held
+static void dequeue_locked(workqueue_t* queue, struct job* job) {
+    g_queue_remove(get_jobs_for(queue, job), job);
+    if (job->lane != NULL) {
+        queue->n_sequential--;
+        job->lane = NULL;
+    }
+}
+
+/* The next job of a lane which isn't busy, continuing with the position after the last job of the lane
+ * and wrapping around at the end, so that a disk is read in sweeps even while jobs are still being
+ * added; must be called with the mutex held. */
+static struct job* pop_sequential_locked(workqueue_t* queue) {
+    if (queue->n_sequential == 0) {
+        return NULL;
+    }
+
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, queue->lanes);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        struct lane* lane = value;
+        if (lane->busy || g_queue_is_empty(&lane->jobs)) {
+            continue;
+        }
+
+        GList* link = lane->jobs.head;
+        while (link != NULL && ((struct job*) link->data)->position < lane->last_position) {
+            link = link->next;
+        }
+        if (link == NULL) {
+            link = lane->jobs.head;
+        }
+
+        struct job* job = link->data;
+        g_queue_delete_link(&lane->jobs, link);
+        queue->n_sequential--;
+        lane->busy = TRUE;
+        lane->last_position = job->position;
+        return job;
+    }
+
+    return NULL;
+}
+
+// jobs waiting for the kind of worker; must be called with the mutex held
+static guint get_n_waiting_locked(workqueue_t* queue, const struct worker* worker) {
+    if (worker->slow) {
+        return g_queue_get_length(&queue->slow_jobs);
+    }
+    return get_n_queued_locked(queue, worker->background);
+}
+
+// must be called with the mutex held
+static struct job* pop_locked(workqueue_t* queue, const struct worker* worker) {
+    if (worker->slow) {
+        return g_queue_pop_head(&queue->slow_jobs);
+    }
+
+    gboolean background = worker->background;
+    if (!background) {
+        return g_queue_pop_head(&queue->jobs);
+    }
+
+    // a lane can only keep one worker busy, so the lanes go first
+    struct job* job = pop_sequential_locked(queue);
+    return job != NULL ? job : g_queue_pop_head(&queue->background_jobs);
+}
+
+static struct lane* get_lane_locked(workqueue_t* queue, guint64 device) {
+    struct lane* lane = g_hash_table_lookup(queue->lanes, &device);
+    if (lane == NULL) {
+        lane = g_new0(struct lane, 1);
+        lane->device = device;
+        g_queue_init(&lane->jobs);
+        g_hash_table_insert(queue->lanes, &lane->device, lane);
+    }
+    return lane;
+}
+
+static void submit_locked(workqueue_t* queue, struct job* job, gboolean may_block);
+
+// replace target with job, the latest request wins; must be called with the mutex held
+static void merge_into_locked(workqueue_t* queue, struct job* target, struct job* job) {
+    // the superseded rename won't happen, so the registration of its old path must be removed
+    if (target->type == WORKQUEUE_JOB_RENAME) {
+        struct job* unregister = job_new(WORKQUEUE_JOB_UNREGISTER, target->old_path, NULL, FALSE);
+        unregister->slow = target->slow;
+        submit_locked(queue, unregister, FALSE);
+    }
+
+    target->type = job->type;
+    g_free(target->old_path);
+    target->old_path = job->old_path;
+    job->old_path = NULL;
+    transfer_batches_locked(target, job);
+    job_free(job);
+}
+
+static gboolean is_busy_locked(workqueue_t* queue, const char* path) {
+    return g_hash_table_contains(queue->pending, path) || g_hash_table_contains(queue->running, path);
+}
+
+// takes ownership of job; must be called with the mutex held
+static void submit_locked(workqueue_t* queue, struct job* job, gboolean may_block) {
+    while (TRUE) {
+        if (job->type == WORKQUEUE_JOB_RENAME) {
+            // something else is going on with the old path, fall back to a full unregister and register
+            if (is_busy_locked(queue, job->old_path)) {
+                struct job* unregister = job_new(WORKQUEUE_JOB_UNREGISTER, job->old_path, NULL, job->background);
+                unregister->slow = job->slow;
+                submit_locked(queue, unregister, FALSE);
+                job->type = WORKQUEUE_JOB_REGISTER;
+                g_clear_pointer(&job->old_path, g_free);
+                continue;
+            }
+
+            // whatever was at the new path before has been replaced by the moved file
+            struct job* pending = g_hash_table_lookup(queue->pending, job->path);
+            if (pending != NULL) {
+                dequeue_locked(queue, pending);
+                g_hash_table_remove(queue->pending, job->path);
+                transfer_batches_locked(job, pending);
+                job_free(pending);
+            }
+        } else {
+            struct job* pending = g_hash_table_lookup(queue->pending, job->path);
+            if (pending != NULL) {
+                if (job->background) {
+                    // whatever is pending already does at least as much, or is more recent
+                    transfer_batches_locked(pending, job);
+                    job_free(job);
+                } else if (pending->background) {
+                    dequeue_locked(queue, pending);
+                    merge_into_locked(queue, pending, job);
+                    pending->background = FALSE;
+                    enqueue_locked(queue, pending);
+                    g_cond_signal(get_not_empty_for(queue, pending));
+                } else {
+                    merge_into_locked(queue, pending, job);
+                }
+                return;
+            }
+        }
+
+        // a worker is busy with this path: run the request once it is done
+        gpointer key;
+        gpointer deferred;
+        if (g_hash_table_lookup_extended(queue->running, job->path, &key, &deferred)) {
+            if (deferred != NULL && job->background) {
+                transfer_batches_locked(deferred, job);
+                job_free(job);
+            } else if (deferred != NULL) {
+                ((struct job*) deferred)->background = FALSE;
+                ((struct job*) deferred)->lane = NULL;
+                merge_into_locked(queue, deferred, job);
+            } else {
+                g_hash_table_insert(queue->running, key, job);
+            }
+            return;
+        }
+
+        // slow jobs never hold up whoever pushes them, e.g., the event loop for a hung server
+        if (!may_block || job->slow || get_n_queued_locked(queue, job->background) < queue->capacity
+            || queue->shutdown) {
+            break;
+        }
+
+        g_cond_wait(job->background ? &queue->background_not_full : &queue->not_full, &queue->mutex);
+    }
+
+    if (job->type == WORKQUEUE_JOB_RENAME) {
+        g_hash_table_insert(queue->running, job->path, NULL);
+        g_hash_table_insert(queue->running, job->old_path, NULL);
+    } else {
+        g_hash_table_insert(queue->pending, job->path, job);
+    }
+
+    enqueue_locked(queue, job);
+    g_cond_signal(get_not_empty_for(queue, job));
+}
+
+// stop tracking path as running and return the job deferred for it, if any; must be called with the mutex held
+static struct job* release_locked(workqueue_t* queue, const char* path) {
+    struct job* deferred = g_hash_table_lookup(queue->running, path);
+    g_hash_table_remove(queue->running, path);
+    return deferred;
+}
+
+static gboolean is_idle_locked(workqueue_t* queue) {
+    return g_queue_is_empty(&queue->jobs) && g_queue_is_empty(&queue->background_jobs) && queue->n_sequential == 0
+           && g_queue_is_empty(&queue->slow_jobs) && queue->busy == 0;
+}
+
+static void* worker_main(void* arguments) {
+    struct worker* worker = arguments;
+    workqueue_t* queue = worker->queue;
+    GCond* not_empty = worker->background ? &queue->background_not_empty : &queue->not_empty;
+    GCond* not_full = worker->background ? &queue->background_not_full : &queue->not_full;
+    if (worker->slow) {
+        not_empty = &queue->slow_not_empty;
+        // nobody waits for room for slow jobs
+        not_full = NULL;
+    }
+
+    if (worker->background) {
+        priority_lower_current_thread();
+    }
+
+    g_mutex_lock(&queue->mutex);
+    while (TRUE) {
+        // jobs in a busy lane are queued, but can't be run yet
+        struct job* job;
+        while ((job = pop_locked(queue, worker)) == NULL
+               && !(queue->shutdown && get_n_waiting_locked(queue, worker) == 0)) {
+            g_cond_wait(not_empty, &queue->mutex);
+        }
+
+        if (job == NULL) {
+            break;
+        }
+
+        struct lane* lane = job->lane;
+        if (job->type != WORKQUEUE_JOB_RENAME) {
+            g_hash_table_remove(queue->pending, job->path);
+            g_hash_table_insert(queue->running, job->path, NULL);
+        }
+        queue->busy++;
+        if (not_full != NULL) {
+            g_cond_signal(not_full);
+        }
+        g_mutex_unlock(&queue->mutex);
+
+        stats_record_since(STATS_STAGE_QUEUE_WAIT, job->queued_at);
+        stats_count(STATS_COUNTER_JOBS, 1);
+        queue->handler(job->type, job->path, job->old_path, queue->user_data);
+
+        g_mutex_lock(&queue->mutex);
+        struct job* deferred = release_locked(queue, job->path);
+        struct job* deferred_old = job->old_path != NULL ? release_locked(queue, job->old_path) : NULL;
+        queue->busy--;
+
+        // the next job of the lane may be run by any background worker
+        if (lane != NULL) {
+            lane->busy = FALSE;
+            if (!g_queue_is_empty(&lane->jobs)) {
+                g_cond_signal(not_empty);
+            } else if (queue->shutdown && get_n_queued_locked(queue, TRUE) == 0) {
+                g_cond_broadcast(not_empty);
+            }
+        }
+
+        // deferred jobs replace the one that just finished, so they do not count against the capacity
+        if (deferred_old != NULL) {
+            submit_locked(queue, deferred_old, FALSE);
+        }
+        if (deferred != NULL) {
+            submit_locked(queue, deferred, FALSE);
+        }
+
+        if (is_idle_locked(queue)) {
+            g_cond_broadcast(&queue->idle);
+        }
+
+        finish_batches_locked(job);
+        job_free(job);
+    }
+    g_mutex_unlock(&queue->mutex);
+
+    g_free(worker);
+    return NULL;
+}
+
+static gboolean start_worker(workqueue_t* queue, gboolean background, gboolean slow) {
+    struct worker* worker = g_new0(struct worker, 1);
+    worker->queue = queue;
+    worker->background = background;
+    worker->slow = slow;
+
+    guint index = queue->n_workers + queue->n_background_workers + queue->n_slow_workers;
+    if (pthread_create(&queue->workers[index], NULL, worker_main, worker) != 0) {
+        logger_print(LOGGER_LEVEL_ERROR, "Failed to create %sworker thread %u",
+                     slow ? "slow " : background ? "background " : "", index);
+        g_free(worker);
+        return FALSE;
+    }
+
+    if (slow) {
+        queue->n_slow_workers++;
+    } else if (background) {
+        queue->n_background_workers++;
+    } else {
+        queue->n_workers++;
+    }
+    return TRUE;
+}
+
+workqueue_t* workqueue_new(guint n_workers, guint n_background_workers, guint capacity,
+                           workqueue_handler_t handler, void* user_data) {
+    workqueue_t* queue = g_new0(workqueue_t, 1);
+
+    g_mutex_init(&queue->mutex);
+    g_cond_init(&queue->not_empty);
+    g_cond_init(&queue->not_full);
+    g_cond_init(&queue->background_not_empty);
+    g_cond_init(&queue->background_not_full);
+    g_cond_init(&queue->slow_not_empty);
+    g_cond_init(&queue->idle);
+    g_queue_init(&queue->jobs);
+    g_queue_init(&queue->background_jobs);
+    g_queue_init(&queue->slow_jobs);
+    queue->pending = g_hash_table_new(g_str_hash, g_str_equal);
+    queue->running = g_hash_table_new(g_str_hash, g_str_equal);
+    queue->lanes = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, g_free);
+    queue->capacity = MAX(capacity, 1);
+    queue->handler = handler;
+    queue->user_data = user_data;
+
+    if (n_workers == 0) {
+        n_workers = g_get_num_processors();
+    }
+    if (n_background_workers == 0) {
+        n_background_workers = MAX(g_get_num_processors() / 2, 1);
+    }
+
+    queue->workers = g_new0(pthread_t, n_workers + n_background_workers);
+    for (guint i = 0; i < n_workers && start_worker(queue, FALSE, FALSE); i++);
+    for (guint i = 0; i < n_background_workers && start_worker(queue, TRUE, FALSE); i++);
+
+    if (queue->n_workers == 0 || queue->n_background_workers == 0) {
+        workqueue_free(queue);
+        return NULL;
+    }
+
+    return queue;
+}
+
+gboolean workqueue_start_slow_workers(workqueue_t* queue, guint n_slow_workers, workqueue_classifier_t is_slow,
+                                      void* user_data) {
+    guint n_others = queue->n_workers + queue->n_background_workers;
+    queue->workers = g_renew(pthread_t, queue->workers, n_others + n_slow_workers);
+    for (guint i = 0; i < n_slow_workers && start_worker(queue, FALSE, TRUE); i++);
+    if (queue->n_slow_workers == 0) {
+        return FALSE;
+    }
+
+    g_mutex_lock(&queue->mutex);
+    queue->classifier_user_data = user_data;
+    queue->is_slow = is_slow;
+    g_mutex_unlock(&queue->mutex);
+    return TRUE;
+}
+
+// the classifier may take its own locks, so it is called before the mutex is taken
+static struct job* classified_job_new(workqueue_t* queue, workqueue_job_type_t type, const char* path,
+                                      const char* old_path, gboolean background) {
+    struct job* job = job_new(type, path, old_path, background);
+    g_mutex_lock(&queue->mutex);
+    workqueue_classifier_t is_slow = queue->is_slow;
+    void* user_data = queue->classifier_user_data;
+    g_mutex_unlock(&queue->mutex);
+
+    job->slow = is_slow != NULL && is_slow(path, user_data);
+    return job;
+}
+
+void workqueue_push(workqueue_t* queue, workqueue_job_type_t type, const char* path) {
+    struct job* job = classified_job_new(queue, type, path, NULL, FALSE);
+
+    g_mutex_lock(&queue->mutex);
+    submit_locked(queue, job, TRUE);
+    g_mutex_unlock(&queue->mutex);
+}
+
+void workqueue_push_background(workqueue_t* queue, workqueue_job_type_t type, const char* path) {
+    struct job* job = classified_job_new(queue, type, path, NULL, TRUE);
+
+    g_mutex_lock(&queue->mutex);
+    submit_locked(queue, job, TRUE);
+    g_mutex_unlock(&queue->mutex);
+}
+
+void workqueue_push_sequential(workqueue_t* queue, workqueue_job_type_t type, const char* path, guint64 device,
+                               guint64 position) {
+    struct job* job = classified_job_new(queue, type, path, NULL, TRUE);
+    job->position = position;
+
+    g_mutex_lock(&queue->mutex);
+    // slow jobs are queued in the order they come anyway
+    if (!job->slow) {
+        job->lane = get_lane_locked(queue, device);
+    }
+    submit_locked(queue, job, TRUE);
+    g_mutex_unlock(&queue->mutex);
+}
+
+void workqueue_push_rename(workqueue_t* queue, const char* old_path, const char* path) {
+    // a file can only be moved within its file system, so both paths are of the same class
+    struct job* job = classified_job_new(queue, WORKQUEUE_JOB_RENAME, path, old_path, FALSE);
+
+    g_mutex_lock(&queue->mutex);
+    submit_locked(queue, job, TRUE);
+    g_mutex_unlock(&queue->mutex);
+}
+
+workqueue_batch_t* workqueue_batch_new(void) {
+    workqueue_batch_t* batch = g_new0(workqueue_batch_t, 1);
+    g_cond_init(&batch->done);
+    return batch;
+}
+
+void workqueue_push_batched(workqueue_t* queue, workqueue_batch_t* batch, workqueue_job_type_t type, const char* path) {
+    struct job* job = classified_job_new(queue, type, path, NULL, FALSE);
+    job->batches = g_slist_prepend(NULL, batch);
+
+    g_mutex_lock(&queue->mutex);
+    batch->remaining++;
+    submit_locked(queue, job, TRUE);
+    g_mutex_unlock(&queue->mutex);
+}
+
+void workqueue_batch_wait(workqueue_t* queue, workqueue_batch_t* batch) {
+    g_mutex_lock(&queue->mutex);
+    while (batch->remaining > 0) {
+        g_cond_wait(&batch->done, &queue->mutex);
+    }
+    g_mutex_unlock(&queue->mutex);
+}
+
+void workqueue_batch_free(workqueue_batch_t* batch) {
+    g_cond_clear(&batch->done);
+    g_free(batch);
+}
+
+void workqueue_wait_idle(workqueue_t* queue) {
+    g_mutex_lock(&queue->mutex);
+    while (!is_idle_locked(queue)) {
+        g_cond_wait(&queue->idle, &queue->mutex);
+    }
+    g_mutex_unlock(&queue->mutex);
+}
+
+guint workqueue_get_n_workers(workqueue_t* queue) {
+    return queue->n_workers;
+}
+
+guint workqueue_get_n_background_workers(workqueue_t* queue) {
+    return queue->n_background_workers;
+}
+
+guint workqueue_get_n_slow_workers(workqueue_t* queue) {
+    return queue->n_slow_workers;
+}
+
+guint workqueue_get_n_queued(workqueue_t* queue, gboolean background) {
+    g_mutex_lock(&queue->mutex);
+    guint n_queued = get_n_queued_locked(queue, background);
+    g_mutex_unlock(&queue->mutex);
+    return n_queued;
+}
+
+guint workqueue_get_n_queued_slow(workqueue_t* queue) {
+    g_mutex_lock(&queue->mutex);
+    guint n_queued = g_queue_get_length(&queue->slow_jobs);
+    g_mutex_unlock(&queue->mutex);
+    return n_queued;
+}
+
+void workqueue_free(workqueue_t* queue) {
+    if (queue == NULL) {
+        return;
+    }
+
+    g_mutex_lock(&queue->mutex);
+    queue->shutdown = TRUE;
+    g_cond_broadcast(&queue->not_empty);
+    g_cond_broadcast(&queue->not_full);
+    g_cond_broadcast(&queue->background_not_empty);
+    g_cond_broadcast(&queue->background_not_full);
+    g_cond_broadcast(&queue->slow_not_empty);
+    g_mutex_unlock(&queue->mutex);
+
+    for (guint i = 0; i < queue->n_workers + queue->n_background_workers + queue->n_slow_workers; i++) {
+        pthread_join(queue->workers[i], NULL);
+    }
+
+    // only reachable if not all kinds of workers could be started
+    struct job* job;
+    while ((job = g_queue_pop_head(&queue->jobs)) != NULL) {
+        finish_batches_locked(job);
+        job_free(job);
+    }
+    while ((job = g_queue_pop_head(&queue->background_jobs)) != NULL) {
+        finish_batches_locked(job);
+        job_free(job);
+    }
+    while ((job = g_queue_pop_head(&queue->slow_jobs)) != NULL) {
+        finish_batches_locked(job);
+        job_free(job);
+    }
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, queue->lanes);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        while ((job = g_queue_pop_head(&((struct lane*) value)->jobs)) != NULL) {
+            finish_batches_locked(job);
+            job_free(job);
+        }
+    }
+
+    g_hash_table_destroy(queue->pending);
+    g_hash_table_destroy(queue->running);
+    g_hash_table_destroy(queue->lanes);
+    g_cond_clear(&queue->not_empty);
+    g_cond_clear(&queue->not_full);
+    g_cond_clear(&queue->background_not_empty);
+    g_cond_clear(&queue->background_not_full);
+    g_cond_clear(&queue->slow_not_empty);
+    g_cond_clear(&queue->idle);
+    g_mutex_clear(&queue->mutex);
+    g_free(queue->workers);
+    g_free(queue);
+}
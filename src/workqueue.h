@@ -0,0 +1,99 @@
+#pragma once
+
+#include <glib.h>
+
+/* Bounded job queue processed by a fixed pool of worker threads.
+ *
+ * Jobs are keyed by path: pushing a path that is still waiting in the queue
+ * only updates the pending job, and pushing a path that a worker is currently
+ * processing defers the new job until that worker is done. Therefore, two jobs
+ * for the same path never run concurrently. Rename jobs hold both their old and
+ * their new path.
+ *
+ * Background jobs (completion jobs, and the jobs pushed by the initial scan) are
+ * run by a separate set of workers at a lower CPU and I/O priority, so that live
+ * events are always handled right away. A background job never replaces another
+ * job for the same path, while any other job replaces a background job.
+ *
+ * Sequential background jobs are grouped by the device their file is on, and only
+ * one of them runs per device at a time, in the order of their position on the
+ * device. This is meant for rotational disks, which read one stream of files in
+ * order much faster than several at random.
+ *
+ * Jobs for files on slow file systems, e.g., network mounts which may hang, can be
+ * given workers of their own (see workqueue_start_slow_workers()), so that they
+ * never occupy the workers or the queue slots of the other jobs. */
+
+typedef enum {
+    WORKQUEUE_JOB_REGISTER,
+    WORKQUEUE_JOB_UNREGISTER,
+    // the AppImage was moved from old_path to path
+    WORKQUEUE_JOB_RENAME,
+    // finish a registration, always a background job
+    WORKQUEUE_JOB_COMPLETE,
+} workqueue_job_type_t;
+
+// old_path is NULL for all jobs but WORKQUEUE_JOB_RENAME
+typedef void (*workqueue_handler_t)(workqueue_job_type_t type, const char* path, const char* old_path,
+                                    void* user_data);
+
+// whether the job for path is to be run by the slow workers
+typedef gboolean (*workqueue_classifier_t)(const char* path, void* user_data);
+
+typedef struct workqueue workqueue_t;
+
+/* Tracks the completion of a set of jobs. A job which is merged into another one
+ * for the same path is complete once the job it was merged into has run. */
+typedef struct workqueue_batch workqueue_batch_t;
+
+/* Create a queue served by n_workers threads (0 means one per CPU core) and n_background_workers threads
+ * for background jobs (0 means one per two CPU cores). Pushing blocks while capacity jobs are waiting. */
+workqueue_t* workqueue_new(guint n_workers, guint n_background_workers, guint capacity,
+                           workqueue_handler_t handler, void* user_data);
+
+/* Run the jobs for which is_slow returns TRUE on n_slow_workers threads of their own, foreground and background
+ * jobs alike, in the order they are pushed. Pushing them never blocks, so that no other thread ever waits for a
+ * slow file system; they wait in a list of their own instead, which isn't limited by the capacity. Meant to be
+ * called once, before jobs are pushed; returns FALSE if no thread could be started. */
+gboolean workqueue_start_slow_workers(workqueue_t* queue, guint n_slow_workers, workqueue_classifier_t is_slow,
+                                      void* user_data);
+
+void workqueue_push(workqueue_t* queue, workqueue_job_type_t type, const char* path);
+
+void workqueue_push_background(workqueue_t* queue, workqueue_job_type_t type, const char* path);
+
+/* Like workqueue_push_background(), but the job runs after the other sequential jobs for device which come
+ * before position (e.g., the inode number of the file), and not alongside any of them. */
+void workqueue_push_sequential(workqueue_t* queue, workqueue_job_type_t type, const char* path, guint64 device,
+                               guint64 position);
+
+void workqueue_push_rename(workqueue_t* queue, const char* old_path, const char* path);
+
+workqueue_batch_t* workqueue_batch_new(void);
+
+// like workqueue_push(), and add the job to batch
+void workqueue_push_batched(workqueue_t* queue, workqueue_batch_t* batch, workqueue_job_type_t type, const char* path);
+
+// blocks until all jobs in batch have run; more jobs can be added to the batch afterwards
+void workqueue_batch_wait(workqueue_t* queue, workqueue_batch_t* batch);
+
+// the batch must not have any jobs left which haven't run yet
+void workqueue_batch_free(workqueue_batch_t* batch);
+
+// blocks until the queue is empty and no worker is busy
+void workqueue_wait_idle(workqueue_t* queue);
+
+guint workqueue_get_n_workers(workqueue_t* queue);
+
+guint workqueue_get_n_background_workers(workqueue_t* queue);
+
+guint workqueue_get_n_slow_workers(workqueue_t* queue);
+
+// number of jobs waiting in the foreground or background queue, not counting running or deferred ones
+guint workqueue_get_n_queued(workqueue_t* queue, gboolean background);
+
+// number of jobs waiting for the slow workers
+guint workqueue_get_n_queued_slow(workqueue_t* queue);
+
+// finishes all queued jobs, then stops the workers and frees the queue
+void workqueue_free(workqueue_t* queue);
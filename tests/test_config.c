@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "config.h"
+
+/* Behaviour of the matching of paths against the configuration: the trie of excluded paths, "~/" expansion,
+ * name and path patterns, MaxDepth and config_may_allow_more(), along with the incremental checks done
+ * during a walk. A temporary directory serves as $HOME, with the root "Applications" in it. */
+
+static gchar* home_dir;
+static gchar* root_dir;
+
+// load a configuration from the lines given, with "@" replaced by the temporary home directory
+static config_t* load(const char* first_line, ...) {
+    GString* contents = g_string_new("[Watch]\n");
+    va_list lines;
+    va_start(lines, first_line);
+    for (const char* line = first_line; line != NULL; line = va_arg(lines, const char*)) {
+        for (const char* c = line; *c != '\0'; c++) {
+            if (*c == '@') {
+                g_string_append(contents, home_dir);
+            } else {
+                g_string_append_c(contents, *c);
+            }
+        }
+        g_string_append_c(contents, '\n');
+    }
+    va_end(lines);
+
+    gchar* path = g_build_filename(home_dir, "appimaged.conf", NULL);
+    g_assert_true(g_file_set_contents(path, contents->str, -1, NULL));
+    config_t* config = config_load(path);
+    g_assert_nonnull(config);
+
+    g_unlink(path);
+    g_free(path);
+    g_string_free(contents, TRUE);
+    return config;
+}
+
+// whether the path relative to the root is allowed, checked as a whole and incrementally, which have to agree
+static gboolean allows(const config_t* config, const char* relative_path, gboolean is_dir) {
+    gchar* path = g_build_filename(root_dir, relative_path, NULL);
+    gboolean allowed = config_allows(config, path, is_dir);
+
+    // walk down from the root like the scanner does, checking only the last component on every level
+    config_dir_t dir;
+    gboolean walk_allowed = config_locate(config, NULL, root_dir, &dir);
+    GString* walk_path = g_string_new(root_dir);
+    gchar** components = g_strsplit(relative_path, "/", -1);
+    for (gchar** component = components; *component != NULL && walk_allowed; component++) {
+        g_string_append_printf(walk_path, "/%s", *component);
+        gboolean is_last = component[1] == NULL;
+        config_dir_t child;
+        walk_allowed = config_allows_entry(config, &dir, walk_path->str, is_last ? is_dir : TRUE, &child);
+        dir = child;
+    }
+    g_strfreev(components);
+    g_string_free(walk_path, TRUE);
+
+    g_assert_cmpint(allowed, ==, walk_allowed);
+    g_free(path);
+    return allowed;
+}
+
+static void test_roots(void) {
+    config_t* config = load("Roots=~/Applications", NULL);
+
+    g_assert_cmpuint(config_get_roots(config)->len, ==, 1);
+    g_assert_true(config_is_root(config, root_dir));
+    g_assert_true(config_get_mount_applications(config));
+    g_assert_true(allows(config, "a/b/c/d/e", TRUE));
+    g_assert_true(allows(config, "a/b/c/d/e.AppImage", FALSE));
+    g_assert_true(config_allows(config, root_dir, TRUE));
+    g_assert_false(config_allows(config, home_dir, TRUE));
+
+    config_unref(config);
+}
+
+static void test_excluded_paths(void) {
+    config_t* config = load("Roots=@/Applications", "Exclude=@/Applications/excluded;@/Applications/a/b", NULL);
+
+    g_assert_false(allows(config, "excluded", TRUE));
+    g_assert_false(allows(config, "excluded/below", TRUE));
+    g_assert_false(allows(config, "excluded/below/file", FALSE));
+    // a path only shares a prefix with an excluded one if it has the same components
+    g_assert_true(allows(config, "excludedness", TRUE));
+    g_assert_true(allows(config, "excluded.AppImage", FALSE));
+    g_assert_true(allows(config, "a", TRUE));
+    g_assert_true(allows(config, "a/file", FALSE));
+    g_assert_false(allows(config, "a/b", TRUE));
+    g_assert_false(allows(config, "a/b/c", TRUE));
+    g_assert_true(allows(config, "a/bc", TRUE));
+    g_assert_true(allows(config, "x/a/b", TRUE));
+
+    config_unref(config);
+}
+
+static void test_home_expansion(void) {
+    config_t* config = load("Roots=~/Applications", "Exclude=~/Applications/skipped;~backup", NULL);
+
+    g_assert_true(config_is_root(config, root_dir));
+    g_assert_false(allows(config, "skipped", TRUE));
+    g_assert_false(allows(config, "skipped/file", FALSE));
+    g_assert_true(allows(config, "kept", TRUE));
+    // only a leading "~/" is expanded, anything else is a pattern like any other
+    g_assert_false(allows(config, "kept/~backup", TRUE));
+    g_assert_true(allows(config, "kept/backup", TRUE));
+
+    config_unref(config);
+}
+
+static void test_patterns(void) {
+    config_t* config = load("Roots=@/Applications",
+                            "Exclude=node_modules;.*;@/Applications/jdk-*;@/Applications/*/cache", NULL);
+
+    // patterns without "/" match the name of every directory and file below the root
+    g_assert_false(allows(config, "node_modules", TRUE));
+    g_assert_false(allows(config, "a/b/node_modules/c", TRUE));
+    g_assert_false(allows(config, ".hidden", TRUE));
+    g_assert_false(allows(config, "a/.hidden.AppImage", FALSE));
+    g_assert_true(allows(config, "a/visible.AppImage", FALSE));
+
+    // other patterns match the whole path, with "*" matching "/" as well
+    g_assert_false(allows(config, "jdk-11", TRUE));
+    g_assert_false(allows(config, "jdk-11/bin/java", FALSE));
+    g_assert_true(allows(config, "a/jdk-11", TRUE));
+    g_assert_false(allows(config, "a/cache", TRUE));
+    g_assert_false(allows(config, "a/b/cache", TRUE));
+    g_assert_true(allows(config, "cache", TRUE));
+    g_assert_true(allows(config, "a/cached", TRUE));
+
+    config_unref(config);
+}
+
+static void test_max_depth(void) {
+    config_t* config = load("Roots=@/Applications", "MaxDepth=1", NULL);
+
+    g_assert_true(allows(config, "a", TRUE));
+    g_assert_false(allows(config, "a/b", TRUE));
+    // files are allowed in the deepest directories which are watched
+    g_assert_true(allows(config, "file", FALSE));
+    g_assert_true(allows(config, "a/file", FALSE));
+    g_assert_false(allows(config, "a/b/file", FALSE));
+
+    config_unref(config);
+
+    config = load("Roots=@/Applications", "MaxDepth=0", NULL);
+    g_assert_false(allows(config, "a", TRUE));
+    g_assert_true(allows(config, "file", FALSE));
+    g_assert_false(allows(config, "a/file", FALSE));
+    config_unref(config);
+}
+
+static void test_mount_root(void) {
+    config_t* config = load("Roots=@/Applications", "Exclude=.*;@/mount/Applications/excluded", "MaxDepth=1", NULL);
+
+    gchar* mount_root = g_build_filename(home_dir, "mount", "Applications", NULL);
+    gchar* inside = g_build_filename(mount_root, "a", NULL);
+    gchar* hidden = g_build_filename(mount_root, ".a", NULL);
+    gchar* excluded = g_build_filename(mount_root, "excluded", NULL);
+    gchar* too_deep = g_build_filename(mount_root, "a", "b", NULL);
+    gchar* outside = g_build_filename(home_dir, "mount", "other", NULL);
+
+    g_assert_false(config_allows(config, inside, TRUE));
+    g_assert_true(config_allows_below(config, mount_root, inside, TRUE));
+    g_assert_false(config_allows_below(config, mount_root, hidden, TRUE));
+    g_assert_false(config_allows_below(config, mount_root, excluded, TRUE));
+    g_assert_false(config_allows_below(config, mount_root, too_deep, TRUE));
+    g_assert_false(config_allows_below(config, mount_root, outside, TRUE));
+
+    config_dir_t dir;
+    g_assert_true(config_locate(config, mount_root, inside, &dir));
+    g_assert_cmpint(dir.depth, ==, 1);
+    g_assert_false(config_allows_entry(config, &dir, too_deep, TRUE, NULL));
+    g_assert_false(config_locate(config, mount_root, outside, &dir));
+    g_assert_false(config_locate(config, NULL, inside, &dir));
+
+    g_free(outside);
+    g_free(too_deep);
+    g_free(excluded);
+    g_free(hidden);
+    g_free(inside);
+    g_free(mount_root);
+    config_unref(config);
+}
+
+static void test_may_allow_more(void) {
+    config_t* old_config = load("Roots=@/Applications", "MaxDepth=2", "Exclude=node_modules;@/Applications/a", NULL);
+    config_t* same = load("Roots=@/Applications", "MaxDepth=2", "Exclude=@/Applications/a;node_modules", NULL);
+    config_t* more_excluded = load("Roots=@/Applications", "MaxDepth=2",
+                                   "Exclude=node_modules;@/Applications/a;.*", NULL);
+    config_t* less_excluded = load("Roots=@/Applications", "MaxDepth=2", "Exclude=node_modules", NULL);
+    config_t* shallower = load("Roots=@/Applications", "MaxDepth=1", "Exclude=node_modules;@/Applications/a", NULL);
+    config_t* deeper = load("Roots=@/Applications", "MaxDepth=3", "Exclude=node_modules;@/Applications/a", NULL);
+    config_t* unlimited = load("Roots=@/Applications", "Exclude=node_modules;@/Applications/a", NULL);
+
+    g_assert_false(config_may_allow_more(old_config, same));
+    g_assert_false(config_may_allow_more(old_config, more_excluded));
+    g_assert_true(config_may_allow_more(old_config, less_excluded));
+    g_assert_false(config_may_allow_more(old_config, shallower));
+    g_assert_true(config_may_allow_more(old_config, deeper));
+    g_assert_true(config_may_allow_more(old_config, unlimited));
+    g_assert_false(config_may_allow_more(unlimited, old_config));
+
+    config_unref(unlimited);
+    config_unref(deeper);
+    config_unref(shallower);
+    config_unref(less_excluded);
+    config_unref(more_excluded);
+    config_unref(same);
+    config_unref(old_config);
+}
+
+int main(int argc, char** argv) {
+    // the home directory is looked up once, so it has to be replaced before anything else
+    home_dir = g_dir_make_tmp("appimaged-test-XXXXXX", NULL);
+    g_assert_nonnull(home_dir);
+    // the roots are resolved, so the paths have to be compared without symlinks
+    char* resolved = realpath(home_dir, NULL);
+    g_free(home_dir);
+    home_dir = g_strdup(resolved);
+    free(resolved);
+    g_setenv("HOME", home_dir, TRUE);
+
+    root_dir = g_build_filename(home_dir, "Applications", NULL);
+    g_mkdir(root_dir, 0700);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/config/roots", test_roots);
+    g_test_add_func("/config/excluded-paths", test_excluded_paths);
+    g_test_add_func("/config/home-expansion", test_home_expansion);
+    g_test_add_func("/config/patterns", test_patterns);
+    g_test_add_func("/config/max-depth", test_max_depth);
+    g_test_add_func("/config/mount-root", test_mount_root);
+    g_test_add_func("/config/may-allow-more", test_may_allow_more);
+    int result = g_test_run();
+
+    g_rmdir(root_dir);
+    g_rmdir(home_dir);
+    g_free(root_dir);
+    g_free(home_dir);
+    return result;
+}